@@ -0,0 +1,112 @@
+#include "pch.h"
+#include "alloc.h"
+
+#include <malloc.h>
+#include <new>
+
+// Replaces the global operator new and delete of the benchmark, see alloc.h
+
+namespace {
+
+   thread_local sAllocCount t_count;
+
+   void* allocate(size_t size, std::align_val_t align = std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__))
+   {
+      ++t_count.allocations;
+      t_count.bytes += size;
+      auto alignment = (size_t)align;
+      return alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__ ? _aligned_malloc(size ? size : 1, alignment) : malloc(size ? size : 1);
+   }
+
+   void release(void* p, std::align_val_t align = std::align_val_t(__STDCPP_DEFAULT_NEW_ALIGNMENT__))
+   {
+      if ((size_t)align > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+         _aligned_free(p);
+      }
+      else {
+         free(p);
+      }
+   }
+
+} // namespace
+
+sAllocCount allocCount()
+{
+   return t_count;
+}
+
+void* operator new(size_t size)
+{
+   if (auto p = allocate(size)) {
+      return p;
+   }
+   throw std::bad_alloc();
+}
+
+void* operator new[](size_t size)
+{
+   return operator new(size);
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+   if (auto p = allocate(size, align)) {
+      return p;
+   }
+   throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+   return operator new(size, align);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+   return allocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+   return allocate(size);
+}
+
+void operator delete(void* p) noexcept
+{
+   release(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+   release(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+   release(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+   release(p);
+}
+
+void operator delete(void* p, std::align_val_t align) noexcept
+{
+   release(p, align);
+}
+
+void operator delete[](void* p, std::align_val_t align) noexcept
+{
+   release(p, align);
+}
+
+void operator delete(void* p, size_t, std::align_val_t align) noexcept
+{
+   release(p, align);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t align) noexcept
+{
+   release(p, align);
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+
+// The benchmark replaces the global allocator with one that counts the calls and
+// bytes of every thread (alloc.cpp), so that the cost of a piece of the launch path
+// can be measured in allocations:
+//
+//    cAllocScope scope;
+//    config.makeConfig();
+//    auto cost = scope.count();
+//
+// Only the calling thread's allocations are counted.
+struct sAllocCount
+{
+   uint64_t allocations = 0;
+   uint64_t bytes = 0;
+};
+
+// Allocations of the calling thread since it started
+sAllocCount allocCount();
+
+class cAllocScope
+{
+public:
+   cAllocScope()
+      : m_start(allocCount())
+   {
+   }
+
+   sAllocCount count() const
+   {
+      auto now = allocCount();
+      return { now.allocations - m_start.allocations, now.bytes - m_start.bytes };
+   }
+
+private:
+   sAllocCount m_start;
+};
@@ -0,0 +1,1014 @@
+#include "pch.h"
+#include "utils.h"
+#include "alloc.h"
+#include "histogram.h"
+#include "lz4.h"
+#include "consumer.h"
+#include "replay.h"
+#include "soak.h"
+#include "selftest.h"
+#include "../server/output.h"
+#include "../server/sessions.h"
+
+#include <condition_variable>
+#include <deque>
+#include <random>
+
+// Launch-path benchmark. Runs the real hook, server and python_driver executables (found
+// next to this one) against cConsumer and prints one JSON document:
+//
+//    latency       spawn of a hook to its request read from the server's stdout, one at a time
+//    throughput    requests/s and latency with 1 to 512 hooks in flight
+//    workers       throughput with 256 hooks in flight against 1 to 16 server workers
+//    makeConfig    request construction cost against the size of the environment, per protocol version
+//    compression   raw against LZ4-compressed requests by environment size, and the break-even transfer rate
+//    sharedMemory  latency of a hook with a 64 KB to 16 MB environment, its request sent through the
+//                  launcher queue against its blocks left in shared memory (see shared.h)
+//    pythonDriver  passthrough overhead of python_driver over running the program directly
+//    allocations   heap allocations of the in-process parts of the launch path against their budgets
+//    sessionTree   building, querying and removing the server's session tree (server/sessions.h) of
+//                  100,000 sessions, half of them a single chain, the rest hung off random sessions
+//    attachOnExec  time to the first line of a debugged program, launched again by the debugger
+//                  against attached to where the hook started it (see hook.cpp)
+//    supervise     cost of a process start under hook --deep-debugger-supervise, none of them debugged
+//    zygote        time to the first line of a python program, cold against a warm interpreter,
+//                  only with --python (see python_driver/zygote.h)
+//
+//    bench [--only <scenario>] [--requests <count>] [--output <file>] [--check]
+//          [--python <interpreter> [--preload <modules>]] [-- <server arguments>]
+//
+// With --check the exit code is 2 when an allocation budget is exceeded.
+//
+// bench --replay replays captured traffic instead, see replay.cpp, bench --soak checks
+// the launch path for lost and damaged requests under load, see soak.cpp, and
+// bench --selftest against inputs that once broke it, see selftest.cpp.
+//
+// Times are in microseconds.
+
+namespace {
+
+   constexpr size_t s_concurrency[] = { 1, 8, 64, 512 };
+   constexpr size_t s_workers[] = { 1, 2, 4, 8, 16 };
+   constexpr size_t s_workers_concurrency = 256;
+   constexpr size_t s_env_sizes[] = { 1 << 10, 16 << 10, 256 << 10, 4 << 20 };
+   constexpr size_t s_payload_sizes[] = { 64 << 10, 256 << 10, 1 << 20, 4 << 20, 16 << 20 };
+   constexpr DWORD s_progress_timeout_ms = 10000;
+
+   // Allocations allowed for one call: fixed + per_item * items, the items are named with
+   // each budget. The budgets are the counts the allocations scenario reports for the
+   // current sources with some headroom; when a change is meant to allocate more, run
+   // bench --only allocations and set them again.
+   struct sAllocBudget
+   {
+      const TCHAR* name;
+      uint64_t fixed;
+      uint64_t per_item;
+   };
+
+   // Per protocol version. Version 1 encodes every environment variable and command line
+   // argument separately, version 2 copies them into its blocks: the items are both.
+   constexpr sAllocBudget s_make_config_budgets[] = {
+      { _T("makeConfig v1"), 40, 1 },
+      { _T("makeConfig v2"), 40, 0 },
+   };
+
+   // What the server does with the requests of one batch frame, per protocol version: the
+   // header it reads from every request (sRequestHeader) and the session ID it adds, then
+   // the frame. The items are the requests.
+   constexpr sAllocBudget s_server_frame_budgets[] = {
+      { _T("serverFrame v1"), 8, 4 },
+      { _T("serverFrame v2"), 8, 4 },
+   };
+   constexpr size_t s_server_frame_requests = 16;
+
+   // python_driver reading parent.cfg
+   constexpr sAllocBudget s_parent_config_budget = { _T("parentConfig"), 8, 0 };
+
+   fs::path selfPath()
+   {
+      TCHAR self[MAX_PATH];
+      GetModuleFileName(nullptr, self, MAX_PATH);
+      return self;
+   }
+
+   fs::path sibling(const TCHAR* name)
+   {
+      return selfPath().replace_filename(name);
+   }
+
+   // Starts a suspended process, so that it cannot run before it has been registered
+   bool spawnSuspended(string cmd, PROCESS_INFORMATION& pi)
+   {
+      STARTUPINFO si{};
+      si.cb = sizeof(si);
+      return CreateProcess(nullptr, cmd.data(), NULL, NULL, FALSE, CREATE_SUSPENDED, NULL, NULL, &si, &pi);
+   }
+
+   class cBench
+   {
+   public:
+      cBench(const string& server_args)
+         : m_server_args(server_args), m_consumer([this](const string_view& request, int64_t arrival_ns) { onRequest(request, arrival_ns); })
+      {
+         m_queue = fmt::format(_T("\\\\.\\pipe\\deepdbg-bench-{}"), _getpid());
+         m_hook_cmd = joins(quote(pathString(sibling(_T("hook.exe")))), quote(pathString(selfPath())), string(_T("--noop")));
+      }
+
+      bool start()
+      {
+         // The hooks inherit all of this
+         _tputenv(_T("DEEPDEBUGGER_RULES="));
+         _tputenv(_T("DEEPDEBUGGER_SESSION_ID=bench"));
+         SetEnvironmentVariable(_T("DEEPDEBUGGER_LAUNCHER_QUEUE"), m_queue.c_str());
+         if (!m_consumer.start(sibling(_T("server.exe")), m_queue, m_server_args)) {
+            return false;
+         }
+         SetEnvironmentVariable(_T("DEEPDEBUGGER_SERVER_PID"), fmt::format(_T("{}"), m_consumer.serverPid()).c_str());
+         return true;
+      }
+
+      string stop()
+      {
+         auto stats = m_consumer.stop();
+         return stats.empty() ? _T("null") : stats;
+      }
+
+      // Runs count hooks with at most concurrency of them in flight
+      string runHooks(size_t count, size_t concurrency)
+      {
+         {
+            std::lock_guard lock(m_mutex);
+            m_latency_us = std::make_unique<cHistogram>();
+            m_slots = CreateSemaphore(nullptr, (LONG)concurrency, (LONG)concurrency, nullptr);
+            m_received = 0;
+         }
+
+         size_t spawned = 0, failed = 0;
+         auto start_ns = nowNs();
+         for (; spawned < count; ++spawned) {
+            if (WaitForSingleObject(m_slots, s_progress_timeout_ms) != WAIT_OBJECT_0) {
+               ERROR("No progress with {} hooks in flight, giving up", concurrency);
+               break;
+            }
+            PROCESS_INFORMATION pi{};
+            auto spawn_ns = nowNs();
+            if (!spawnSuspended(m_hook_cmd, pi)) {
+               ERROR("Cannot start hook ({})", getErrorMessage());
+               ++failed;
+               ReleaseSemaphore(m_slots, 1, nullptr);
+               continue;
+            }
+            {
+               std::lock_guard lock(m_mutex);
+               m_spawned[pi.dwProcessId] = spawn_ns;
+            }
+            ResumeThread(pi.hThread);
+            CloseHandle(pi.hThread);
+            CloseHandle(pi.hProcess);
+         }
+
+         // Whatever has not arrived once the requests stop coming is lost
+         auto progress_ns = nowNs();
+         for (uint64_t seen = m_received; m_received < spawned - failed;) {
+            Sleep(10);
+            if (m_received != seen) {
+               seen = m_received;
+               progress_ns = nowNs();
+            }
+            else if (nowNs() - progress_ns > s_progress_timeout_ms * 1000000ll) {
+               break;
+            }
+         }
+         auto elapsed_ns = nowNs() - start_ns;
+
+         std::lock_guard lock(m_mutex);
+         CloseHandle(m_slots);
+         m_slots = nullptr;
+         auto lost = m_spawned.size();
+         m_spawned.clear();
+
+         uint64_t received = m_received;
+         return fmt::format(_T(R"({{"concurrency":{},"requests":{},"received":{},"lost":{},"failed":{},"elapsedUs":{},"requestsPerSec":{},"latencyUs":{}}})"),
+            concurrency, spawned, received, lost, failed, elapsed_ns / 1000, elapsed_ns ? received * 1000000000ull / elapsed_ns : 0, m_latency_us->json());
+      }
+
+   private:
+      void onRequest(const string_view& request, int64_t arrival_ns)
+      {
+         // The hook queue is named after the hook's process
+         auto hook_queue = findJsonString(request, _T("deepDbgHookPipe"));
+         auto pid = (DWORD)_ttoi(hook_queue.substr(hook_queue.rfind(_T('.')) + 1).c_str());
+
+         std::lock_guard lock(m_mutex);
+         auto it = m_spawned.find(pid);
+         if (it == m_spawned.end()) {
+            return;
+         }
+         m_latency_us->record((arrival_ns - it->second) / 1000);
+         m_spawned.erase(it);
+         ++m_received;
+         if (m_slots) {
+            ReleaseSemaphore(m_slots, 1, nullptr);
+         }
+      }
+
+      string m_server_args, m_queue, m_hook_cmd;
+      cConsumer m_consumer;
+
+      std::mutex m_mutex;
+      std::map<DWORD, int64_t> m_spawned;
+      std::unique_ptr<cHistogram> m_latency_us;
+      std::atomic<uint64_t> m_received = 0;
+      HANDLE m_slots = nullptr;
+   };
+
+   // Something like the search paths of conda and CUDA environments: directory lists with
+   // recurring parts, versions and hashes, about as compressible as the real ones
+   string pathLikeValue(size_t len, std::mt19937& rng)
+   {
+      static constexpr const TCHAR* parts[] = { _T("Users"), _T("dev"), _T("miniconda3"), _T("envs"), _T("Library"), _T("bin"),
+         _T("lib"), _T("site-packages"), _T("NVIDIA GPU Computing Toolkit"), _T("CUDA"), _T("include"), _T("Scripts"), _T("mingw-w64") };
+      string retval;
+      while (retval.size() < len) {
+         retval += _T("C:");
+         for (auto depth = 2 + rng() % 5; depth--;) {
+            retval += _T('\\');
+            retval += parts[rng() % std::size(parts)];
+            if (rng() % 4 == 0) {
+               retval += fmt::format(_T("-{}.{}"), rng() % 13, rng() % 10);
+            }
+         }
+         if (rng() % 3 == 0) {
+            retval += fmt::format(_T("\\{:08x}"), (uint32_t)rng());
+         }
+         retval += _T(';');
+      }
+      retval.resize(len);
+      return retval;
+   }
+
+   // Pads the environment to about the given size with variables of at most 16 KB,
+   // a single variable is limited to 32767 characters
+   void padEnvironment(size_t size, bool path_like = false)
+   {
+      static constexpr size_t chunk = 16 << 10;
+      static size_t s_padded = 0;
+
+      for (size_t idx = 0; idx < s_padded; ++idx) {
+         _tputenv(fmt::format(_T("DEEPDEBUGGER_BENCH_PAD{}="), idx).c_str());
+      }
+      s_padded = 0;
+
+      size_t current = 0;
+      for (TCHAR** s = _tenviron; *s; s++) {
+         current += 1 + _tcslen(*s);
+      }
+      for (; current < size; ++s_padded) {
+         auto len = std::min(chunk, size - current);
+         static std::mt19937 rng(1);
+         _tputenv(fmt::format(_T("DEEPDEBUGGER_BENCH_PAD{}={}"), s_padded, path_like ? pathLikeValue(len, rng) : string(len, _T('x'))).c_str());
+         current += len + 24;
+      }
+   }
+
+   string benchMakeConfig()
+   {
+      static constexpr int64_t budget_ns = 500000000;
+
+      string self = pathString(selfPath()), noop = _T("--noop");
+      TCHAR* args[] = { self.data(), noop.data() };
+
+      string retval;
+      for (int version = 1; version <= protocol::s_max_version; ++version) {
+         _tputenv(fmt::format(_T("DEEPDEBUGGER_PROTOCOL={}"), version).c_str());
+         for (auto size : s_env_sizes) {
+            padEnvironment(size);
+
+            cConfig config(_T(""), std::span(args));
+            cHistogram us;
+            size_t message_size = 0;
+            for (int64_t spent = 0; (us.count() < 5 || spent < budget_ns) && us.count() < 1000;) {
+               auto start_ns = nowNs();
+               message_size = config.makeConfig().size();
+               auto elapsed_ns = nowNs() - start_ns;
+               us.record(elapsed_ns / 1000);
+               spent += elapsed_ns;
+            }
+            retval += fmt::format(_T(R"({}{{"protocol":{},"envBytes":{},"messageBytes":{},"us":{}}})"), retval.empty() ? _T("") : _T(","), version, size, message_size, us.json());
+         }
+      }
+      _tputenv(_T("DEEPDEBUGGER_PROTOCOL="));
+      padEnvironment(0);
+      return join(_T("["sv), retval, _T("]"sv));
+   }
+
+   // Requests built raw and compressed (protocol 2) against the size of the environment. What
+   // compression costs is the hook's codec time plus the extension's decoding, stood in for by
+   // lz4::decompress; what it saves is carrying the difference through the pipe, the server
+   // and the extension's stdout reader. breakEvenMBps is the transfer rate of that path below
+   // which compressing wins.
+   string benchCompression()
+   {
+      static constexpr int64_t budget_ns = 500000000;
+
+      string self = pathString(selfPath()), noop = _T("--noop");
+      TCHAR* args[] = { self.data(), noop.data() };
+
+      string retval;
+      _tputenv(_T("DEEPDEBUGGER_PROTOCOL=2"));
+      for (auto size : s_env_sizes) {
+         padEnvironment(size, true);
+         cConfig config(_T(""), std::span(args));
+
+         auto measure = [&](bool compress, size_t& message_size) {
+            _tputenv(compress ? _T("DEEPDEBUGGER_COMPRESS=1") : _T("DEEPDEBUGGER_COMPRESS="));
+            auto us = std::make_unique<cHistogram>();
+            for (int64_t spent = 0; (us->count() < 5 || spent < budget_ns) && us->count() < 1000;) {
+               auto start_ns = nowNs();
+               message_size = config.makeConfig().size();
+               auto elapsed_ns = nowNs() - start_ns;
+               us->record(elapsed_ns / 1000);
+               spent += elapsed_ns;
+            }
+            return us;
+         };
+         size_t raw_size = 0, compressed_size = 0;
+         auto raw_us = measure(false, raw_size);
+         auto compressed_us = measure(true, compressed_size);
+
+         // The extension's side
+         auto request = config.makeConfig();
+         auto header = string_view(request).substr(0, request.find(_T('\0')));
+         auto block = std::string_view((const char*)request.data() + header.size() + 1, request.size() - header.size() - 1);
+         auto block_raw_size = (size_t)_ttoi64(findJsonString(header, _T("deepDbgRawSize")).c_str());
+         cHistogram decode_us;
+         bool decoded = true;
+         std::string blocks;
+         for (int64_t spent = 0; block_raw_size && decoded && (decode_us.count() < 5 || spent < budget_ns) && decode_us.count() < 1000;) {
+            auto start_ns = nowNs();
+            decoded = lz4::decompress(block, block_raw_size, blocks);
+            auto elapsed_ns = nowNs() - start_ns;
+            decode_us.record(elapsed_ns / 1000);
+            spent += elapsed_ns;
+         }
+
+         auto cost_us = (int64_t)compressed_us->percentile(50) - (int64_t)raw_us->percentile(50) + (int64_t)decode_us.percentile(50);
+         auto saved = (int64_t)raw_size - (int64_t)compressed_size;
+         retval += fmt::format(_T(R"({}{{"envBytes":{},"rawBytes":{},"compressedBytes":{},"ratio":{:.2f},"rawUs":{},"compressedUs":{},"decodeUs":{},"decoded":{},"breakEvenMBps":{:.1f}}})"),
+            retval.empty() ? _T("") : _T(","), size, raw_size, compressed_size, compressed_size ? (double)raw_size / compressed_size : 0.0,
+            raw_us->json(), compressed_us->json(), decode_us.json(), decoded && block_raw_size, saved > 0 && cost_us > 0 ? (double)saved / cost_us : 0.0);
+      }
+      _tputenv(_T("DEEPDEBUGGER_COMPRESS="));
+      _tputenv(_T("DEEPDEBUGGER_PROTOCOL="));
+      padEnvironment(0);
+      return join(_T("["sv), retval, _T("]"sv));
+   }
+
+   // One hook at a time, so that the latency is the transfer's and not the queue's. The hooks
+   // inherit the padded environment; the server's output statistics show the frames did not shrink.
+   string benchSharedMemory(const string& server_args, size_t count)
+   {
+      string retval;
+      _tputenv(_T("DEEPDEBUGGER_PROTOCOL=2"));
+      for (auto size : s_payload_sizes) {
+         padEnvironment(size);
+         for (bool shared : { false, true }) {
+            _tputenv(shared ? _T("DEEPDEBUGGER_SHARED_MEMORY=1") : _T("DEEPDEBUGGER_SHARED_MEMORY="));
+            cBench bench(server_args);
+            if (!bench.start()) {
+               continue;
+            }
+            auto run = bench.runHooks(count, 1);
+            retval += fmt::format(_T(R"({}{{"payloadBytes":{},"shared":{},"run":{},"server":{}}})"), retval.empty() ? _T("") : _T(","), size, shared, run, bench.stop());
+         }
+      }
+      _tputenv(_T("DEEPDEBUGGER_SHARED_MEMORY="));
+      _tputenv(_T("DEEPDEBUGGER_PROTOCOL="));
+      padEnvironment(0);
+      return join(_T("["sv), retval, _T("]"sv));
+   }
+
+   // Runs f once to warm up, then counts the allocations of a second run against the budget
+   template <typename F>
+   string measureAllocations(const sAllocBudget& budget, uint64_t items, bool& within_budget, F&& f)
+   {
+      f();
+      cAllocScope scope;
+      f();
+      auto count = scope.count();
+
+      auto allowed = budget.fixed + budget.per_item * items;
+      bool ok = count.allocations <= allowed;
+      if (!ok) {
+         ERROR("{} made {} allocations, its budget is {}", budget.name, count.allocations, allowed);
+         within_budget = false;
+      }
+      return fmt::format(_T(R"("{}":{{"allocations":{},"bytes":{},"items":{},"budget":{},"ok":{}}})"),
+         budget.name, count.allocations, count.bytes, items, allowed, ok);
+   }
+
+   // The server's handling of requests up to their frame, see handle and cBatcher in server.cpp
+   void handleRequests(const std::vector<string>& requests)
+   {
+      std::vector<string> pending;
+      pending.reserve(requests.size());
+      for (const auto& request : requests) {
+         string data = request;
+         sRequestHeader::read(data);
+         addSessionId(data, _T("bench.1"));
+         pending.push_back(std::move(data));
+      }
+      cFrameBuilder builder(0, pending.size());
+      for (const auto& data : pending) {
+         builder.add(data, nullptr);
+      }
+      size_t bytes;
+      builder.take(bytes);
+   }
+
+   string benchAllocations(bool& within_budget)
+   {
+      string self = pathString(selfPath()), noop = _T("--noop");
+      TCHAR* args[] = { self.data(), noop.data() };
+
+      uint64_t variables = 0;
+      for (TCHAR** s = _tenviron; *s; s++) {
+         ++variables;
+      }
+
+      std::vector<string> results;
+      for (int version = 1; version <= protocol::s_max_version; ++version) {
+         _tputenv(fmt::format(_T("DEEPDEBUGGER_PROTOCOL={}"), version).c_str());
+         cConfig config(_T(""), std::span(args));
+         results.push_back(measureAllocations(s_make_config_budgets[version - 1], variables + std::size(args), within_budget, [&] {
+            config.makeConfig();
+         }));
+
+         std::vector<string> requests(s_server_frame_requests, config.makeConfig());
+         results.push_back(measureAllocations(s_server_frame_budgets[version - 1], requests.size(), within_budget, [&] {
+            handleRequests(requests);
+         }));
+      }
+      _tputenv(_T("DEEPDEBUGGER_PROTOCOL="));
+
+      auto dir = fs::temp_directory_path() / _T("DeepDebugger");
+      std::error_code ec;
+      fs::create_directories(dir, ec);
+      auto parent_cfg = dir / fmt::format(_T("bench-{}.cfg"), _getpid());
+      std::ofstream(parent_cfg) << "home = " << selfPath().parent_path().string() << "\npath = " << selfPath().string() << "\n";
+      results.push_back(measureAllocations(s_parent_config_budget, 0, within_budget, [&] {
+         cFileContents fc;
+         fc.read(parent_cfg);
+         findValue(_T("path"), string_view(fc.begin(), fc.end()));
+      }));
+      fs::remove(parent_cfg, ec);
+
+      string retval;
+      for (const auto& result : results) {
+         retval += join(retval.empty() ? _T(""sv) : _T(","sv), result);
+      }
+      return join(_T("{"sv), retval, _T("}"sv));
+   }
+
+   string benchSessionTree(size_t runs)
+   {
+      constexpr size_t sessions = 100000;
+      cHistogram add_ns, depth_ns, remove_us;
+      std::mt19937 rng(1);
+      for (size_t run = 0; run < runs; ++run) {
+         cSessionTree tree;
+         std::vector<string> ids = { tree.add(_T("bench"), 0, string()) };
+         ids.reserve(sessions);
+         auto start_ns = nowNs();
+         while (ids.size() < sessions / 2) {
+            ids.push_back(tree.add(ids.back(), 0, string()));
+         }
+         while (ids.size() < sessions) {
+            ids.push_back(tree.add(ids[rng() % ids.size()], 0, string()));
+         }
+         add_ns.record((nowNs() - start_ns) / sessions);
+
+         start_ns = nowNs();
+         size_t deepest = 0;
+         for (const auto& id : ids) {
+            deepest = std::max(deepest, tree.depth(id));
+         }
+         depth_ns.record((nowNs() - start_ns) / sessions);
+
+         start_ns = nowNs();
+         auto removed = tree.remove(_T("bench")).size();
+         remove_us.record((nowNs() - start_ns) / 1000);
+         if (removed != sessions + 1 || deepest != sessions / 2) {
+            ERROR("Session tree removed {} of {} sessions, {} deep", removed, sessions + 1, deepest);
+         }
+      }
+      return fmt::format(_T(R"({{"sessions":{},"runs":{},"addNs":{},"depthNs":{},"removeUs":{}}})"),
+         sessions, runs, add_ns.json(), depth_ns.json(), remove_us.json());
+   }
+
+   string benchPythonDriver(size_t count)
+   {
+      // python_driver runs the interpreter named in parent.cfg next to it, here this program
+      auto dir = fs::temp_directory_path() / _T("DeepDebugger") / fmt::format(_T("bench-{}"), _getpid());
+      std::error_code ec;
+      fs::create_directories(dir, ec);
+      auto driver = dir / _T("python_driver.exe");
+      if (!fs::copy_file(sibling(_T("python_driver.exe")), driver, fs::copy_options::overwrite_existing, ec)) {
+         ERROR("Cannot copy python_driver to {} ({})", dir.string(), ec.message());
+         return _T("null");
+      }
+      std::ofstream(dir / _T("parent.cfg")) << "path=" << selfPath().string() << "\n";
+
+      auto run = [count](const string& cmd) {
+         auto us = std::make_unique<cHistogram>();
+         for (size_t i = 0; i < count; ++i) {
+            auto start_ns = nowNs();
+            execute(cmd);
+            us->record((nowNs() - start_ns) / 1000);
+         }
+         return us;
+      };
+      auto direct = run(joins(quote(pathString(selfPath())), string(_T("--noop"))));
+      auto driven = run(joins(quote(pathString(driver)), string(_T("--noop"))));
+      fs::remove_all(dir, ec);
+
+      return fmt::format(_T(R"({{"runs":{},"directUs":{},"driverUs":{},"overheadUsP50":{}}})"),
+         count, direct->json(), driven->json(), (int64_t)driven->percentile(50) - (int64_t)direct->percentile(50));
+   }
+
+   // The first line stands in for the first breakpoint, the debugger attaches right before it
+   constexpr auto s_first_line_script = R"py(import os, sys, time
+import debugpy
+for name in filter(None, os.environ.get('DEEPDEBUGGER_PYTHON_PRELOAD', '').split(',')):
+    __import__(name.strip())
+with open(sys.argv[1], 'w') as f:
+    f.write(str(time.perf_counter_ns()))
+)py"sv;
+
+   // Stands in for the debug session attaching to a zygote, the way the debugpy adapter does
+   // for an attach by process ID: injects debugpy, connects and completes the configuration.
+   //
+   //    python attach.py <python> <pid> <port>
+   constexpr auto s_attach_script = R"py(import json, socket, subprocess, sys, time
+python, pid, port = sys.argv[1], sys.argv[2], int(sys.argv[3])
+subprocess.run([python, '-m', 'debugpy', '--listen', '127.0.0.1:%d' % port, '--pid', pid], check=True)
+for _ in range(1000):
+    try:
+        client = socket.create_connection(('127.0.0.1', port))
+        break
+    except OSError:
+        time.sleep(0.01)
+else:
+    sys.exit(1)
+for seq, (command, arguments) in enumerate((('initialize', {'adapterID': 'debugpy'}), ('attach', {}), ('configurationDone', {})), 1):
+    body = json.dumps({'seq': seq, 'type': 'request', 'command': command, 'arguments': arguments}).encode()
+    client.sendall(b'Content-Length: %d\r\n\r\n' % len(body) + body)
+# Held until the program is over, as a debug session is
+while client.recv(65536):
+    pass
+)py"sv;
+
+   // Waits for the script's timestamp, perf_counter_ns is QPC time like nowNs
+   int64_t firstLineNs(const fs::path& out, DWORD timeout_ms)
+   {
+      for (auto deadline = GetTickCount64() + timeout_ms;; Sleep(1)) {
+         int64_t ns = 0;
+         if (std::ifstream(out) >> ns) {
+            return ns;
+         }
+         if (GetTickCount64() > deadline) {
+            return 0;
+         }
+      }
+   }
+
+   // Stands in for the debugger: continues every event of the debuggee until it exits
+   void debugUntilExit()
+   {
+      DEBUG_EVENT ev{};
+      while (WaitForDebugEvent(&ev, INFINITE)) {
+         DWORD status = DBG_CONTINUE;
+         switch (ev.dwDebugEventCode) {
+         case CREATE_PROCESS_DEBUG_EVENT:
+            if (ev.u.CreateProcessInfo.hFile) {
+               CloseHandle(ev.u.CreateProcessInfo.hFile);
+            }
+            break;
+         case LOAD_DLL_DEBUG_EVENT:
+            if (ev.u.LoadDll.hFile) {
+               CloseHandle(ev.u.LoadDll.hFile);
+            }
+            break;
+         case EXCEPTION_DEBUG_EVENT:
+            if (ev.u.Exception.ExceptionRecord.ExceptionCode != EXCEPTION_BREAKPOINT) {
+               status = DBG_EXCEPTION_NOT_HANDLED;
+            }
+            break;
+         }
+         ContinueDebugEvent(ev.dwProcessId, ev.dwThreadId, status);
+         if (ev.dwDebugEventCode == EXIT_PROCESS_DEBUG_EVENT) {
+            return;
+         }
+      }
+   }
+
+   // A parameter added with cConfig::add, in either protocol
+   string requestParam(const string_view& request, const string& key)
+   {
+      auto header_end = request.find(_T('\0'));
+      if (header_end == string_view::npos) {
+         string value;
+         auto encoded = findJsonString(request, key);
+         return encoded.empty() || !base64::Decode(encoded, value).empty() ? string() : value;
+      }
+      auto blocks = request.substr(header_end + 1);
+      protocol::readBlock(blocks);
+      for (auto params = protocol::readBlock(blocks); !params.empty();) {
+         auto param = readUntil(params, _T('\0'));
+         if (readUntil(param, _T('=')) == key) {
+            return string(param);
+         }
+      }
+      return string();
+   }
+
+   // This program plays both the extension and the debugger: on each request it either
+   // launches the program under its debug loop or attaches the loop to the process named in it
+   string benchAttachOnExec(size_t count)
+   {
+      static constexpr DWORD timeout_ms = 10000;
+
+      auto dir = fs::temp_directory_path() / _T("DeepDebugger");
+      std::error_code ec;
+      fs::create_directories(dir, ec);
+      auto stamp = dir / fmt::format(_T("bench-stamp-{}.txt"), _getpid());
+
+      std::mutex mutex;
+      std::condition_variable arrived;
+      std::deque<DWORD> requests;
+      cConsumer consumer([&](const string_view& request, int64_t) {
+         auto pid = requestParam(request, _T("processId"));
+         std::lock_guard lock(mutex);
+         requests.push_back(pid.empty() ? 0 : (DWORD)_ttoi(pid.c_str()));
+         arrived.notify_one();
+      });
+      auto queue = fmt::format(_T("\\\\.\\pipe\\deepdbg-bench-attach-{}"), _getpid());
+      _tputenv(_T("DEEPDEBUGGER_RULES="));
+      _tputenv(_T("DEEPDEBUGGER_SESSION_ID=bench"));
+      SetEnvironmentVariable(_T("DEEPDEBUGGER_LAUNCHER_QUEUE"), queue.c_str());
+      if (!consumer.start(sibling(_T("server.exe")), queue)) {
+         return _T("null");
+      }
+      SetEnvironmentVariable(_T("DEEPDEBUGGER_SERVER_PID"), fmt::format(_T("{}"), consumer.serverPid()).c_str());
+
+      auto program_cmd = joins(quote(pathString(selfPath())), string(_T("--stamp")), quote(pathString(stamp)));
+      auto hook_cmd = joins(quote(pathString(sibling(_T("hook.exe")))), program_cmd);
+
+      auto run = [&](bool attach) {
+         _tputenv(attach ? _T("DEEPDEBUGGER_ATTACH_ON_EXEC=1") : _T("DEEPDEBUGGER_ATTACH_ON_EXEC="));
+         auto us = std::make_unique<cHistogram>();
+         for (size_t i = 0; i < count; ++i) {
+            fs::remove(stamp, ec);
+            PROCESS_INFORMATION hook{};
+            auto start_ns = nowNs();
+            if (!spawnSuspended(hook_cmd, hook)) {
+               ERROR("Cannot start hook ({})", getErrorMessage());
+               break;
+            }
+            ResumeThread(hook.hThread);
+
+            DWORD pid = 0;
+            bool received = false;
+            {
+               std::unique_lock lock(mutex);
+               if ((received = arrived.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&] { return !requests.empty(); }))) {
+                  pid = requests.front();
+                  requests.pop_front();
+               }
+            }
+            bool debugging = false;
+            if (received && pid) {
+               debugging = DebugActiveProcess(pid);
+            }
+            else if (received) {
+               STARTUPINFO si{};
+               si.cb = sizeof(si);
+               PROCESS_INFORMATION program{};
+               string cmd = program_cmd;
+               if ((debugging = CreateProcess(nullptr, cmd.data(), NULL, NULL, FALSE, DEBUG_ONLY_THIS_PROCESS, NULL, NULL, &si, &program))) {
+                  CloseHandle(program.hThread);
+                  CloseHandle(program.hProcess);
+               }
+            }
+            if (debugging) {
+               debugUntilExit();
+            }
+            WaitForSingleObject(hook.hProcess, timeout_ms);
+            CloseHandle(hook.hThread);
+            CloseHandle(hook.hProcess);
+
+            if (auto ns = firstLineNs(stamp, 0)) {
+               us->record((ns - start_ns) / 1000);
+            }
+         }
+         return us;
+      };
+      auto relaunched = run(false);
+      auto attached = run(true);
+      _tputenv(_T("DEEPDEBUGGER_ATTACH_ON_EXEC="));
+      consumer.stop();
+      fs::remove(stamp, ec);
+
+      return fmt::format(_T(R"({{"runs":{},"relaunchUs":{},"attachUs":{},"savedUsP50":{}}})"),
+         count, relaunched->json(), attached->json(), (int64_t)relaunched->percentile(50) - (int64_t)attached->percentile(50));
+   }
+
+   // Starts this program with --noop count times, one after the other, and writes the time taken
+   int spawnNoops(size_t count, const fs::path& out)
+   {
+      string cmd = joins(quote(pathString(selfPath())), string(_T("--noop")));
+      auto start_ns = nowNs();
+      for (size_t i = 0; i < count; ++i) {
+         if (execute(cmd) != 0) {
+            return -1;
+         }
+      }
+      std::ofstream(out) << nowNs() - start_ns;
+      return 0;
+   }
+
+   // The same starts run directly and in a supervised tree whose rules debug nothing, so every
+   // start is reported, suspended, inspected and resumed
+   string benchSupervise(size_t count)
+   {
+      static constexpr size_t rounds = 5;
+      static constexpr DWORD timeout_ms = 60000;
+
+      auto dir = fs::temp_directory_path() / _T("DeepDebugger");
+      std::error_code ec;
+      fs::create_directories(dir, ec);
+      auto stamp = dir / fmt::format(_T("bench-spawn-{}.txt"), _getpid());
+      auto rules = dir / fmt::format(_T("bench-rules-{}.txt"), _getpid());
+      std::ofstream(rules) << "default skip\n";
+      SetEnvironmentVariable(_T("DEEPDEBUGGER_RULES"), pathString(rules).c_str());
+
+      auto spawner = joins(quote(pathString(selfPath())), string(_T("--spawn")), fmt::format(_T("{}"), count), quote(pathString(stamp)));
+      auto run = [&](const string& cmd) {
+         auto ns_per_exec = std::make_unique<cHistogram>();
+         for (size_t round = 0; round < rounds; ++round) {
+            fs::remove(stamp, ec);
+            PROCESS_INFORMATION pi{};
+            if (!spawnSuspended(cmd, pi)) {
+               ERROR("Cannot start {} ({})", cmd, getErrorMessage());
+               break;
+            }
+            ResumeThread(pi.hThread);
+            WaitForSingleObject(pi.hProcess, timeout_ms);
+            CloseHandle(pi.hThread);
+            CloseHandle(pi.hProcess);
+            if (auto ns = firstLineNs(stamp, 0)) {
+               ns_per_exec->record(ns / count);
+            }
+         }
+         return ns_per_exec;
+      };
+      auto direct = run(spawner);
+      auto supervised = run(joins(quote(pathString(sibling(_T("hook.exe")))), string(_T("--deep-debugger-supervise")), spawner));
+      _tputenv(_T("DEEPDEBUGGER_RULES="));
+      fs::remove(stamp, ec);
+      fs::remove(rules, ec);
+
+      return fmt::format(_T(R"({{"execs":{},"rounds":{},"directNsPerExec":{},"supervisedNsPerExec":{},"overheadUsP50":{:.1f}}})"),
+         count, rounds, direct->json(), supervised->json(), ((int64_t)supervised->percentile(50) - (int64_t)direct->percentile(50)) / 1000.0);
+   }
+
+   string benchZygote(const string& python, const string& preload, size_t count)
+   {
+      static constexpr DWORD miss_timeout_ms = 30000;
+      static constexpr size_t max_misses = 100;
+      static constexpr int first_port = 5710;
+
+      auto dir = fs::temp_directory_path() / _T("DeepDebugger") / fmt::format(_T("bench-zygote-{}"), _getpid());
+      std::error_code ec;
+      fs::create_directories(dir, ec);
+      auto driver = dir / _T("python_driver.exe");
+      if (!fs::copy_file(sibling(_T("python_driver.exe")), driver, fs::copy_options::overwrite_existing, ec)) {
+         ERROR("Cannot copy python_driver to {} ({})", dir.string(), ec.message());
+         return _T("null");
+      }
+      std::ofstream(dir / _T("parent.cfg")) << "path=" << python << "\n";
+      auto script = dir / _T("first_line.py"), out = dir / _T("first_line.txt");
+      std::ofstream(script, std::ios::binary) << s_first_line_script;
+      auto attach = dir / _T("attach.py");
+      std::ofstream(attach, std::ios::binary) << s_attach_script;
+
+      _tputenv(fmt::format(_T("DEEPDEBUGGER_PYTHON_PRELOAD={}"), preload).c_str());
+      auto script_args = joins(quote(pathString(script)), quote(pathString(out)));
+
+      cHistogram cold_us;
+      for (size_t i = 0; i < count; ++i) {
+         fs::remove(out, ec);
+         auto start_ns = nowNs();
+         execute(joins(quote(python), script_args));
+         if (auto ns = firstLineNs(out, 0)) {
+            cold_us.record((ns - start_ns) / 1000);
+         }
+      }
+
+      // The driver hands the program to a zygote and returns, the zygote runs it once a
+      // client attaches: the warm time includes debugpy's attach, as a session's does.
+      // Without a zygote the program would be left to the debug session, which the consumer
+      // does not start. The first run is such a miss, it starts the zygote. The last zygote
+      // is left to its idle timeout.
+      cHistogram warm_us;
+      size_t misses = 0;
+      std::mutex mutex;
+      std::vector<HANDLE> clients;
+      int port = first_port;
+      {
+         cConsumer consumer([&](const string_view& request, int64_t) {
+            auto pid = requestParam(request, _T("processId"));
+            if (pid.empty()) {
+               return;
+            }
+            std::lock_guard lock(mutex);
+            string cmd = joins(quote(python), quote(pathString(attach)), quote(python), pid, fmt::format(_T("{}"), port++));
+            STARTUPINFO si{};
+            si.cb = sizeof(si);
+            PROCESS_INFORMATION pi{};
+            if (!CreateProcess(nullptr, cmd.data(), NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) {
+               ERROR("Cannot attach to zygote {} ({})", pid, getErrorMessage());
+               return;
+            }
+            CloseHandle(pi.hThread);
+            clients.push_back(pi.hProcess);
+         });
+         auto queue = fmt::format(_T("\\\\.\\pipe\\deepdbg-bench-zygote-{}"), _getpid());
+         _tputenv(_T("DEEPDEBUGGER_RULES="));
+         _tputenv(_T("DEEPDEBUGGER_SESSION_ID=bench"));
+         _tputenv(_T("DEEPDEBUGGER_PYTHON_ZYGOTE=1"));
+         SetEnvironmentVariable(_T("DEEPDEBUGGER_LAUNCHER_QUEUE"), queue.c_str());
+         if (!consumer.start(sibling(_T("server.exe")), queue)) {
+            fs::remove_all(dir, ec);
+            return _T("null");
+         }
+         SetEnvironmentVariable(_T("DEEPDEBUGGER_SERVER_PID"), fmt::format(_T("{}"), consumer.serverPid()).c_str());
+
+         auto cmd = joins(quote(pathString(driver)), script_args, string(_T("--connect")));
+         while (warm_us.count() < count && misses < max_misses) {
+            fs::remove(out, ec);
+            auto start_ns = nowNs();
+            execute(cmd);
+            if (auto ns = firstLineNs(out, miss_timeout_ms)) {
+               warm_us.record((ns - start_ns) / 1000);
+            }
+            else {
+               ++misses;
+            }
+         }
+         consumer.stop();
+         _tputenv(_T("DEEPDEBUGGER_PYTHON_ZYGOTE="));
+      }
+      for (auto client : clients) {
+         if (WaitForSingleObject(client, miss_timeout_ms) != WAIT_OBJECT_0) {
+            TerminateProcess(client, 1);
+         }
+         CloseHandle(client);
+      }
+      fs::remove_all(dir, ec);
+
+      return fmt::format(_T(R"({{"runs":{},"coldUs":{},"warmUs":{},"misses":{},"savedUsP50":{}}})"),
+         count, cold_us.json(), warm_us.json(), misses, (int64_t)cold_us.percentile(50) - (int64_t)warm_us.percentile(50));
+   }
+
+} // namespace
+
+int _tmain(int argc, TCHAR* argv[])
+{
+   if (argc > 1 && argv[1] == _T("--noop"sv)) {
+      return 0;
+   }
+   if (argc > 3 && argv[1] == _T("--spawn"sv)) {
+      return spawnNoops((size_t)_ttoi(argv[2]), argv[3]);
+   }
+   if (argc > 2 && argv[1] == _T("--stamp"sv)) {
+      std::ofstream(argv[2]) << nowNs();
+      return 0;
+   }
+
+   if (auto log = _tgetenv(_T("DEEPDEBUGGER_LOGFILE"))) {
+      ENABLE_LOGGING(log, _T("bench"));
+   }
+
+   if (argc > 2 && argv[1] == _T("--replay"sv)) {
+      return replay(sibling(_T("server.exe")), argv[2], argc - 3, argv + 3);
+   }
+   if (argc > 1 && argv[1] == _T("--soak"sv)) {
+      return soak(sibling(_T("server.exe")), sibling(_T("hook.exe")), argc - 2, argv + 2);
+   }
+   if (argc > 1 && argv[1] == _T("--selftest"sv)) {
+      return selftest(argc - 2, argv + 2);
+   }
+
+   string only, output, server_args, python, preload;
+   size_t requests = 1000;
+   bool check = false;
+   for (int idx = 1; idx < argc; ++idx) {
+      if (argv[idx] == _T("--only"sv) && idx + 1 < argc) {
+         only = argv[++idx];
+      }
+      else if (argv[idx] == _T("--requests"sv) && idx + 1 < argc) {
+         requests = (size_t)_ttoi64(argv[++idx]);
+      }
+      else if (argv[idx] == _T("--output"sv) && idx + 1 < argc) {
+         output = argv[++idx];
+      }
+      else if (argv[idx] == _T("--python"sv) && idx + 1 < argc) {
+         python = argv[++idx];
+      }
+      else if (argv[idx] == _T("--preload"sv) && idx + 1 < argc) {
+         preload = argv[++idx];
+      }
+      else if (argv[idx] == _T("--check"sv)) {
+         check = true;
+      }
+      else if (argv[idx] == _T("--"sv)) {
+         while (++idx < argc) {
+            server_args = server_args.empty() ? string(argv[idx]) : joins(server_args, string(argv[idx]));
+         }
+      }
+   }
+   auto enabled = [&only](const TCHAR* name) { return only.empty() || only == name; };
+
+   std::vector<string> results;
+   if (enabled(_T("latency")) || enabled(_T("throughput"))) {
+      cBench bench(server_args);
+      if (!bench.start()) {
+         return 1;
+      }
+      if (enabled(_T("latency"))) {
+         results.push_back(join(_T(R"("latency":)"sv), bench.runHooks(requests, 1)));
+      }
+      if (enabled(_T("throughput"))) {
+         string levels;
+         for (auto concurrency : s_concurrency) {
+            levels += join(levels.empty() ? _T(""sv) : _T(","sv), bench.runHooks(std::max(requests, 2 * concurrency), concurrency));
+         }
+         results.push_back(join(_T(R"("throughput":[)"sv), levels, _T("]"sv)));
+      }
+      results.push_back(join(_T(R"("server":)"sv), bench.stop()));
+   }
+   if (enabled(_T("workers"))) {
+      string levels;
+      for (auto workers : s_workers) {
+         auto args = fmt::format(_T("--deep-debugger-workers {}"), workers);
+         cBench bench(server_args.empty() ? args : joins(server_args, args));
+         if (!bench.start()) {
+            return 1;
+         }
+         auto run = bench.runHooks(std::max(requests, 2 * s_workers_concurrency), s_workers_concurrency);
+         levels += fmt::format(_T(R"({}{{"workers":{},"run":{},"server":{}}})"), levels.empty() ? _T("") : _T(","), workers, run, bench.stop());
+      }
+      results.push_back(join(_T(R"("workers":[)"sv), levels, _T("]"sv)));
+   }
+   if (enabled(_T("makeConfig"))) {
+      results.push_back(join(_T(R"("makeConfig":)"sv), benchMakeConfig()));
+   }
+   if (enabled(_T("compression"))) {
+      results.push_back(join(_T(R"("compression":)"sv), benchCompression()));
+   }
+   if (enabled(_T("sharedMemory"))) {
+      results.push_back(join(_T(R"("sharedMemory":)"sv), benchSharedMemory(server_args, std::min<size_t>(requests, 50))));
+   }
+   if (enabled(_T("pythonDriver"))) {
+      results.push_back(join(_T(R"("pythonDriver":)"sv), benchPythonDriver(std::min<size_t>(requests, 200))));
+   }
+   bool within_budget = true;
+   if (enabled(_T("allocations"))) {
+      results.push_back(join(_T(R"("allocations":)"sv), benchAllocations(within_budget)));
+   }
+   if (enabled(_T("sessionTree"))) {
+      results.push_back(join(_T(R"("sessionTree":)"sv), benchSessionTree(std::min<size_t>(requests, 10))));
+   }
+   if (enabled(_T("attachOnExec"))) {
+      results.push_back(join(_T(R"("attachOnExec":)"sv), benchAttachOnExec(std::min<size_t>(requests, 100))));
+   }
+   if (enabled(_T("supervise"))) {
+      results.push_back(join(_T(R"("supervise":)"sv), benchSupervise(std::min<size_t>(requests, 200))));
+   }
+   if (enabled(_T("zygote")) && !python.empty()) {
+      results.push_back(join(_T(R"("zygote":)"sv), benchZygote(python, preload, std::min<size_t>(requests, 50))));
+   }
+
+   string report = _T("{");
+   for (const auto& result : results) {
+      report += join(report.size() > 1 ? _T(","sv) : _T(""sv), result);
+   }
+   report += _T("}\n");
+
+   fmt::print(_T("{}"), report);
+   if (!output.empty()) {
+      std::ofstream(output) << report;
+   }
+   return check && !within_budget ? 2 : 0;
+}
@@ -0,0 +1,175 @@
+#include "pch.h"
+#include "consumer.h"
+#include "histogram.h"
+
+#include <psapi.h>
+
+cConsumer::~cConsumer()
+{
+   if (m_process) {
+      stop();
+   }
+}
+
+size_t cConsumer::serverWorkingSet() const
+{
+   PROCESS_MEMORY_COUNTERS counters{};
+   counters.cb = sizeof(counters);
+   return m_process && GetProcessMemoryInfo(m_process, &counters, sizeof(counters)) ? counters.WorkingSetSize : 0;
+}
+
+bool cConsumer::start(const fs::path& server, const string& queue, const string& args)
+{
+   m_queue = queue;
+
+   SECURITY_ATTRIBUTES sa{};
+   sa.nLength = sizeof(sa);
+   sa.bInheritHandle = TRUE;
+   HANDLE write_end = nullptr;
+   if (!CreatePipe(&m_stdout, &write_end, &sa, 1 << 20)) {
+      ERROR("Cannot create server output pipe ({})", getErrorMessage());
+      return false;
+   }
+   SetHandleInformation(m_stdout, HANDLE_FLAG_INHERIT, 0);
+
+   STARTUPINFO si{};
+   si.cb = sizeof(si);
+   si.dwFlags = STARTF_USESTDHANDLES;
+   si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+   si.hStdOutput = write_end;
+   si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+   PROCESS_INFORMATION pi{};
+   string cmd = joins(quote(pathString(server)), quote(queue), string(args));
+   LOG("Starting {}", cmd);
+   bool started = CreateProcess(nullptr, cmd.data(), NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi);
+   CloseHandle(write_end);
+   if (!started) {
+      ERROR("Cannot start {} ({})", cmd, getErrorMessage());
+      CloseHandle(m_stdout);
+      m_stdout = nullptr;
+      return false;
+   }
+   CloseHandle(pi.hThread);
+   m_process = pi.hProcess;
+   m_pid = pi.dwProcessId;
+
+   m_thread = std::thread(&cConsumer::run, this);
+
+   for (int attempt = 0; attempt < 500; ++attempt) {
+      if (WaitNamedPipe(queue.c_str(), 10)) {
+         return true;
+      }
+      if (WaitForSingleObject(m_process, 0) == WAIT_OBJECT_0) {
+         break;
+      }
+      Sleep(10);
+   }
+   ERROR("Server is not listening on {}", queue);
+   return false;
+}
+
+string cConsumer::stop()
+{
+   if (!m_process) {
+      return m_stats;
+   }
+   if (!writeQueue(m_queue, _T("stopped"))) {
+      ERROR("Cannot stop the server ({})", getErrorMessage());
+      TerminateProcess(m_process, 1);
+   }
+   if (WaitForSingleObject(m_process, 10000) != WAIT_OBJECT_0) {
+      ERROR("Server did not exit, terminating");
+      TerminateProcess(m_process, 1);
+   }
+   if (m_thread.joinable()) {
+      m_thread.join();
+   }
+   CloseHandle(m_process);
+   CloseHandle(m_stdout);
+   m_process = m_stdout = nullptr;
+   return m_stats;
+}
+
+namespace {
+
+   // Splits the frame at pos into its fields, returns the position after it, npos while it is
+   // incomplete. A field =<n> announces a protocol 2 request of n characters, see cBatcher.
+   size_t splitFrame(const string& data, size_t pos, std::vector<string_view>& fields)
+   {
+      fields.clear();
+      while (pos < data.size() && _istspace(data[pos])) {
+         ++pos;
+      }
+      while (true) {
+         if (!fields.empty() && data.compare(pos, 3, _T("end")) == 0) {
+            return pos + 3;
+         }
+         auto sep = data.find(_T('|'), pos);
+         if (sep == string::npos) {
+            return string::npos;
+         }
+         string_view field(data.data() + pos, sep - pos);
+         pos = sep + 1;
+         if (!fields.empty() && field.starts_with(_T('='))) {
+            size_t len = 0;
+            for (auto c : field.substr(1)) {
+               len = len * 10 + (c - _T('0'));
+            }
+            if (pos + len >= data.size()) {
+               return string::npos;
+            }
+            field = string_view(data.data() + pos, len);
+            pos += len + 1;
+         }
+         fields.push_back(field);
+      }
+   }
+
+} // namespace
+
+void cConsumer::run()
+{
+   std::vector<char> buf(1 << 20);
+   std::vector<string_view> fields;
+   string data;
+   DWORD rlen = 0;
+   while (ReadFile(m_stdout, buf.data(), (DWORD)buf.size(), &rlen, nullptr) && rlen) {
+      auto arrival_ns = nowNs();
+      data.append((const TCHAR*)buf.data(), rlen / sizeof(TCHAR));
+
+      size_t pos = 0;
+      for (size_t next; (next = splitFrame(data, pos, fields)) != string::npos; pos = next) {
+         onFrame(fields, arrival_ns);
+      }
+      data.erase(0, pos);
+   }
+}
+
+void cConsumer::onFrame(const std::vector<string_view>& fields, int64_t arrival_ns)
+{
+   ++m_frames;
+   if (fields[0] == _T("start")) {
+      for (size_t idx = 1; idx < fields.size(); ++idx) {
+         onRequest(fields[idx], arrival_ns);
+      }
+   }
+   else if (fields[0] == _T("batch")) {
+      for (size_t idx = 3; idx < fields.size(); ++idx) {
+         onRequest(fields[idx], arrival_ns);
+      }
+   }
+   else if (fields[0] == _T("stats") && fields.size() > 1) {
+      m_stats = fields[1];
+   }
+}
+
+void cConsumer::onRequest(const string_view& request, int64_t arrival_ns)
+{
+   ++m_requests;
+   m_on_request(request, arrival_ns);
+
+   auto hook_queue = findJsonString(request, _T("deepDbgHookPipe"));
+   if (!hook_queue.empty() && !writeQueue(hook_queue, _T("stopped"))) {
+      LOG("Cannot answer {} ({})", hook_queue, getErrorMessage());
+   }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+#include "utils.h"
+
+// Stand-in for the extension: runs the real server with its stdout on a pipe, splits
+// the output into frames and answers every request's hook with "stopped", the way a
+// debug session that ends right away would.
+class cConsumer
+{
+public:
+   // Called on the reader thread for every request, with the time it was read
+   using fRequest = std::function<void(const string_view& request, int64_t arrival_ns)>;
+
+   explicit cConsumer(fRequest on_request)
+      : m_on_request(std::move(on_request))
+   {
+   }
+   ~cConsumer();
+
+   // Starts the server on the queue and waits until it accepts connections
+   bool start(const fs::path& server, const string& queue, const string& args = string());
+
+   // Stops the server, returns the statistics it reported
+   string stop();
+
+   uint64_t requests() const
+   {
+      return m_requests;
+   }
+   uint64_t frames() const
+   {
+      return m_frames;
+   }
+   DWORD serverPid() const
+   {
+      return m_pid;
+   }
+
+   // Bytes of the server's working set, 0 when it is not running
+   size_t serverWorkingSet() const;
+
+private:
+   void run();
+   void onFrame(const std::vector<string_view>& fields, int64_t arrival_ns);
+   void onRequest(const string_view& request, int64_t arrival_ns);
+
+   fRequest m_on_request;
+   string m_queue, m_stats;
+   HANDLE m_process = nullptr;
+   HANDLE m_stdout = nullptr;
+   DWORD m_pid = 0;
+   std::thread m_thread;
+   std::atomic<uint64_t> m_requests = 0, m_frames = 0;
+};
@@ -0,0 +1,170 @@
+#include "pch.h"
+#include "utils.h"
+#include "capture.h"
+#include "histogram.h"
+#include "consumer.h"
+#include "replay.h"
+
+// Re-injects a capture written by the server (--deep-debugger-capture) into a fresh
+// server run by cConsumer and reports latency and loss:
+//
+//    bench --replay <capture> [--rate original|max|<factor>] [--connections <count>] [--output <file>] [-- <server arguments>]
+//
+// Requests are sent at their original pace, <factor> times faster, or as fast as
+// possible, from the given number of concurrent connections. Each request's hook
+// queue is renamed after its index, which is how arrivals are matched to sends.
+
+namespace {
+
+   constexpr int64_t s_progress_timeout_ns = 10000000000ll;
+
+   struct sEvent
+   {
+      uint64_t offset_us;     // since the first request of the capture
+      string message;
+   };
+
+   // Sets a string field of a serialized request, the value must need no escaping but for backslashes
+   string setJsonString(const string_view& json, const string_view& key, const string_view& value)
+   {
+      string escaped;
+      for (auto c : value) {
+         if (c == _T('\\')) {
+            escaped += c;
+         }
+         escaped += c;
+      }
+
+      auto quoted_key = join(_T("\""sv), key, _T("\""sv));
+      auto pos = json.find(quoted_key);
+      if (pos != string_view::npos) {
+         auto begin = json.find(_T('"'), json.find(_T(':'), pos + quoted_key.size()));
+         auto end = begin == string_view::npos ? begin : json.find(_T('"'), begin + 1);
+         if (end != string_view::npos) {
+            return join(json.substr(0, begin + 1), escaped, json.substr(end));
+         }
+      }
+      return join(_T("{"sv), quoted_key, _T(":\""sv), escaped, _T("\","sv), json.substr(1));
+   }
+
+} // namespace
+
+int replay(const fs::path& server, const TCHAR* capture_file, int argc, TCHAR* argv[])
+{
+   double rate = 1;                 // 0 for as fast as possible
+   size_t connections = 8;
+   string output, server_args, rate_name = _T("original");
+   for (int idx = 0; idx < argc; ++idx) {
+      if (argv[idx] == _T("--rate"sv) && idx + 1 < argc) {
+         rate_name = argv[++idx];
+         rate = rate_name == _T("max") ? 0 : rate_name == _T("original") ? 1 : _ttof(rate_name.c_str());
+      }
+      else if (argv[idx] == _T("--connections"sv) && idx + 1 < argc) {
+         connections = std::max<size_t>((size_t)_ttoi64(argv[++idx]), 1);
+      }
+      else if (argv[idx] == _T("--output"sv) && idx + 1 < argc) {
+         output = argv[++idx];
+      }
+      else if (argv[idx] == _T("--"sv)) {
+         while (++idx < argc) {
+            server_args = server_args.empty() ? string(argv[idx]) : joins(server_args, string(argv[idx]));
+         }
+      }
+   }
+
+   auto queue = fmt::format(_T("\\\\.\\pipe\\deepdbg-replay-{}"), _getpid());
+
+   cCaptureReader reader;
+   if (!reader.open(capture_file)) {
+      ERROR("Cannot read capture {}", capture_file);
+      return 1;
+   }
+   std::vector<sEvent> events;
+   sCaptureRecord record;
+   string message;
+   uint64_t first_us = 0;
+   while (reader.next(record, message)) {
+      if (events.empty()) {
+         first_us = record.time_us;
+      }
+      auto hook_queue = fmt::format(_T("{}.{}"), queue, events.size());
+      events.push_back({ record.time_us > first_us ? record.time_us - first_us : 0, setJsonString(message, _T("deepDbgHookPipe"), hook_queue) });
+   }
+   if (events.empty()) {
+      ERROR("Capture {} is empty", capture_file);
+      return 1;
+   }
+
+   std::vector<std::atomic<int64_t>> sent_ns(events.size());
+   std::vector<std::atomic<bool>> arrived(events.size());
+   cHistogram latency_us, lag_us;
+   std::atomic<uint64_t> received = 0;
+
+   cConsumer consumer([&](const string_view& request, int64_t arrival_ns) {
+      auto hook_queue = findJsonString(request, _T("deepDbgHookPipe"));
+      auto idx = (size_t)_ttoi64(hook_queue.substr(hook_queue.rfind(_T('.')) + 1).c_str());
+      if (idx < events.size() && !arrived[idx].exchange(true)) {
+         latency_us.record((arrival_ns - sent_ns[idx]) / 1000);
+         ++received;
+      }
+   });
+   _tputenv(_T("DEEPDEBUGGER_RULES="));
+   if (!consumer.start(server, queue, server_args)) {
+      return 1;
+   }
+
+   std::atomic<size_t> next = 0;
+   std::atomic<uint64_t> sent = 0, send_failed = 0;
+   auto start_ns = nowNs();
+   auto send = [&]() {
+      for (size_t idx; (idx = next++) < events.size();) {
+         if (rate > 0) {
+            auto due_ns = start_ns + (int64_t)((double)events[idx].offset_us * 1000 / rate);
+            for (int64_t left; (left = due_ns - nowNs()) > 0;) {
+               Sleep(left > 2000000 ? (DWORD)(left / 1000000) - 1 : 0);
+            }
+            lag_us.record((nowNs() - due_ns) / 1000);
+         }
+         sent_ns[idx] = nowNs();
+         if (writeQueue(queue, events[idx].message)) {
+            ++sent;
+         }
+         else {
+            ++send_failed;
+         }
+      }
+   };
+   std::vector<std::thread> senders;
+   for (size_t i = 0; i < connections; ++i) {
+      senders.emplace_back(send);
+   }
+   for (auto& sender : senders) {
+      sender.join();
+   }
+
+   // Whatever has not arrived once the requests stop coming is lost
+   auto progress_ns = nowNs();
+   for (uint64_t seen = received; received < sent;) {
+      Sleep(10);
+      if (received != seen) {
+         seen = received;
+         progress_ns = nowNs();
+      }
+      else if (nowNs() - progress_ns > s_progress_timeout_ns) {
+         break;
+      }
+   }
+   auto elapsed_ns = nowNs() - start_ns;
+   auto stats = consumer.stop();
+
+   auto report = fmt::format(_T(R"({{"capture":{{"requests":{},"spanUs":{}}},"rate":"{}","connections":{},"sent":{},"sendFailed":{},"received":{},"lost":{},"elapsedUs":{},"requestsPerSec":{},"latencyUs":{},"sendLagUs":{},"server":{}}})"),
+      events.size(), events.back().offset_us, rate_name, connections, sent.load(), send_failed.load(), received.load(), sent - received,
+      elapsed_ns / 1000, elapsed_ns ? received * 1000000000ull / elapsed_ns : 0, latency_us.json(), lag_us.json(), stats.empty() ? _T("null") : stats);
+   report += _T("\n");
+
+   fmt::print(_T("{}"), report);
+   if (!output.empty()) {
+      std::ofstream(output) << report;
+   }
+   return 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "utils.h"
+
+// Replays a request capture against the server, arguments follow the capture file
+int replay(const fs::path& server, const TCHAR* capture_file, int argc, TCHAR* argv[]);
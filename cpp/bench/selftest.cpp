@@ -0,0 +1,228 @@
+#include "pch.h"
+#include "utils.h"
+#include "sniff.h"
+#include "selftest.h"
+#include "../server/pool.h"
+
+// Checks of the launch path against inputs that once broke it, and of what its executables
+// must contain, each a list of expectations:
+//
+//    bench --selftest [--only <check>]
+//
+//    sniff          classification of programs with a cut-short or unusual header (see sniff.h)
+//    requestHead    the hook queue of a request over the frame size limit, found in the head the
+//                   server keeps of it (see server/pool.h), in both protocols
+//    probes         the TraceLogging metadata of the "DeepDebugger" provider and of every probe
+//                   fired in hook.exe, server.exe and python_driver.exe, found next to this one
+//                   (see probes.h)
+//
+// Every failed expectation is printed; the exit code is 2 if there was any.
+
+namespace {
+
+   class cChecks
+   {
+   public:
+      explicit cChecks(const string& only)
+         : m_only(only)
+      {
+      }
+
+      bool enabled(const TCHAR* name) const
+      {
+         return m_only.empty() || m_only == name;
+      }
+
+      void expect(bool condition, const TCHAR* check, const string& what)
+      {
+         ++m_count;
+         if (!condition) {
+            ++m_failed;
+            fmt::print(_T("{}: {}\n"), check, what);
+         }
+      }
+
+      size_t count() const
+      {
+         return m_count;
+      }
+      size_t failed() const
+      {
+         return m_failed;
+      }
+
+   private:
+      string m_only;
+      size_t m_count = 0;
+      size_t m_failed = 0;
+   };
+
+   // A DOS stub pointing at a PE header at pe, which is written only if it fits in size bytes
+   std::string peHeader(size_t size, uint32_t pe, uint16_t characteristics = 0)
+   {
+      std::string retval(size, '\0');
+      retval.replace(0, 2, "MZ");
+      if (0x3c + 4 <= size) {
+         memcpy(retval.data() + 0x3c, &pe, sizeof(pe));
+      }
+      if ((size_t)pe + 26 <= size) {
+         retval.replace(pe, 4, std::string("PE\0\0", 4));
+         retval[pe + 4] = '\x64';   // IMAGE_FILE_MACHINE_AMD64
+         retval[pe + 5] = '\x86';
+         memcpy(retval.data() + pe + 22, &characteristics, sizeof(characteristics));
+      }
+      return retval;
+   }
+
+   void checkSniff(cChecks& checks)
+   {
+      auto name = _T("sniff");
+      auto exe = _T("program.exe");
+
+      auto info = sniff::classify(exe, peHeader(sniff::s_sniff_size, 0x80));
+      checks.expect(info.kind == sniff::eKind::native && info.machine == 0x8664, name, _T("PE header within the bytes read"));
+      info = sniff::classify(exe, peHeader(sniff::s_sniff_size, 0x80, 0x2000));
+      checks.expect(info.kind == sniff::eKind::unknown, name, _T("DLL"));
+
+      // e_lfanew is not bounded, linkers put the header past a large stub
+      info = sniff::classify(exe, peHeader(sniff::s_sniff_size, 0x10000));
+      checks.expect(info.kind == sniff::eKind::native && !info.machine, name, _T("PE header past the bytes read"));
+      info = sniff::classify(exe, peHeader(sniff::s_sniff_size, (uint32_t)sniff::s_sniff_size - 2));
+      checks.expect(info.kind == sniff::eKind::native && !info.machine, name, _T("PE signature across the end of the bytes read"));
+      info = sniff::classify(exe, peHeader(sniff::s_sniff_size, 0xffffffff));
+      checks.expect(info.kind == sniff::eKind::native, name, _T("e_lfanew at its largest"));
+
+      // Through the file as well, which is read and cached
+      auto dir = fs::temp_directory_path() / fmt::format(_T("deepdbg-selftest-{}"), _getpid());
+      std::error_code ec;
+      fs::create_directories(dir, ec);
+      auto write = [&dir](const TCHAR* fname, const std::string& content) {
+         auto path = dir / fname;
+         std::ofstream(path, std::ios::binary) << content;
+         return pathString(path);
+      };
+      checks.expect(sniff::classify(write(_T("mz.exe"), "MZ")).kind == sniff::eKind::native, name, _T("2-byte \"MZ\" file"));
+      checks.expect(sniff::classify(write(_T("stub.exe"), peHeader(0x40, 0x400))).kind == sniff::eKind::native, name, _T("DOS stub only"));
+      checks.expect(sniff::classify(write(_T("empty.py"), "")).kind == sniff::eKind::python, name, _T("empty script"));
+      checks.expect(sniff::classify(write(_T("module.pyc"), std::string("\x6f\x0d\x0d\x0a\0\0\0\0", 8))).kind == sniff::eKind::python, name, _T("bytecode"));
+      checks.expect(sniff::classify(write(_T("tool"), "#!/usr/bin/env -S pypy3 -u\n")).kind == sniff::eKind::python, name, _T("pypy through env"));
+      fs::remove_all(dir, ec);
+   }
+
+   void checkRequestHead(cChecks& checks)
+   {
+      auto name = _T("requestHead");
+      string self = _T("program"), long_arg(4096, _T('x'));
+      TCHAR* args[] = { self.data(), long_arg.data() };
+      _tputenv(_T("DEEPDEBUGGER_SESSION_ID=selftest"));
+      cMessageBuffer::setLimit(cMessageBuffer::s_head_size);
+
+      for (int version = 1; version <= protocol::s_max_version; ++version) {
+         _tputenv(fmt::format(_T("DEEPDEBUGGER_PROTOCOL={}"), version).c_str());
+         cConfig config(_T(""), std::span(args));
+         auto request = config.makeConfig();
+
+         // Read the way a connection is, in pieces
+         cMessageBuffer buffer;
+         auto bytes = (const uint8_t*)request.data();
+         for (size_t left = request.size() * sizeof(TCHAR); left;) {
+            DWORD size = 0;
+            auto space = buffer.space(size);
+            size = (DWORD)std::min<size_t>(size, left);
+            memcpy(space, bytes, size);
+            buffer.commit(size);
+            bytes += size;
+            left -= size;
+         }
+         auto state = buffer.state();
+         auto head = buffer.take();
+
+         auto expected = findJsonString(string_view(request).substr(0, request.find(_T('\0'))), _T("deepDbgHookPipe"));
+         auto found = findJsonString(string_view(head).substr(0, head.find(_T('\0'))), _T("deepDbgHookPipe"));
+         checks.expect(state == cMessageBuffer::eState::oversized, name, fmt::format(_T("protocol {} request of {} bytes discarded"), version, request.size()));
+         checks.expect(!expected.empty() && found == expected, name, fmt::format(_T("protocol {} hook queue in the head, {} found"), version, found));
+      }
+      _tputenv(_T("DEEPDEBUGGER_PROTOCOL="));
+      _tputenv(_T("DEEPDEBUGGER_SESSION_ID="));
+   }
+
+   // The provider as TraceLogging lays it out in the image: its GUID, the size of the rest, its name
+   std::string providerMetadata()
+   {
+      const uint8_t guid[] = { 0xbd, 0xa5, 0x8c, 0x30, 0x1e, 0x6b, 0xaf, 0x51, 0x21, 0x34, 0xb3, 0x64, 0x18, 0x05, 0x67, 0x3e };
+      const char name[] = "DeepDebugger";
+      uint16_t remaining = (uint16_t)(sizeof(remaining) + sizeof(name));
+      std::string retval((const char*)guid, sizeof(guid));
+      retval.append((const char*)&remaining, sizeof(remaining));
+      retval.append(name, sizeof(name));
+      return retval;
+   }
+
+   void checkProbes(cChecks& checks)
+   {
+      auto name = _T("probes");
+
+      // The probes each executable fires itself or through the utils library
+      const std::vector<const char*> requester = { "RequestBuildStart", "RequestBuildEnd", "RequestSend", "AwaitWake", "PassthroughExec" };
+      const std::pair<const TCHAR*, std::vector<const char*>> executables[] = {
+         { _T("hook.exe"), requester },
+         { _T("python_driver.exe"), requester },
+         { _T("server.exe"), { "ServerAccept", "FrameEmit" } },
+      };
+
+      // Where TraceLogging metadata starts: "ETW0", two 16-bit fields, then its magic number
+      const uint64_t magic = 0xBB8A052B88040E86;
+      auto provider = providerMetadata();
+
+      TCHAR self[MAX_PATH];
+      GetModuleFileName(nullptr, self, MAX_PATH);
+      for (const auto& [exe, events] : executables) {
+         auto path = fs::path(self).replace_filename(exe);
+         std::ifstream in(path, std::ios::binary);
+         std::string image((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+         checks.expect(!image.empty(), name, fmt::format(_T("{} read"), pathString(path)));
+         if (image.empty()) {
+            continue;
+         }
+
+         bool marked = false;
+         for (auto pos = image.find("ETW0"); pos != std::string::npos && !marked; pos = image.find("ETW0", pos + 1)) {
+            uint64_t found = 0;
+            if (pos + 16 <= image.size()) {
+               memcpy(&found, image.data() + pos + 8, sizeof(found));
+            }
+            marked = found == magic;
+         }
+         checks.expect(marked, name, fmt::format(_T("{} has TraceLogging metadata"), exe));
+         checks.expect(image.find(provider) != std::string::npos, name, fmt::format(_T("{} declares the DeepDebugger provider"), exe));
+         for (auto event : events) {
+            checks.expect(image.find(std::string(event) + '\0') != std::string::npos, name, fmt::format(_T("{} has the {} probe"), exe, string(event, event + strlen(event))));
+         }
+      }
+   }
+
+} // namespace
+
+int selftest(int argc, TCHAR* argv[])
+{
+   string only;
+   for (int idx = 0; idx < argc; ++idx) {
+      if (argv[idx] == _T("--only"sv) && idx + 1 < argc) {
+         only = argv[++idx];
+      }
+   }
+
+   cChecks checks(only);
+   if (checks.enabled(_T("sniff"))) {
+      checkSniff(checks);
+   }
+   if (checks.enabled(_T("requestHead"))) {
+      checkRequestHead(checks);
+   }
+   if (checks.enabled(_T("probes"))) {
+      checkProbes(checks);
+   }
+
+   fmt::print(_T("{} checks, {} failed\n"), checks.count(), checks.failed());
+   return checks.failed() ? 2 : 0;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "utils.h"
+
+// Checks of launch path parts against inputs that broke them, arguments follow --selftest
+int selftest(int argc, TCHAR* argv[]);
@@ -0,0 +1,394 @@
+#include "pch.h"
+#include "utils.h"
+#include "histogram.h"
+#include "consumer.h"
+#include "soak.h"
+
+#include <cmath>
+#include <random>
+#include <unordered_map>
+
+// Concurrency soak test: floods a fresh server run by cConsumer with requests of random
+// sizes for the given time and checks that every request arrives exactly once and intact:
+//
+//    bench --soak [--duration <s>] [--transport queue|hook|all] [--connections <count>]
+//                 [--min-size <bytes>] [--max-size <bytes>] [--output <file>] [-- <server arguments>]
+//
+//    queue    requests written straight to the launcher queue by in-process senders, as a hook writes them
+//    hook     real hook processes, their payload travels in their environment
+//
+// Every request carries its ID, a payload of random size and the payload's checksum.
+// Requests still missing once the traffic has stopped are lost, those arriving again
+// duplicated, and those that are not JSON or whose payload fails its checksum corrupted.
+// The exit code is 2 if any request was lost, duplicated or corrupted.
+//
+// The server's working set is sampled throughout: idle before the traffic, its peak, and
+// at the end. Requests the server turns away at its memory cap are sent again by hooks but
+// lost in the queue transport, which has no one listening for the answer; keep the
+// connections times the largest request under the cap (--deep-debugger-memory-cap).
+
+namespace {
+
+   constexpr int64_t s_progress_timeout_ns = 10000000000ll;
+   constexpr DWORD s_hook_timeout_ms = 30000;
+   constexpr size_t s_env_chunk = 16 << 10;     // a variable is limited to 32767 characters
+   constexpr DWORD s_sample_interval_ms = 100;
+
+   constexpr auto s_id_var = _T("DEEPDEBUGGER_SOAK_ID"sv);
+   constexpr auto s_crc_var = _T("DEEPDEBUGGER_SOAK_CRC"sv);
+   constexpr auto s_pad_var = _T("DEEPDEBUGGER_SOAK_PAD"sv);
+
+   struct sOptions
+   {
+      int64_t duration_s = 60;
+      size_t connections = 64;
+      size_t min_size = 100;
+      size_t max_size = 2 << 20;
+      string server_args;
+   };
+
+   // FNV-1a, enough to tell a damaged payload
+   uint64_t checksum(const string_view& data)
+   {
+      uint64_t h = 14695981039346656037ull;
+      for (auto c : data) {
+         h = (h ^ (uint64_t)(std::make_unsigned_t<TCHAR>)c) * 1099511628211ull;
+      }
+      return h;
+   }
+
+   // Alphanumeric only, so that the payload needs no escaping and has no frame separators
+   string makePayload(std::mt19937_64& rng, const sOptions& options)
+   {
+      static constexpr auto alphabet = _T("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789"sv);
+
+      // Log-uniform, so that small requests dominate as they do in real traffic
+      std::uniform_real_distribution<double> log_size(std::log((double)options.min_size), std::log((double)std::max(options.max_size, options.min_size)));
+      string retval((size_t)std::exp(log_size(rng)), _T(' '));
+      for (auto& c : retval) {
+         c = alphabet[rng() % alphabet.size()];
+      }
+      return retval;
+   }
+
+   class cSoak
+   {
+   public:
+      cSoak(const string& transport, const sOptions& options)
+         : m_transport(transport), m_options(options), m_consumer([this](const string_view& request, int64_t arrival_ns) { onRequest(request, arrival_ns); })
+      {
+         m_queue = fmt::format(_T("\\\\.\\pipe\\deepdbg-soak-{}-{}"), _getpid(), transport);
+      }
+
+      bool start(const fs::path& server)
+      {
+         // The hooks inherit all of this
+         _tputenv(_T("DEEPDEBUGGER_RULES="));
+         _tputenv(_T("DEEPDEBUGGER_SESSION_ID=soak"));
+         SetEnvironmentVariable(_T("DEEPDEBUGGER_LAUNCHER_QUEUE"), m_queue.c_str());
+         if (!m_consumer.start(server, m_queue, m_options.server_args)) {
+            return false;
+         }
+         SetEnvironmentVariable(_T("DEEPDEBUGGER_SERVER_PID"), fmt::format(_T("{}"), m_consumer.serverPid()).c_str());
+
+         auto env = GetEnvironmentStrings();
+         for (auto s = env; *s; s += _tcslen(s) + 1) {
+            m_environment.append(s, _tcslen(s) + 1);
+         }
+         FreeEnvironmentStrings(env);
+         return true;
+      }
+
+      // Sends until the time is up, waits for the stragglers and reports
+      string run(const fs::path& hook, bool& clean)
+      {
+         auto start_ns = nowNs();
+         auto deadline_ns = start_ns + m_options.duration_s * 1000000000ll;
+         auto idle_bytes = m_consumer.serverWorkingSet();
+         size_t peak_bytes = idle_bytes;
+         std::atomic<bool> sampling = true;
+         std::thread sampler([&]() {
+            while (sampling) {
+               peak_bytes = std::max(peak_bytes, m_consumer.serverWorkingSet());
+               Sleep(s_sample_interval_ms);
+            }
+         });
+         std::vector<std::thread> senders;
+         for (size_t i = 0; i < m_options.connections; ++i) {
+            senders.emplace_back([this, i, deadline_ns, &hook]() {
+               std::mt19937_64 rng(((uint64_t)_getpid() << 32) ^ i);
+               while (nowNs() < deadline_ns) {
+                  if (m_transport == _T("hook")) {
+                     sendHook(hook, rng);
+                  }
+                  else {
+                     sendQueue(rng);
+                  }
+               }
+            });
+         }
+         for (auto& sender : senders) {
+            sender.join();
+         }
+
+         auto progress_ns = nowNs();
+         for (uint64_t seen = m_arrived; m_arrived < m_sent;) {
+            Sleep(10);
+            if (m_arrived != seen) {
+               seen = m_arrived;
+               progress_ns = nowNs();
+            }
+            else if (nowNs() - progress_ns > s_progress_timeout_ns) {
+               break;
+            }
+         }
+         auto elapsed_ns = nowNs() - start_ns;
+         sampling = false;
+         sampler.join();
+         auto end_bytes = m_consumer.serverWorkingSet();
+         auto stats = m_consumer.stop();
+
+         std::lock_guard lock(m_mutex);
+         auto lost = m_in_flight.size();
+         clean = clean && !lost && !m_duplicated && !m_corrupted;
+         uint64_t received = m_received;
+         return fmt::format(_T(R"({{"transport":"{}","connections":{},"elapsedUs":{},"sent":{},"sendFailed":{},"received":{},"lost":{},"duplicated":{},"corrupted":{},"bytesSent":{},"requestsPerSec":{},"bytesPerSec":{},"latencyUs":{},"payloadBytes":{},"serverWorkingSet":{{"idle":{},"peak":{},"end":{}}},"server":{}}})"),
+            m_transport, m_options.connections, elapsed_ns / 1000, m_sent.load(), m_send_failed.load(), received, lost, m_duplicated, m_corrupted, m_bytes_sent.load(),
+            elapsed_ns ? received * 1000000000ull / elapsed_ns : 0, elapsed_ns ? m_bytes_sent * 1000000000ull / elapsed_ns : 0,
+            m_latency_us.json(), m_sizes.json(), idle_bytes, std::max(peak_bytes, end_bytes), end_bytes, stats.empty() ? _T("null") : stats);
+      }
+
+   private:
+      // Registers the request before it is sent, so that its arrival always finds it
+      uint64_t issue(const string& payload)
+      {
+         auto id = m_next_id++;
+         {
+            std::lock_guard lock(m_mutex);
+            m_in_flight[id] = nowNs();
+         }
+         m_sizes.record(payload.size());
+         return id;
+      }
+
+      void sent(bool success, uint64_t id, const string& payload)
+      {
+         if (success) {
+            ++m_sent;
+            m_bytes_sent += payload.size() * sizeof(TCHAR);
+            return;
+         }
+         ++m_send_failed;
+         std::lock_guard lock(m_mutex);
+         m_in_flight.erase(id);
+      }
+
+      void sendQueue(std::mt19937_64& rng)
+      {
+         auto payload = makePayload(rng, m_options);
+         auto id = issue(payload);
+         // No hook queue of that name exists, the consumer's reply goes nowhere
+         auto request = fmt::format(_T(R"({{"deepDbgHookPipe":"soak","deepDbgParentSessionID":"soak","soakId":{},"soakCrc":"{:016x}","soakPad":"{}"}})"),
+            id, checksum(payload), payload);
+         sent(writeQueue(m_queue, request), id, payload);
+      }
+
+      void sendHook(const fs::path& hook, std::mt19937_64& rng)
+      {
+         auto payload = makePayload(rng, m_options);
+         auto id = issue(payload);
+
+         string env = m_environment;
+         auto add = [&env](const string& var) {
+            env += var;
+            env += _T('\0');
+         };
+         add(fmt::format(_T("{}={}"), s_id_var, id));
+         add(fmt::format(_T("{}={:016x}"), s_crc_var, checksum(payload)));
+         for (size_t pos = 0, k = 0; pos < payload.size(); pos += s_env_chunk, ++k) {
+            add(fmt::format(_T("{}{}={}"), s_pad_var, k, string_view(payload).substr(pos, s_env_chunk)));
+         }
+         env += _T('\0');
+
+         // The hook asks for a session of bench --noop and exits once the consumer answers
+         STARTUPINFO si{};
+         si.cb = sizeof(si);
+         PROCESS_INFORMATION pi{};
+         string cmd = joins(quote(pathString(hook)), quote(pathString(hook.parent_path() / _T("bench.exe"))), string(_T("--noop")));
+         DWORD flags = 0;
+#ifdef _UNICODE
+         flags |= CREATE_UNICODE_ENVIRONMENT;
+#endif
+         if (!CreateProcess(nullptr, cmd.data(), NULL, NULL, FALSE, flags, env.data(), NULL, &si, &pi)) {
+            ERROR("Cannot start hook ({})", getErrorMessage());
+            sent(false, id, payload);
+            return;
+         }
+         sent(true, id, payload);
+         CloseHandle(pi.hThread);
+         if (WaitForSingleObject(pi.hProcess, s_hook_timeout_ms) != WAIT_OBJECT_0) {
+            ERROR("Hook {} got no reply, terminating", pi.dwProcessId);
+            TerminateProcess(pi.hProcess, 1);
+         }
+         CloseHandle(pi.hProcess);
+      }
+
+      // The ID, payload and checksum of a request, from its fields or its environment
+      bool parse(const string_view& request, uint64_t& id, string& payload, uint64_t& crc)
+      {
+         auto header_end = std::min(request.find(_T('\0')), request.size());
+         auto cfg = nlohmann::json::parse(request.begin(), request.begin() + header_end, nullptr, false);
+         if (cfg.is_discarded() || !cfg.is_object()) {
+            return false;
+         }
+         if (cfg.contains("soakId")) {
+            id = cfg["soakId"].get<uint64_t>();
+            crc = std::stoull(cfg.value("soakCrc", std::string("0")), nullptr, 16);
+            payload = cfg.value("soakPad", std::string());
+            return true;
+         }
+
+         bool found = false;
+         std::map<size_t, string> chunks;
+         auto onVariable = [&](string_view v) {
+            auto name = readUntil(v, _T('='));
+            if (name == s_id_var) {
+               id = _ttoi64(string(v).c_str());
+               found = true;
+            }
+            else if (name == s_crc_var) {
+               crc = _tcstoui64(string(v).c_str(), nullptr, 16);
+            }
+            else if (name.starts_with(s_pad_var)) {
+               chunks[(size_t)_ttoi64(string(name.substr(s_pad_var.size())).c_str())] = v;
+            }
+         };
+         if (header_end < request.size()) {
+            // Protocol 2: the environment is the last block
+            auto blocks = request.substr(header_end + 1);
+            for (int idx = 0; idx < 3; ++idx) {
+               protocol::readBlock(blocks);
+            }
+            for (auto env = protocol::readBlock(blocks); !env.empty();) {
+               onVariable(readUntil(env, _T('\0')));
+            }
+         }
+         else {
+            string environment = findJsonString(request, _T("environment")), var;
+            for (string_view s = environment; !s.empty();) {
+               auto encoded = readUntil(s, _T('-'));
+               if (encoded.empty() || !base64::Decode(string(encoded), var).empty()) {
+                  continue;
+               }
+               onVariable(var);
+            }
+         }
+         for (const auto& [k, chunk] : chunks) {
+            payload += chunk;
+         }
+         return found;
+      }
+
+      void onRequest(const string_view& request, int64_t arrival_ns)
+      {
+         uint64_t id = 0, crc = 0;
+         string payload;
+         bool parsed = false;
+         try {
+            parsed = parse(request, id, payload, crc);
+         }
+         catch (const std::exception& e) {
+            ERROR("Malformed request ({})", e.what());
+         }
+         bool intact = parsed && checksum(payload) == crc;
+
+         std::lock_guard lock(m_mutex);
+         auto it = parsed ? m_in_flight.find(id) : m_in_flight.end();
+         if (it == m_in_flight.end()) {
+            // Either a second copy or too damaged to tell whose it is
+            if (parsed && id < m_next_id) {
+               ++m_duplicated;
+               LOG("Request {} arrived again", id);
+            }
+            else {
+               ++m_corrupted;
+               LOG("Unidentifiable request of {} characters", request.size());
+            }
+            return;
+         }
+         if (!intact) {
+            ++m_corrupted;
+            LOG("Request {} corrupted: {} payload characters", id, payload.size());
+         }
+         else {
+            ++m_received;
+            m_latency_us.record((arrival_ns - it->second) / 1000);
+         }
+         m_in_flight.erase(it);
+         ++m_arrived;
+      }
+
+      string m_transport, m_queue, m_environment;
+      sOptions m_options;
+      cConsumer m_consumer;
+
+      std::atomic<uint64_t> m_next_id = 0, m_sent = 0, m_send_failed = 0, m_bytes_sent = 0, m_arrived = 0;
+      cHistogram m_latency_us, m_sizes;
+
+      std::mutex m_mutex;
+      std::unordered_map<uint64_t, int64_t> m_in_flight;     // sent time of every request yet to arrive
+      uint64_t m_received = 0, m_duplicated = 0, m_corrupted = 0;
+   };
+
+} // namespace
+
+int soak(const fs::path& server, const fs::path& hook, int argc, TCHAR* argv[])
+{
+   sOptions options;
+   string transport = _T("all"), output;
+   for (int idx = 0; idx < argc; ++idx) {
+      if (argv[idx] == _T("--duration"sv) && idx + 1 < argc) {
+         options.duration_s = _ttoi64(argv[++idx]);
+      }
+      else if (argv[idx] == _T("--transport"sv) && idx + 1 < argc) {
+         transport = argv[++idx];
+      }
+      else if (argv[idx] == _T("--connections"sv) && idx + 1 < argc) {
+         options.connections = std::max<size_t>((size_t)_ttoi64(argv[++idx]), 1);
+      }
+      else if (argv[idx] == _T("--min-size"sv) && idx + 1 < argc) {
+         options.min_size = std::max<size_t>((size_t)_ttoi64(argv[++idx]), 1);
+      }
+      else if (argv[idx] == _T("--max-size"sv) && idx + 1 < argc) {
+         options.max_size = std::max<size_t>((size_t)_ttoi64(argv[++idx]), 1);
+      }
+      else if (argv[idx] == _T("--output"sv) && idx + 1 < argc) {
+         output = argv[++idx];
+      }
+      else if (argv[idx] == _T("--"sv)) {
+         while (++idx < argc) {
+            options.server_args = options.server_args.empty() ? string(argv[idx]) : joins(options.server_args, string(argv[idx]));
+         }
+      }
+   }
+
+   bool clean = true;
+   string results;
+   for (auto name : { _T("queue"), _T("hook") }) {
+      if (transport != _T("all") && transport != name) {
+         continue;
+      }
+      cSoak soak(name, options);
+      if (!soak.start(server)) {
+         return 1;
+      }
+      results += join(results.empty() ? _T(""sv) : _T(","sv), soak.run(hook, clean));
+   }
+
+   auto report = join(_T("["sv), results, _T("]\n"sv));
+   fmt::print(_T("{}"), report);
+   if (!output.empty()) {
+      std::ofstream(output) << report;
+   }
+   return clean ? 0 : 2;
+}
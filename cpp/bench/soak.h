@@ -0,0 +1,7 @@
+#pragma once
+
+#include "utils.h"
+
+// Floods the server with requests and checks that each arrives once and intact,
+// arguments follow --soak
+int soak(const fs::path& server, const fs::path& hook, int argc, TCHAR* argv[]);
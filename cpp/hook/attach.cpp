@@ -0,0 +1,58 @@
+#include "pch.h"
+#include "attach.h"
+#include "sniff.h"
+#include "trace.h"
+
+#include <thread>
+
+namespace {
+
+   constexpr DWORD s_default_attach_timeout_ms = 30000;
+
+   // Returns once a debugger is attached, the timeout has passed or the session is given up
+   void waitForDebugger(HANDLE hProcess, HANDLE give_up, DWORD timeout_ms)
+   {
+      for (auto deadline = GetTickCount64() + timeout_ms; WaitForSingleObject(give_up, 1) == WAIT_TIMEOUT;) {
+         BOOL attached = FALSE;
+         if (!CheckRemoteDebuggerPresent(hProcess, &attached) || attached) {
+            return;
+         }
+         if (GetTickCount64() >= deadline) {
+            ERROR("No debugger attached in {} ms, resuming", timeout_ms);
+            return;
+         }
+      }
+   }
+
+} // namespace
+
+namespace attach {
+
+   bool request(const string& program, DWORD pid, HANDLE hProcess, std::span<TCHAR*> args, const string& priority, const std::function<void()>& resume)
+   {
+      cConfig config(sniff::debuggerType(program), args);
+      config.add(_T("program"), program);
+      config.add(_T("processId"), fmt::format(_T("{}"), pid));
+      config.setPriority(priority);
+
+      auto timeout = _tgetenv(_T("DEEPDEBUGGER_ATTACH_TIMEOUT"));
+      HANDLE give_up = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+      std::thread resumer([&, timeout_ms = timeout ? (DWORD)_ttoi(timeout) : s_default_attach_timeout_ms] {
+         waitForDebugger(hProcess, give_up, timeout_ms);
+         trace::instant("resume");
+         resume();
+      });
+
+      // Returns when the session is over, the program may still run detached. A session
+      // that ended without attaching, or never started, leaves nothing to wait for.
+      bool sent = config.send();
+      if (!sent || config.passthrough()) {
+         ERROR("No debug session, {} runs on its own", program);
+      }
+      SetEvent(give_up);
+      resumer.join();
+      CloseHandle(give_up);
+      return sent;
+   }
+
+} // namespace attach
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <functional>
+#include <span>
+
+#include "utils.h"
+
+// Debug sessions attaching to a program that is already running, held suspended by
+// the hook until the debugger is there (see attachOnExec in hook.cpp and supervisor.h)
+namespace attach {
+
+   // Sends an attach request for the process and calls resume once a debugger is attached,
+   // after DEEPDEBUGGER_ATTACH_TIMEOUT ms (30000 by default) or when there is no session.
+   // Returns when the session is over, false if there was none; priority is as for cConfig::setPriority.
+   bool request(const string& program, DWORD pid, HANDLE hProcess, std::span<TCHAR*> args, const string& priority, const std::function<void()>& resume);
+
+} // namespace attach
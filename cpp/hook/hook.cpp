@@ -1,20 +1,121 @@
 
 #include "pch.h"
 #include "utils.h"
+#include "attach.h"
+#include "pathcache.h"
+#include "probes.h"
+#include "rules.h"
+#include "sniff.h"
+#include "supervisor.h"
+#include "trace.h"
+
+namespace {
+
+   // With DEEPDEBUGGER_ATTACH_ON_EXEC=1 a native program is started here, suspended, and the
+   // debugger attaches to it instead of launching it again: the program keeps the hook's
+   // handles and its place in the process tree, and the hook returns its exit code
+   bool attachOnExec(const string& program)
+   {
+      auto value = _tgetenv(_T("DEEPDEBUGGER_ATTACH_ON_EXEC"));
+      return value && *value && *value != _T('0') && !_tcsicmp(fs::path(program).extension().string().c_str(), _T(".exe"));
+   }
+
+   // Runs the command line after the hook's name without a debugger
+   int passthrough(string& cmdline)
+   {
+      string cmd(PathGetArgs(cmdline.data()));
+      LOG("Executing {}", cmd);
+      trace::instant("passthrough");
+      PROBE_PASSTHROUGH_EXEC(GetCurrentProcessId(), cmd.c_str());
+      return execute(cmd);
+   }
+
+   int execAttached(const string& program, string cmd, std::span<TCHAR*> args, const string& priority)
+   {
+      STARTUPINFO si{};
+      si.cb = sizeof(si);
+      PROCESS_INFORMATION pi{};
+      if (!CreateProcess(program.c_str(), cmd.data(), NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &pi)) {
+         ERROR("Cannot start {} ({})", program, getErrorMessage());
+         return -1;
+      }
+      LOG("Started {} suspended, process {}", cmd, pi.dwProcessId);
+
+      attach::request(program, pi.dwProcessId, pi.hProcess, args, priority, [&pi] { ResumeThread(pi.hThread); });
+
+      WaitForSingleObject(pi.hProcess, INFINITE);
+      DWORD exit_code = 0;
+      GetExitCodeProcess(pi.hProcess, &exit_code);
+      CloseHandle(pi.hThread);
+      CloseHandle(pi.hProcess);
+      LOG("{} exited with {}", program, exit_code);
+      return (int)exit_code;
+   }
+
+} // namespace
 
 int _tmain(int argc, TCHAR* argv[])
 {
    if (auto log = _tgetenv(_T("DEEPDEBUGGER_LOGFILE"))) {
       ENABLE_LOGGING(log, _T("hook"));
    }
+   trace::init(_T("hook"));
+   trace::cSpan span("hook");
 
    string cmdline = GetCommandLine();
 
-   cConfig config(_T(""), argc, argv);
+   // A hook variable may name the priority class of its requests, the switch is dropped
+   // from the command line as if it were the hook's own name
+   string priority;
+   if (argc > 2 && argv[1] == _T("--deep-debugger-priority"sv)) {
+      priority = argv[2];
+      argc -= 2;
+      argv += 2;
+      cmdline = PathGetArgs(PathGetArgs(cmdline.data()));
+   }
+
+   if (argc > 2 && argv[1] == _T("--deep-debugger-supervise"sv)) {
+      return supervisor::run(pathcache::resolve(argv[2]), string(PathGetArgs(PathGetArgs(cmdline.data()))));
+   }
+
+   if (argc < 2) {
+      cConfig config(_T(""), argc, argv);
+      config.setPriority(priority);
+      return config.send() ? 0 : -1;
+   }
+
+   // The extension takes an absolute program as it is, the rules match it the same way
+   auto resolve_start_ns = trace::enabled() ? nowNs() : 0;
+   auto program = pathcache::resolve(argv[1]);
+   if (resolve_start_ns) {
+      trace::complete("resolve", resolve_start_ns, nowNs());
+   }
+   LOG("Program resolved to {}", program);
+
+   cMatchRules rules;
+   auto rules_start_ns = trace::enabled() ? nowNs() : 0;
+   bool skip = rules.load() && rules.evaluate(program, std::span(argv + 1, argc - 1)) == rules::eAction::skip;
+   if (rules_start_ns) {
+      trace::complete("rules", rules_start_ns, nowNs());
+   }
+   if (skip) {
+      return passthrough(cmdline);
+   }
+
+   if (attachOnExec(program)) {
+      return execAttached(program, string(PathGetArgs(cmdline.data())), std::span(argv + 2, argc - 2), priority);
+   }
+
+   cConfig config(sniff::debuggerType(program), std::span(argv + 2, argc - 2));
+   config.add(_T("program"), program);
+   config.setPriority(priority);
 
    if (!config.send()) {
       return -1;
    };
+   if (config.passthrough()) {
+      return passthrough(cmdline);
+   }
 
    LOG("Success");
    return 0;
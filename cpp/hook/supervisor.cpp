@@ -0,0 +1,230 @@
+#include "pch.h"
+#include "attach.h"
+#include "rules.h"
+#include "supervisor.h"
+#include "trace.h"
+
+#include <winternl.h>
+#include <shellapi.h>
+#include <thread>
+
+namespace {
+
+   constexpr ULONG s_process_command_line_information = 60;
+
+   // Not in the SDK headers, ntdll exports them since Windows XP
+   using NtProcessFn = LONG(NTAPI*)(HANDLE);
+   using NtQueryInformationProcessFn = LONG(NTAPI*)(HANDLE, ULONG, PVOID, ULONG, PULONG);
+
+   struct sNtApi
+   {
+      NtProcessFn suspend = nullptr;
+      NtProcessFn resume = nullptr;
+      NtQueryInformationProcessFn query = nullptr;
+
+      bool load()
+      {
+         auto ntdll = GetModuleHandle(_T("ntdll.dll"));
+         suspend = (NtProcessFn)GetProcAddress(ntdll, "NtSuspendProcess");
+         resume = (NtProcessFn)GetProcAddress(ntdll, "NtResumeProcess");
+         query = (NtQueryInformationProcessFn)GetProcAddress(ntdll, "NtQueryInformationProcess");
+         return suspend && resume && query;
+      }
+   };
+
+   sNtApi s_nt;
+
+   string fromWide(const std::wstring& wstr)
+   {
+#ifdef _UNICODE
+      return wstr;
+#else
+      int size = WideCharToMultiByte(CP_ACP, 0, wstr.data(), (int)wstr.size(), NULL, 0, NULL, NULL);
+      string retval(size, '\0');
+      WideCharToMultiByte(CP_ACP, 0, wstr.data(), (int)wstr.size(), retval.data(), size, NULL, NULL);
+      return retval;
+#endif
+   }
+
+   string imagePath(HANDLE hProcess)
+   {
+      TCHAR path[MAX_PATH * 2];
+      DWORD size = (DWORD)std::size(path);
+      return QueryFullProcessImageName(hProcess, 0, path, &size) ? string(path, size) : string();
+   }
+
+   // The arguments of another process, split the way its C runtime does
+   std::vector<string> commandLine(HANDLE hProcess)
+   {
+      ULONG len = 0;
+      s_nt.query(hProcess, s_process_command_line_information, nullptr, 0, &len);
+      std::vector<BYTE> buf(len);
+      if (!len || s_nt.query(hProcess, s_process_command_line_information, buf.data(), len, &len) < 0) {
+         return {};
+      }
+      auto cmdline = (const UNICODE_STRING*)buf.data();
+      std::wstring wcmdline(cmdline->Buffer, cmdline->Length / sizeof(WCHAR));
+
+      std::vector<string> retval;
+      int argc = 0;
+      if (auto argv = CommandLineToArgvW(wcmdline.c_str(), &argc)) {
+         for (int idx = 0; idx < argc; ++idx) {
+            retval.push_back(fromWide(argv[idx]));
+         }
+         LocalFree(argv);
+      }
+      return retval;
+   }
+
+   void debugSession(HANDLE hProcess, DWORD pid, string program, std::vector<string> args)
+   {
+      std::vector<TCHAR*> argv;
+      for (auto& arg : args) {
+         argv.push_back(arg.data());
+      }
+      attach::request(program, pid, hProcess, std::span(argv).subspan(argv.empty() ? 0 : 1), string(), [hProcess] { s_nt.resume(hProcess); });
+      CloseHandle(hProcess);
+   }
+
+   class cSupervisor
+   {
+   public:
+      ~cSupervisor()
+      {
+         for (auto& session : m_sessions) {
+            session.join();
+         }
+         if (m_port) {
+            CloseHandle(m_port);
+         }
+         if (m_job) {
+            CloseHandle(m_job);
+         }
+      }
+
+      bool init()
+      {
+         TCHAR self[MAX_PATH * 2];
+         DWORD size = GetModuleFileName(NULL, self, (DWORD)std::size(self));
+         m_self = string(self, size);
+
+         m_job = CreateJobObject(NULL, NULL);
+         m_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+         if (!m_job || !m_port) {
+            return false;
+         }
+         JOBOBJECT_ASSOCIATE_COMPLETION_PORT port_info{ m_job, m_port };
+         return SetInformationJobObject(m_job, JobObjectAssociateCompletionPortInformation, &port_info, sizeof(port_info));
+      }
+
+      bool start(const string& program, string& cmd, PROCESS_INFORMATION& pi)
+      {
+         STARTUPINFO si{};
+         si.cb = sizeof(si);
+         if (!CreateProcess(program.c_str(), cmd.data(), NULL, NULL, TRUE, CREATE_SUSPENDED, NULL, NULL, &si, &pi)) {
+            return false;
+         }
+         // Outside the job (one that cannot nest, say) the tree is not seen, the program runs alone
+         m_assigned = AssignProcessToJobObject(m_job, pi.hProcess);
+         if (!m_assigned) {
+            ERROR("Cannot supervise {} ({}), running it unsupervised", program, getErrorMessage());
+         }
+         m_root = pi.dwProcessId;
+         ResumeThread(pi.hThread);
+         return true;
+      }
+
+      // Until the last process of the tree exits, no wait for a program outside the job
+      void supervise(const cMatchRules& rules)
+      {
+         if (!m_assigned) {
+            return;
+         }
+         DWORD message = 0;
+         ULONG_PTR key = 0;
+         LPOVERLAPPED data = nullptr;
+         while (GetQueuedCompletionStatus(m_port, &message, &key, &data, INFINITE)) {
+            if (message == JOB_OBJECT_MSG_ACTIVE_PROCESS_ZERO) {
+               break;
+            }
+            auto pid = (DWORD)(ULONG_PTR)data;
+            if (message == JOB_OBJECT_MSG_NEW_PROCESS && pid != m_root) {
+               inspect(rules, pid);
+            }
+         }
+      }
+
+   private:
+      void inspect(const cMatchRules& rules, DWORD pid)
+      {
+         HANDLE hProcess = OpenProcess(PROCESS_SUSPEND_RESUME | PROCESS_QUERY_INFORMATION | SYNCHRONIZE, FALSE, pid);
+         if (!hProcess) {
+            // Gone already
+            return;
+         }
+         s_nt.suspend(hProcess);
+
+         auto inspect_start_ns = trace::enabled() ? nowNs() : 0;
+         auto program = imagePath(hProcess);
+         bool debug = !program.empty() && _tcsicmp(program.c_str(), m_self.c_str());
+         std::vector<string> args;
+         if (debug) {
+            args = commandLine(hProcess);
+            std::vector<TCHAR*> argv;
+            for (auto& arg : args) {
+               argv.push_back(arg.data());
+            }
+            debug = rules.evaluate(program, argv) == rules::eAction::debug;
+         }
+         if (inspect_start_ns) {
+            trace::complete("inspect", inspect_start_ns, nowNs());
+         }
+
+         if (!debug) {
+            s_nt.resume(hProcess);
+            CloseHandle(hProcess);
+            return;
+         }
+         LOG("Debugging process {}: {}", pid, program);
+         m_sessions.emplace_back(debugSession, hProcess, pid, std::move(program), std::move(args));
+      }
+
+      string m_self;
+      HANDLE m_job = nullptr;
+      HANDLE m_port = nullptr;
+      DWORD m_root = 0;
+      bool m_assigned = false;
+      std::list<std::thread> m_sessions;
+   };
+
+} // namespace
+
+namespace supervisor {
+
+   int run(const string& program, string cmd)
+   {
+      cMatchRules rules;
+      cSupervisor supervisor;
+      if (!rules.load() || !s_nt.load() || !supervisor.init()) {
+         ERROR("Cannot supervise {} ({}), executing it", program, rules.loaded() ? getErrorMessage() : _T("no match rules"));
+         return execute(cmd);
+      }
+
+      PROCESS_INFORMATION pi{};
+      if (!supervisor.start(program, cmd, pi)) {
+         ERROR("Cannot start {} ({})", program, getErrorMessage());
+         return -1;
+      }
+      LOG("Supervising {}, process {}", cmd, pi.dwProcessId);
+      supervisor.supervise(rules);
+
+      DWORD exit_code = 0;
+      WaitForSingleObject(pi.hProcess, INFINITE);
+      GetExitCodeProcess(pi.hProcess, &exit_code);
+      CloseHandle(pi.hThread);
+      CloseHandle(pi.hProcess);
+      LOG("{} exited with {}", program, exit_code);
+      return (int)exit_code;
+   }
+
+} // namespace supervisor
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "utils.h"
+
+// Supervised launch, hook --deep-debugger-supervise <program> [args]: for build tools
+// and scripts whose command lines cannot be rewritten to go through the hook, and for
+// children that nothing injected into the parent would reach.
+//
+// The program runs in a job object whose completion port reports every process created
+// anywhere below it. Each new process is suspended while its image path and command
+// line are evaluated against the match rules (DEEPDEBUGGER_RULES, which are required
+// here; "default skip" plus debug rules is the usual setup). A match becomes an attach
+// request for the process, which stays suspended until the debugger is attached (see
+// attach.h); any other process is resumed right away. Hooks started in the tree are
+// left to handle their own programs.
+//
+// Windows reports a process once it exists, not at the exec itself, so a matched program
+// may have run its loader by the time it is suspended, and a process that exits before
+// the report is not seen at all. Job objects need no privileges and nest, so this works
+// for unelevated sessions and inside other jobs.
+namespace supervisor {
+
+   // Runs the program and returns its exit code once the whole tree has exited
+   int run(const string& program, string cmd);
+
+} // namespace supervisor
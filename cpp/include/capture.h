@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+
+#include "utils.h"
+
+// Capture of the launch requests a server received, for replaying real traffic.
+// The file is append-only: a header, then one record per request
+//
+//    sCaptureRecord | <size bytes of the request>
+//
+// Arrival times are wall-clock microseconds, so captures of several server runs
+// appended to the same file replay in order. A record cut short by a killed
+// server ends the capture.
+struct sCaptureHeader
+{
+   char magic[4] = { 'D', 'D', 'C', 'P' };
+   uint16_t version = 1;
+   uint16_t char_size = sizeof(TCHAR);
+};
+
+struct sCaptureRecord
+{
+   uint64_t time_us;       // since the Unix epoch
+   uint32_t pid;           // of the requester
+   uint32_t size;          // of the request in bytes
+};
+
+class cCaptureWriter
+{
+public:
+   ~cCaptureWriter();
+
+   // Appends to the file, creating it if necessary
+   bool open(const fs::path& fname);
+   bool append(DWORD pid, const string_view& message);
+
+   uint64_t records() const
+   {
+      return m_records;
+   }
+
+private:
+   HANDLE m_file = INVALID_HANDLE_VALUE;
+   uint64_t m_records = 0;
+   string m_buf;
+};
+
+class cCaptureReader
+{
+public:
+   bool open(const fs::path& fname);
+
+   // False at the end of the capture
+   bool next(sCaptureRecord& record, string& message);
+
+private:
+   std::ifstream m_file;
+};
+
+// Wall-clock microseconds since the Unix epoch
+uint64_t captureTimeUs();
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+
+#include "utils.h"
+
+// Log-linear latency histogram: values are grouped by their highest set bit and
+// every power of two is then split into s_sub_buckets / 2 linear steps, which keeps
+// the relative error of every reported percentile below 2 / s_sub_buckets (about 6%)
+// over the whole uint64_t range. Recording is a single relaxed atomic increment.
+class cHistogram
+{
+public:
+   static constexpr unsigned s_sub_bits = 5;
+   static constexpr uint64_t s_sub_buckets = 1ull << s_sub_bits;
+   static constexpr size_t s_bucket_count = (64 - s_sub_bits + 2) * (s_sub_buckets / 2);
+
+   void record(uint64_t value)
+   {
+      m_buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+      m_count.fetch_add(1, std::memory_order_relaxed);
+      m_sum.fetch_add(value, std::memory_order_relaxed);
+      for (auto max = m_max.load(std::memory_order_relaxed); value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed);) {
+      }
+   }
+
+   uint64_t count() const
+   {
+      return m_count.load(std::memory_order_relaxed);
+   }
+   uint64_t sum() const
+   {
+      return m_sum.load(std::memory_order_relaxed);
+   }
+   uint64_t max() const
+   {
+      return m_max.load(std::memory_order_relaxed);
+   }
+
+   // Upper bound of the bucket holding the given percentile (0..100)
+   uint64_t percentile(double p) const
+   {
+      uint64_t total = count();
+      if (!total) {
+         return 0;
+      }
+      auto rank = (uint64_t)(p / 100.0 * (double)total + 0.5);
+      rank = std::clamp<uint64_t>(rank, 1, total);
+      uint64_t seen = 0;
+      for (size_t idx = 0; idx < s_bucket_count; ++idx) {
+         seen += m_buckets[idx].load(std::memory_order_relaxed);
+         if (seen >= rank) {
+            return std::min(highest(idx), max());
+         }
+      }
+      return max();
+   }
+
+   // {"count":..,"mean":..,"p50":..,"p90":..,"p99":..,"p999":..,"max":..}
+   std::string json() const
+   {
+      auto n = count();
+      return fmt::format(R"({{"count":{},"mean":{},"p50":{},"p90":{},"p99":{},"p999":{},"max":{}}})",
+         n, n ? sum() / n : 0, percentile(50), percentile(90), percentile(99), percentile(99.9), max());
+   }
+
+   template <typename F>
+   void forEachBucket(F&& f) const
+   {
+      for (size_t idx = 0; idx < s_bucket_count; ++idx) {
+         if (auto n = m_buckets[idx].load(std::memory_order_relaxed)) {
+            f(highest(idx), n);
+         }
+      }
+   }
+
+   static size_t index(uint64_t value)
+   {
+      if (value < s_sub_buckets) {
+         return (size_t)value;
+      }
+      unsigned shift = (unsigned)std::bit_width(value) - s_sub_bits;
+      return (size_t)(shift * (s_sub_buckets / 2) + (value >> shift));
+   }
+
+   static uint64_t highest(size_t idx)
+   {
+      if (idx < s_sub_buckets) {
+         return idx;
+      }
+      unsigned shift = (unsigned)(idx / (s_sub_buckets / 2)) - 1;
+      uint64_t mantissa = idx - shift * (s_sub_buckets / 2);
+      return ((mantissa + 1) << shift) - 1;
+   }
+
+private:
+   std::atomic<uint64_t> m_buckets[s_bucket_count] = {};
+   std::atomic<uint64_t> m_count = 0;
+   std::atomic<uint64_t> m_sum = 0;
+   std::atomic<uint64_t> m_max = 0;
+};
+
+// Monotonic timestamps in microseconds / nanoseconds, comparable between processes
+inline int64_t nowNs()
+{
+   static const int64_t freq = [] {
+      LARGE_INTEGER f;
+      QueryPerformanceFrequency(&f);
+      return f.QuadPart;
+   }();
+   LARGE_INTEGER c;
+   QueryPerformanceCounter(&c);
+   return (int64_t)((c.QuadPart / freq) * 1000000000ll + (c.QuadPart % freq) * 1000000000ll / freq);
+}
+
+inline int64_t nowUs()
+{
+   return nowNs() / 1000;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include "utils.h"
+
+// Cross-process mutual exclusion on <file>.lck, the Windows counterpart of flock:
+// an exclusive byte-range lock (LockFileEx) on the lock file. The system drops the
+// lock when its owner exits or is killed, so a dead holder never blocks anyone, and
+// waiters sleep in the kernel instead of polling. The lock file also holds shared
+// contention statistics, mapped into every process that uses the lock.
+class cProcessLock
+{
+public:
+   // Shared between all users of a lock file, lives at the start of the file
+   struct sStats
+   {
+      std::atomic<uint32_t> owner;           // PID of the current holder, 0 when free
+      std::atomic<uint32_t> reserved;
+      std::atomic<uint64_t> acquisitions;
+      std::atomic<uint64_t> contended;       // acquisitions that had to wait
+      std::atomic<uint64_t> timeouts;
+      std::atomic<uint64_t> recovered;       // acquisitions after a holder died
+      std::atomic<uint64_t> wait_ns;
+      std::atomic<uint64_t> max_wait_ns;
+      std::atomic<uint64_t> hold_ns;
+   };
+   static_assert(std::atomic<uint64_t>::is_always_lock_free, "lock statistics must be address-free");
+
+   cProcessLock() = default;
+   explicit cProcessLock(const fs::path& fname)
+   {
+      open(fname);
+   }
+   ~cProcessLock();
+
+   cProcessLock(const cProcessLock&) = delete;
+   cProcessLock& operator=(const cProcessLock&) = delete;
+
+   // Opens <fname>.lck, creating it if necessary
+   bool open(const fs::path& fname);
+   bool isOpen() const
+   {
+      return m_stats != nullptr;
+   }
+
+   // False on timeout or failure
+   bool lock(DWORD timeout_ms = INFINITE);
+   void unlock();
+
+   // True if the last lock() took over from a holder that died holding the lock
+   bool recovered() const
+   {
+      return m_recovered;
+   }
+
+   // {"acquisitions":..,"contended":..,"timeouts":..,"recovered":..,"waitNs":..,"maxWaitNs":..,"holdNs":..,"owner":..}
+   string stats() const;
+   void resetStats();
+
+private:
+   void close();
+
+   HANDLE m_file = INVALID_HANDLE_VALUE;
+   HANDLE m_mapping = nullptr;
+   HANDLE m_event = nullptr;
+   sStats* m_stats = nullptr;
+
+   // Byte-range locks belong to the handle, threads of one process take turns here first
+   std::timed_mutex m_local;
+   int64_t m_acquired_ns = 0;
+   bool m_recovered = false;
+};
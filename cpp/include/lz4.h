@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+// Codec of the LZ4 block format (lz4_Block_format.md in the LZ4 sources): byte-aligned
+// literal runs and back references into a 64 KB window, which decodes with little more
+// than memcpy. The compressor is the greedy single-probe one, a 4096-entry hash table of
+// 4-byte sequences, that gives LZ4 its speed; the output is read by any LZ4 block decoder,
+// the extension's as well (src/lz4.ts). Blocks carry no size, the caller keeps it.
+namespace lz4 {
+
+   std::string compress(std::string_view input);
+
+   // False when the block is damaged or does not decode to exactly raw_size bytes
+   bool decompress(std::string_view block, size_t raw_size, std::string& output);
+
+} // namespace lz4
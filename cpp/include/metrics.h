@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include "histogram.h"
+
+// Process-wide metrics registry: counters, gauges and cHistograms registered by name
+// once, then updated without locks from any thread. The registry is rendered as JSON
+// (the server's stats control request) or in the Prometheus text format, which
+// cExporter rewrites periodically for the node exporter's textfile collector.
+namespace metrics {
+
+   // Striped over cache lines by thread, so that concurrent increments do not contend
+   class cCounter
+   {
+   public:
+      void add(uint64_t n = 1)
+      {
+         m_slots[slot()].value.fetch_add(n, std::memory_order_relaxed);
+      }
+
+      uint64_t value() const
+      {
+         uint64_t retval = 0;
+         for (const auto& s : m_slots) {
+            retval += s.value.load(std::memory_order_relaxed);
+         }
+         return retval;
+      }
+
+   private:
+      static constexpr size_t s_slot_count = 16;
+
+      struct alignas(64) sSlot
+      {
+         std::atomic<uint64_t> value = 0;
+      };
+
+      static size_t slot()
+      {
+         static std::atomic<size_t> next = 0;
+         thread_local size_t idx = next++ % s_slot_count;
+         return idx;
+      }
+
+      sSlot m_slots[s_slot_count];
+   };
+
+   class cGauge
+   {
+   public:
+      void set(int64_t v)
+      {
+         m_value.store(v, std::memory_order_relaxed);
+      }
+      void add(int64_t n = 1)
+      {
+         m_value.fetch_add(n, std::memory_order_relaxed);
+      }
+      void sub(int64_t n = 1)
+      {
+         m_value.fetch_sub(n, std::memory_order_relaxed);
+      }
+
+      int64_t value() const
+      {
+         return m_value.load(std::memory_order_relaxed);
+      }
+
+   private:
+      std::atomic<int64_t> m_value = 0;
+   };
+
+   // Registration returns the existing metric if the name is taken. Names follow the
+   // Prometheus conventions: deepdbg_<component>_<what>_<unit>, counters end in _total.
+   cCounter& counter(const char* name, const char* help);
+   cGauge& gauge(const char* name, const char* help);
+   cHistogram& histogram(const char* name, const char* help);
+
+   // A gauge read when the metrics are rendered, the function must be thread-safe
+   void gauge(const char* name, const char* help, std::function<int64_t()> read);
+
+   // {"<name>":<value or cHistogram::json()>,...}
+   std::string json();
+   std::string prometheus();
+
+   // Replaces the file in one rename, so that a scraper never sees it half-written
+   bool writeFile(const fs::path& fname);
+
+   // Rewrites the Prometheus file every interval and once more when stopped
+   class cExporter
+   {
+   public:
+      ~cExporter();
+
+      void start(const fs::path& fname, DWORD interval_ms);
+      void stop();
+
+   private:
+      void run();
+
+      fs::path m_fname;
+      DWORD m_interval_ms = 0;
+      std::mutex m_mutex;
+      std::condition_variable m_wake;
+      bool m_stop = false;
+      std::thread m_thread;
+   };
+
+} // namespace metrics
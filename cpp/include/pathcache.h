@@ -0,0 +1,19 @@
+#pragma once
+
+#include "utils.h"
+
+// Program lookup along PATH for the hooks, so that a request carries the absolute
+// program path and the extension never probes the file system.
+//
+// Directory listings are kept in a per-user index, %TEMP%\DeepDebugger\pathcache.bin,
+// which every hook maps read-only. A listing is trusted while the last write time of
+// its directory is unchanged. Stale and new directories are listed again and the index
+// is replaced as a whole, so a concurrent hook sees either the old or the new version.
+namespace pathcache {
+
+   // Resolves a program the way the extension used to: absolute as is, relative to the
+   // working directory if it exists there, and a bare name along PATH, trying the
+   // PATHEXT extensions when it has none. Otherwise returns it joined to the working directory.
+   string resolve(const string& program);
+
+} // namespace pathcache
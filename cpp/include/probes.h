@@ -0,0 +1,40 @@
+#pragma once
+
+#include <TraceLoggingProvider.h>
+
+// Static probe points on the launch path, the Windows counterpart of USDT probes:
+// TraceLogging events of the "DeepDebugger" ETW provider. An event is a single
+// test of the provider's enabled mask while no session listens, its arguments are
+// not even evaluated, and the events are self-describing, so a tracer needs
+// nothing from the build to decode them. To record them:
+//
+//    logman start deepdbg -p {308ca5bd-6b1e-51af-2134-b3641805673e} -o deepdbg.etl -ets
+//    logman stop deepdbg -ets
+//
+// The provider GUID is the one derived from the provider name, so tools taking
+// *DeepDebugger (xperf, PerfView, WPR profiles) find it as well.
+TRACELOGGING_DECLARE_PROVIDER(g_deepdbg_provider);
+
+#define DEEPDBG_PROBE(name, ...) TraceLoggingWrite(g_deepdbg_provider, name, __VA_ARGS__)
+
+// Request building in cConfig::makeConfig
+#define PROBE_REQUEST_BUILD_START(pid) \
+   DEEPDBG_PROBE("RequestBuildStart", TraceLoggingUInt32(pid, "pid"))
+#define PROBE_REQUEST_BUILD_END(pid, size, session_id) \
+   DEEPDBG_PROBE("RequestBuildEnd", TraceLoggingUInt32(pid, "pid"), TraceLoggingUInt64(size, "size"), TraceLoggingValue(session_id, "sessionId"))
+
+// The hook sending its request and being woken up by the reply
+#define PROBE_REQUEST_SEND(pid, size, attempt) \
+   DEEPDBG_PROBE("RequestSend", TraceLoggingUInt32(pid, "pid"), TraceLoggingUInt64(size, "size"), TraceLoggingInt32(attempt, "attempt"))
+#define PROBE_AWAIT_WAKE(pid, reply) \
+   DEEPDBG_PROBE("AwaitWake", TraceLoggingUInt32(pid, "pid"), TraceLoggingValue(reply, "reply"))
+
+// The server accepting a connection and emitting a frame to the extension
+#define PROBE_SERVER_ACCEPT(pid) \
+   DEEPDBG_PROBE("ServerAccept", TraceLoggingUInt32(pid, "pid"))
+#define PROBE_FRAME_EMIT(sequence, requests, size) \
+   DEEPDBG_PROBE("FrameEmit", TraceLoggingUInt64(sequence, "sequence"), TraceLoggingUInt64(requests, "requests"), TraceLoggingUInt64(size, "size"))
+
+// A hook or the python driver running the command itself instead of debugging it
+#define PROBE_PASSTHROUGH_EXEC(pid, cmd) \
+   DEEPDBG_PROBE("PassthroughExec", TraceLoggingUInt32(pid, "pid"), TraceLoggingValue(cmd, "cmd"))
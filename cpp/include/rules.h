@@ -0,0 +1,73 @@
+#pragma once
+
+#include "utils.h"
+
+// Match rules deciding whether a spawned program is debugged or executed directly.
+//
+// The rules file (DEEPDEBUGGER_RULES) holds one rule per line, '#' starts a comment:
+//
+//    default debug|skip
+//    <debug|skip> program <glob>        - absolute program path, '*' and '?' wildcards
+//    <debug|skip> arg <glob>            - any single argument
+//    <debug|skip> cmdline <substring>   - anywhere in the space-joined arguments
+//    <debug|skip> env <NAME>[=<glob>]   - variable is set (and matches)
+//
+// The first matching rule in file order wins; without a match the default action
+// applies (debug, unless overridden). The file is compiled into a flat image
+// (an Aho-Corasick automaton over the cmdline substrings plus the glob table)
+// which is cached in %TEMP%\DeepDebugger\rules-<hash of the rules file path>.bin and
+// memory-mapped by later invocations for as long as the rules file modification time
+// and size stay unchanged.
+
+namespace rules {
+
+   enum class eAction : uint8_t { debug, skip };
+   enum class eKind : uint8_t { program, arg, cmdline, env };
+
+   bool globMatch(string_view pattern, string_view str, bool icase = false);
+
+} // namespace rules
+
+class cMatchRules
+{
+public:
+   cMatchRules() = default;
+   ~cMatchRules();
+
+   cMatchRules(const cMatchRules&) = delete;
+   cMatchRules& operator=(const cMatchRules&) = delete;
+
+   // Loads the rules named by DEEPDEBUGGER_RULES; false if there are none
+   bool load();
+   bool load(const fs::path& fname);
+
+   rules::eAction evaluate(string_view program, std::span<TCHAR*> args) const;
+
+   bool loaded() const
+   {
+      return m_base != nullptr;
+   }
+
+private:
+   struct sHeader;
+   struct sRule;
+   struct sNode;
+   struct sEdge;
+
+   bool map(const fs::path& fname, uint64_t mtime, uint64_t size);
+   void unmap();
+
+   static bool compile(const fs::path& fname, const fs::path& cache_name, uint64_t mtime, uint64_t size);
+
+   const sHeader* header() const;
+   const sRule* rule(uint32_t idx) const;
+   const sNode* node(uint32_t idx) const;
+   const sEdge* edges(const sNode* n) const;
+   string_view str(uint32_t offset, uint32_t len) const;
+
+   uint32_t next(uint32_t state, TCHAR c) const;
+
+   HANDLE m_file = INVALID_HANDLE_VALUE;
+   HANDLE m_mapping = nullptr;
+   const uint8_t* m_base = nullptr;
+};
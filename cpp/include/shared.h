@@ -0,0 +1,54 @@
+#pragma once
+
+#include <memory>
+
+#include "utils.h"
+
+// Request blocks passed to the server in shared memory instead of through the launcher queue,
+// when the extension sets DEEPDEBUGGER_SHARED_MEMORY to a size threshold in bytes and the
+// blocks of a version 2 request (compressed or not) reach it.
+//
+// The hook writes the blocks to a section backed by the paging file and keeps nothing but
+// its handle, no view. The request is then the header alone, followed by the NUL, with two
+// string fields: "deepDbgSection" (the handle in the hook's process) and "deepDbgSectionSize"
+// (the blocks' size in bytes). The server duplicates the handle out of the hook read-only,
+// maps it and writes the blocks to the extension straight from the mapping, so the launcher
+// queue carries a few hundred bytes whatever the size of the environment and the server
+// copies none of it. The hook closes the section once the server has answered. A server
+// that cannot map the section answers "inline", and the hook sends the request again with
+// its blocks.
+namespace shared {
+
+   // Smallest blocks passed in shared memory, 0 when requests carry them
+   size_t threshold();
+
+   // The hook's side: a section holding the blocks, nullptr on failure
+   HANDLE create(const string_view& blocks);
+
+   // The server's side: a read-only mapping of the blocks in a requester's section
+   class cView
+   {
+   public:
+      // nullptr when the section cannot be taken over or holds less than size bytes
+      static std::shared_ptr<const cView> open(DWORD pid, const string_view& handle, size_t size);
+
+      ~cView();
+      cView(const cView&) = delete;
+      cView& operator=(const cView&) = delete;
+
+      string_view blocks() const
+      {
+         return string_view((const TCHAR*)m_view, m_size / sizeof(TCHAR));
+      }
+
+   private:
+      cView(const void* view, size_t size)
+         : m_view(view), m_size(size)
+      {
+      }
+
+      const void* m_view;
+      size_t m_size;
+   };
+
+} // namespace shared
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "utils.h"
+
+// Program classification for the request's debugger type, so that the extension does not
+// have to guess from the file name or run file(1) for every launch.
+//
+// The first s_sniff_size bytes decide: a PE header (not a DLL) or an ELF one (executable
+// or shared object, which position independent executables are), a '#!' line naming the
+// interpreter (through env as well), Python bytecode; anything else goes by its extension.
+// Results are kept by file identity (volume and file index, the inode here) and last
+// write time in a per-user cache, %TEMP%\DeepDebugger\sniffcache.bin, which every hook
+// reads, so that a program is read once and not at every launch. The cache holds the
+// programs classified last and is replaced as a whole, like the PATH index (pathcache.h).
+namespace sniff {
+
+   enum class eKind : uint8_t { unknown, native, shell, python, node };
+
+   constexpr size_t s_sniff_size = 512;
+
+   struct sInfo
+   {
+      eKind kind = eKind::unknown;
+      uint16_t machine = 0;   // IMAGE_FILE_MACHINE_* or EM_*, native programs only
+      bool is64 = false;
+      string interpreter;     // the '#!' interpreter, after env
+   };
+
+   sInfo classify(const string& program);
+
+   // Classifies a header already read, path is for the extension only
+   sInfo classify(const string& path, std::string_view header);
+
+   // The extension's launch type for the program, empty when it is left to the extension
+   string debuggerType(const string& program);
+
+} // namespace sniff
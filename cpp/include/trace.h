@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+
+#include "histogram.h"
+
+// Launch-path tracing into a Chrome trace-event file (chrome://tracing, ui.perfetto.dev),
+// enabled by DEEPDEBUGGER_TRACE=<file> or, in the server, --deep-debugger-trace <file>.
+//
+// Stages are stamped with QPC time, the clock process.hrtime uses on Windows, so the
+// extension's events line up with the native ones. A stamp only appends to an in-memory
+// buffer; events are formatted and appended to the file in bulk, under the file's
+// cProcessLock, when the buffer fills up and at exit. Each request carries the trace ID
+// given to it by its hook (deepDbgTraceID) and all its stages are tagged with it, flow
+// events link them across processes.
+namespace trace {
+
+   inline bool s_enabled = false;
+
+   inline bool enabled()
+   {
+      return s_enabled;
+   }
+
+   // Enables tracing if a trace file is given or set in the environment
+   void init(const TCHAR* process_name, const TCHAR* fname = nullptr);
+   void threadName(const char* name);
+
+   uint64_t newId();
+   string formatId(uint64_t id);
+   uint64_t parseId(const string_view& id);
+
+   // A stage of the given request, from start_ns to end_ns (nowNs() time)
+   void complete(const char* name, int64_t start_ns, int64_t end_ns, uint64_t id = 0);
+   void instant(const char* name, uint64_t id = 0);
+
+   // Links the request's stages across processes: 's' starts, 't' continues, 'f' ends the flow
+   void flow(char phase, uint64_t id);
+
+   void flush();
+
+   // Traces the enclosing scope as a stage
+   class cSpan
+   {
+   public:
+      explicit cSpan(const char* name, uint64_t id = 0)
+         : m_name(name), m_id(id), m_start_ns(enabled() ? nowNs() : 0)
+      {
+      }
+      ~cSpan()
+      {
+         if (m_start_ns) {
+            complete(m_name, m_start_ns, nowNs(), m_id);
+         }
+      }
+
+      cSpan(const cSpan&) = delete;
+      cSpan& operator=(const cSpan&) = delete;
+
+      void setId(uint64_t id)
+      {
+         m_id = id;
+      }
+
+   private:
+      const char* m_name;
+      uint64_t m_id;
+      int64_t m_start_ns;
+   };
+
+} // namespace trace
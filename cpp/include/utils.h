@@ -82,9 +82,123 @@ inline string quote(const string_view& str)
    return join(mark, trim(str), mark);
 };
 
+inline string pathString(const fs::path& p)
+{
+#ifdef _UNICODE
+   return p.wstring();
+#else
+   return p.string();
+#endif
+}
+
 int execute(const string_view& cmd);
 string getErrorMessage();
 
+namespace base64 {
+   string Encode(const string_view& data);
+
+   // Returns the error, empty on success
+   string Decode(const string& input, string& out);
+}
+
+// Opens a named pipe for writing. One that does not exist yet or has no free instance is
+// tried again with jittered exponential backoff for up to timeout_ms; waited_us receives the
+// time spent on that, 0 when the pipe opened right away.
+HANDLE openQueue(const string& queue, DWORD timeout_ms = 0, int64_t* waited_us = nullptr);
+
+// Writes one message to a pipe from openQueue and closes it
+bool sendMessage(HANDLE hPipe, const string_view& message);
+
+// Connects to a named pipe and writes one message to it
+bool writeQueue(const string& queue, const string_view& message);
+
+// Value of a string field of a serialized request, found without parsing the whole document
+inline string findJsonString(const string_view& json, const string_view& key)
+{
+   for (size_t pos = json.find(key); pos != string_view::npos; pos = json.find(key, pos + key.size())) {
+      if (pos == 0 || json[pos - 1] != _T('"') || json.substr(pos + key.size(), 1) != _T("\"")) {
+         continue;
+      }
+      auto v = ltrim(json.substr(pos + key.size() + 1));
+      if (v.empty() || v.front() != _T(':')) {
+         continue;
+      }
+      v = ltrim(v.substr(1));
+      if (v.empty() || v.front() != _T('"')) {
+         continue;
+      }
+      string retval;
+      for (size_t i = 1; i < v.size() && v[i] != _T('"'); ++i) {
+         if (v[i] == _T('\\') && i + 1 < v.size()) {
+            ++i;
+         }
+         retval += v[i];
+      }
+      return retval;
+   }
+   return string();
+}
+
+// Adds a string field at the end of the header of a serialized request, a JSON object,
+// the value must need no escaping
+inline void addJsonString(string& message, const string_view& key, const string_view& value)
+{
+   auto end = std::min(message.find(_T('\0')), message.size()) - 1;
+   message.insert(end, fmt::format(_T(R"(,"{}":"{}")"), key, value));
+}
+
+// Request encodings. Version 1 is a JSON document with base64-encoded fields. Version 2
+// is a JSON header with the plain fields ("deepDbgProtocol": 2), a NUL and four blocks
+//
+//    <header>\0<length>:<cwd><length>:<parameters><length>:<arguments><length>:<environment>
+//
+// with decimal lengths in characters. Parameters (key=value), arguments and environment
+// variables are NUL-terminated strings back to back; the environment is the process'
+// environment block as is. The extension sets DEEPDEBUGGER_PROTOCOL to the version it reads.
+//
+// The blocks of a version 2 request may be sent as one LZ4 block (lz4.h) instead, when
+// the extension sets DEEPDEBUGGER_COMPRESS to a size threshold in bytes and the blocks
+// reach it and shrink. The header then says so in string fields: "deepDbgCodec": "lz4",
+// "deepDbgRawSize" (the blocks' size) and "deepDbgCodecUs" (the hook's compression time).
+// Large blocks may also stay in shared memory, with DEEPDEBUGGER_SHARED_MEMORY, see shared.h.
+namespace protocol {
+
+   constexpr int s_max_version = 2;
+   constexpr DWORD s_default_connect_timeout_ms = 5000;
+
+   // The version requests are sent in
+   int version();
+
+   // Smallest blocks compressed, 0 when requests are sent raw
+   size_t compressThreshold();
+
+   // How long hooks wait for the launcher queue to appear (DEEPDEBUGGER_CONNECT_TIMEOUT ms)
+   DWORD connectTimeout();
+
+   // Version 2 requests carry their length in frames, their blocks may hold anything
+   inline bool isBinary(const string_view& message)
+   {
+      return message.find(_T('\0')) != string_view::npos;
+   }
+
+   // Takes the next <length>:<data> block off the tail of a version 2 request, empties it when malformed
+   inline string_view readBlock(string_view& blocks)
+   {
+      size_t len = 0, pos = 0;
+      for (; pos < blocks.size() && _istdigit(blocks[pos]); ++pos) {
+         len = len * 10 + (blocks[pos] - _T('0'));
+      }
+      if (pos == blocks.size() || blocks[pos] != _T(':') || blocks.size() - pos - 1 < len) {
+         blocks = string_view();
+         return string_view();
+      }
+      auto retval = blocks.substr(pos + 1, len);
+      blocks.remove_prefix(pos + 1 + len);
+      return retval;
+   }
+
+} // namespace protocol
+
 struct cConfig
 {
    std::map<string, string> m_params;
@@ -94,14 +208,31 @@ struct cConfig
 
    void add(const string& key, const string& val);
 
+   // Priority class of the request, for the server's scheduler; DEEPDEBUGGER_PRIORITY overrides it
+   void setPriority(const string& priority)
+   {
+      m_priority = priority;
+   }
+
    bool send();
 
-private:
+   // The server gave up on the request before its session started, the program runs on its own
+   bool passthrough() const
+   {
+      return m_passthrough;
+   }
+
+   // The request as sent by send(), public for the benchmark
    string makeConfig();
-   bool await();
+
+private:
+   void addBinaryBlocks(string& message);
+   bool await(HANDLE hPipe, string& reply);
 
    std::vector<string> m_cmdline;
-   string m_session_type, m_parent_session_id, m_queue, m_hook_queue;
+   string m_session_type, m_parent_session_id, m_queue, m_hook_queue, m_priority;
+   uint64_t m_trace_id = 0;
+   bool m_passthrough = false;
 };
 
 inline string_view findValue(const string_view& name, const string_view& buffer)
@@ -154,7 +285,7 @@ namespace dbg {
    inline static bool s_logging_enabled = false;
 
    inline std::shared_ptr<spdlog::logger> logger;
-   inline fs::path lock_path;
+   inline fs::path log_path;
 
    inline void log(const string_view& log_msg)
    {
@@ -177,7 +308,7 @@ namespace dbg {
          if (!logger) {
             string name_str = string(name) + fmt::format(" [{}]", _getpid());
             logger = spdlog::basic_logger_mt(name_str, fname.string().c_str());
-            lock_path = fname.string() + _T(".lock");
+            log_path = fname;
 
          }
          logger->info(_T("Logging started"s));
@@ -190,28 +321,16 @@ namespace dbg {
    {
       return s_logging_enabled;
    }
-   inline void getLock()
-   {
-      while (true) {
-         try {
-            fs::create_directories(lock_path);
-            return;
-         }
-         catch (...) {
-            Sleep(0);
-         }
-      }
-   }
-   inline void releaseLock()
-   {
-      fs::remove(lock_path);
-   }
+
+   // Serialize log writes between processes through <log file>.lck, see cProcessLock
+   bool getLock();
+   void releaseLock(bool locked);
 } // namespace dbg
 
-#define LOG(sfmt, ...) if (dbg::loggingEnabled()) { dbg::getLock(); dbg::log(fmt::format(_T(sfmt), __VA_ARGS__)); dbg::releaseLock(); }
-#define LOGX(sfmt, stmt, ...) if (dbg::loggingEnabled()) { stmt; dbg::getLock(); dbg::log(_T(sfmt)::format(sfmt, __VA_ARGS__)); dbg::releaseLock(); }
+#define LOG(sfmt, ...) if (dbg::loggingEnabled()) { auto locked = dbg::getLock(); dbg::log(fmt::format(_T(sfmt), __VA_ARGS__)); dbg::releaseLock(locked); }
+#define LOGX(sfmt, stmt, ...) if (dbg::loggingEnabled()) { stmt; auto locked = dbg::getLock(); dbg::log(_T(sfmt)::format(sfmt, __VA_ARGS__)); dbg::releaseLock(locked); }
 
 #undef ERROR
-#define ERROR(sfmt, ...) if (dbg::loggingEnabled()) { dbg::getLock(); dbg::error(fmt::format(_T(sfmt), __VA_ARGS__)); dbg::releaseLock(); }
+#define ERROR(sfmt, ...) if (dbg::loggingEnabled()) { auto locked = dbg::getLock(); dbg::error(fmt::format(_T(sfmt), __VA_ARGS__)); dbg::releaseLock(locked); }
 
 #define ENABLE_LOGGING(log, name) dbg::enableLogging(fs::path(_tgetenv(_T("TMP"))) / log, name)
@@ -0,0 +1,164 @@
+#include "pch.h"
+#include "utils.h"
+#include "lock.h"
+#include "histogram.h"
+
+// Command line front end of cProcessLock, the counterpart of flock(1) for scripts:
+//
+//    lock [--timeout <ms>] <file> <command line>     runs the command holding <file>.lck
+//    lock [--timeout <ms>] --hold <file>              holds <file>.lck until stdin is closed
+//    lock --stats <file>                             prints the contention statistics
+//    lock --reset <file>                             clears them
+//    lock --bench <file> [processes] [iterations]    measures contending processes
+
+namespace {
+
+   int benchWorker(const TCHAR* fname, int iterations)
+   {
+      cProcessLock lock(fname);
+      if (!lock.isOpen()) {
+         return 1;
+      }
+      for (int i = 0; i < iterations; ++i) {
+         if (!lock.lock()) {
+            return 1;
+         }
+         lock.unlock();
+      }
+      return 0;
+   }
+
+   int bench(const TCHAR* fname, int processes, int iterations)
+   {
+      cProcessLock lock(fname);
+      if (!lock.isOpen()) {
+         ERROR("Cannot open lock {} ({})", fname, getErrorMessage());
+         return 1;
+      }
+      lock.resetStats();
+
+      TCHAR self[MAX_PATH];
+      GetModuleFileName(nullptr, self, MAX_PATH);
+      auto cmdline = fmt::format(_T("{} --bench-worker {} {}"), quote(self), quote(fname), iterations);
+
+      // Workers start suspended, so that all of them contend from the first iteration
+      std::vector<PROCESS_INFORMATION> workers;
+      for (int i = 0; i < processes; ++i) {
+         STARTUPINFO si{};
+         si.cb = sizeof(si);
+         PROCESS_INFORMATION pi{};
+         string cmd = cmdline;
+         if (!CreateProcess(nullptr, cmd.data(), NULL, NULL, FALSE, CREATE_SUSPENDED, NULL, NULL, &si, &pi)) {
+            ERROR("Cannot start worker {} ({})", i, getErrorMessage());
+            break;
+         }
+         workers.push_back(pi);
+      }
+
+      auto start_ns = nowNs();
+      for (auto& pi : workers) {
+         ResumeThread(pi.hThread);
+      }
+      int failed = 0;
+      for (auto& pi : workers) {
+         WaitForSingleObject(pi.hProcess, INFINITE);
+         DWORD exit_code = 0;
+         GetExitCodeProcess(pi.hProcess, &exit_code);
+         failed += exit_code != 0;
+         CloseHandle(pi.hProcess);
+         CloseHandle(pi.hThread);
+      }
+      auto elapsed_ns = nowNs() - start_ns;
+
+      auto total = (uint64_t)workers.size() * iterations;
+      fmt::print(_T(R"({{"processes":{},"iterations":{},"failed":{},"elapsedUs":{},"acquisitionsPerSec":{},"lock":{}}})"),
+         workers.size(), iterations, failed, elapsed_ns / 1000, elapsed_ns ? total * 1000000000ull / elapsed_ns : 0, lock.stats());
+      fmt::print(_T("\n"));
+      return failed || (int)workers.size() != processes;
+   }
+
+   // For a process that cannot take the lock itself, the extension: prints "locked" once it
+   // has it, and releases it when its stdin is closed, as it also is when that process dies
+   int hold(const TCHAR* fname, DWORD timeout_ms)
+   {
+      cProcessLock lock(fname);
+      if (!lock.lock(timeout_ms)) {
+         ERROR("Cannot lock {} ({})", fname, lock.isOpen() ? _T("timed out"s) : getErrorMessage());
+         return 1;
+      }
+      fmt::print(_T("locked\n"));
+      fflush(stdout);
+
+      char buf[256];
+      DWORD rlen = 0;
+      HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+      while (ReadFile(hStdin, buf, sizeof(buf), &rlen, NULL) && rlen) {
+      }
+      lock.unlock();
+      return 0;
+   }
+
+} // namespace
+
+int _tmain(int argc, TCHAR* argv[])
+{
+   if (argc > 2 && argv[1] == _T("--bench-worker"sv)) {
+      return benchWorker(argv[2], argc > 3 ? _ttoi(argv[3]) : 1000);
+   }
+
+   if (auto log = _tgetenv(_T("DEEPDEBUGGER_LOGFILE"))) {
+      ENABLE_LOGGING(log, _T("lock"));
+   }
+
+   if (argc > 2 && argv[1] == _T("--bench"sv)) {
+      return bench(argv[2], argc > 3 ? _ttoi(argv[3]) : 64, argc > 4 ? _ttoi(argv[4]) : 1000);
+   }
+   if (argc > 2 && (argv[1] == _T("--stats"sv) || argv[1] == _T("--reset"sv))) {
+      cProcessLock lock(argv[2]);
+      if (!lock.isOpen()) {
+         ERROR("Cannot open lock {} ({})", argv[2], getErrorMessage());
+         return 1;
+      }
+      if (argv[1] == _T("--reset"sv)) {
+         lock.resetStats();
+      }
+      else {
+         fmt::print(_T("{}\n"), lock.stats());
+      }
+      return 0;
+   }
+
+   int idx = 1;
+   DWORD timeout_ms = INFINITE;
+   if (argc > 2 && argv[1] == _T("--timeout"sv)) {
+      timeout_ms = (DWORD)_ttoi(argv[2]);
+      idx = 3;
+   }
+   if (idx + 1 < argc && argv[idx] == _T("--hold"sv)) {
+      return hold(argv[idx + 1], timeout_ms);
+   }
+   if (idx + 1 >= argc) {
+      ERROR("Usage: lock [--timeout <ms>] <file> <command line> | [--timeout <ms>] --hold <file>");
+      return 1;
+   }
+
+   // The command is passed on exactly as quoted on our own command line
+   const TCHAR* cmd = GetCommandLine();
+   for (int i = 0; i <= idx; ++i) {
+      cmd = PathGetArgs(cmd);
+   }
+
+   cProcessLock lock(argv[idx]);
+   if (!lock.lock(timeout_ms)) {
+      ERROR("Cannot lock {} ({})", argv[idx], lock.isOpen() ? _T("timed out"s) : getErrorMessage());
+      return 1;
+   }
+   int exit_code = execute(cmd);
+   lock.unlock();
+
+   // Not logged while holding the lock, which may well be the log's own
+   if (lock.recovered()) {
+      LOG("Lock {} recovered from a dead holder", argv[idx]);
+   }
+   return exit_code;
+}
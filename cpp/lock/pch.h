@@ -0,0 +1,19 @@
+
+#pragma once
+
+#include <windows.h>
+#include "Shlwapi.h"
+#include <tchar.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <ctype.h>
+#include <filesystem>
+#include <map>
+#include <vector>
+#include <list>
+
+#include "nlohmann/json.hpp"
+
+#include "spdlog/spdlog.h"
+#include "spdlog/sinks/basic_file_sink.h"
@@ -1,12 +1,18 @@
 
 #include "pch.h"
 #include "utils.h"
+#include "probes.h"
+#include "rules.h"
+#include "trace.h"
+#include "zygote.h"
 
 int _tmain(int argc, TCHAR* argv[])
 {
    if (auto log = _tgetenv(_T("DEEPDEBUGGER_LOGFILE"))) {
       ENABLE_LOGGING(log, _T("python driver"));
    }
+   trace::init(_T("python driver"));
+   trace::cSpan span("python driver");
 
    string_view connect_switch = _T("--connect");
 
@@ -42,9 +48,18 @@ int _tmain(int argc, TCHAR* argv[])
    string cmdline = GetCommandLine();
    string_view args = PathGetArgs(cmdline.data());
 
+   if (launch_debugger) {
+      cMatchRules rules;
+      if (rules.load() && rules.evaluate(python_path, std::span(argv + 1, argc - 1)) == rules::eAction::skip) {
+         launch_debugger = false;
+      }
+   }
+
    if (!launch_debugger) {
       string cmd = joins(python_path_quoted, args);
       LOG("Executing {}", cmd);
+      trace::instant("passthrough");
+      PROBE_PASSTHROUGH_EXEC(GetCurrentProcessId(), cmd.c_str());
       return execute(cmd);
    }
 
@@ -53,6 +68,23 @@ int _tmain(int argc, TCHAR* argv[])
    LOG("Setting session program path to {}", python_path);
    config.add(_T("program"), python_path);
 
+   if (zygote::enabled()) {
+      // The interpreter's own arguments, without the session switches trailing them
+      auto python_args = std::span(argv + 1, argc - 1);
+      while (python_args.size() > 1 && string_view(python_args[python_args.size() - 2]).starts_with(_T("--deep-debugger-"))) {
+         python_args = python_args.first(python_args.size() - 2);
+      }
+      if (zygote::supports(python_args)) {
+         if (auto pid = zygote::claim(python_path, python_args)) {
+            config.add(_T("processId"), fmt::format(_T("{}"), pid));
+         }
+         else {
+            // This session starts cold, the next one finds a zygote (a claimed one starts its own replacement)
+            zygote::start(python_path, fs::path(argv[0]).parent_path());
+         }
+      }
+   }
+
    if (!config.send()) {
       return -1;
    };
@@ -0,0 +1,263 @@
+#include "pch.h"
+#include "utils.h"
+#include "zygote.h"
+
+#include "nlohmann/json.hpp"
+using namespace nlohmann;
+
+namespace {
+
+   constexpr DWORD s_default_attach_timeout_ms = 30000;
+   constexpr int s_idle_timeout_s = 3600;
+
+   // The zygote itself, written next to the driver:
+   //
+   //    python zygote.py <queue> <mutex> <preload> <idle seconds>
+   //
+   // A claim is one message on the queue, {"args", "cwd", "env", "stdio", "attachTimeoutMs"},
+   // answered with the zygote's PID. The standard handles are already duplicated into the zygote.
+   constexpr auto s_script = R"py(# DeepDebugger warm interpreter, written by python_driver, see zygote.h
+import ctypes
+import sys
+
+queue, mutex_name, preload, idle_s = sys.argv[1], sys.argv[2], sys.argv[3], float(sys.argv[4])
+
+# Held while this zygote lives, drivers do not start another one meanwhile
+kernel32 = ctypes.WinDLL('kernel32', use_last_error=True)
+kernel32.CreateMutexW.restype = ctypes.c_void_p
+mutex = kernel32.CreateMutexW(None, False, mutex_name)
+if not mutex or ctypes.get_last_error() == 183:  # ERROR_ALREADY_EXISTS
+    sys.exit(0)
+
+import importlib
+import json
+import msvcrt
+import os
+import runpy
+import subprocess
+import threading
+import time
+from multiprocessing.connection import Listener
+
+import debugpy
+for name in filter(None, (n.strip() for n in preload.split(','))):
+    try:
+        importlib.import_module(name)
+    except Exception:
+        pass
+
+idle = threading.Timer(idle_s, os._exit, (0,))
+idle.daemon = True
+idle.start()
+with Listener(queue, family='AF_PIPE') as listener:
+    conn = listener.accept()
+    idle.cancel()
+job = json.loads(conn.recv_bytes())
+
+# The replacement gets this process' environment, not the session's
+kernel32.CloseHandle(ctypes.c_void_p(mutex))
+subprocess.Popen([sys.executable] + sys.argv, close_fds=True,
+                 stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL,
+                 creationflags=subprocess.DETACHED_PROCESS | subprocess.CREATE_NEW_PROCESS_GROUP)
+
+for fd, (handle, std) in enumerate(zip(job['stdio'], (-10, -11, -12))):
+    if handle:
+        kernel32.SetStdHandle(std, ctypes.c_void_p(handle))
+        os.dup2(msvcrt.open_osfhandle(handle, os.O_RDONLY if fd == 0 else os.O_WRONLY), fd)
+sys.stdin = sys.__stdin__ = open(0, 'r', closefd=False)
+sys.stdout = sys.__stdout__ = open(1, 'w', buffering=1 if os.isatty(1) else -1, closefd=False)
+sys.stderr = sys.__stderr__ = open(2, 'w', buffering=1, closefd=False)
+
+conn.send_bytes(str(os.getpid()).encode())
+conn.close()
+
+os.chdir(job['cwd'])
+os.environ.clear()
+os.environ.update(job['env'])
+
+# debugpy attaching by process ID injects its tracer into this process, no native debugger
+# shows up. Its client connects first, then the program waits for the end of the client's
+# configuration, so that breakpoints on the first lines hold.
+deadline = time.monotonic() + job['attachTimeoutMs'] / 1000
+while not debugpy.is_client_connected() and time.monotonic() < deadline:
+    time.sleep(0.01)
+if debugpy.is_client_connected():
+    give_up = threading.Timer(max(deadline - time.monotonic(), 0), debugpy.wait_for_client.cancel)
+    give_up.daemon = True
+    give_up.start()
+    debugpy.wait_for_client()
+    give_up.cancel()
+
+args = job['args']
+if args[0] == '-m':
+    sys.argv = args[1:]
+    sys.path[0] = os.getcwd()
+    runpy.run_module(args[1], run_name='__main__', alter_sys=True)
+elif args[0] == '-c':
+    sys.argv = ['-c'] + args[2:]
+    sys.path[0] = ''
+    exec(compile(args[1], '<string>', 'exec'), {'__name__': '__main__', '__builtins__': __builtins__})
+else:
+    sys.argv = args
+    sys.path[0] = os.path.dirname(os.path.abspath(args[0]))
+    runpy.run_path(args[0], run_name='__main__')
+)py"sv;
+
+   // Zygotes are per interpreter and preload list
+   string zygoteName(const string& python_path)
+   {
+      string key = fs::path(python_path).lexically_normal().string();
+      std::transform(key.begin(), key.end(), key.begin(), [](TCHAR c) { return (TCHAR)_totlower(c); });
+      if (auto preload = _tgetenv(_T("DEEPDEBUGGER_PYTHON_PRELOAD"))) {
+         key += _T('|');
+         key += preload;
+      }
+      uint64_t h = 14695981039346656037ull;
+      for (auto c : key) {
+         h = (h ^ (uint64_t)(std::make_unsigned_t<TCHAR>)c) * 1099511628211ull;
+      }
+      return fmt::format(_T("deepdbg-zygote-{:016x}"), h);
+   }
+
+   string zygoteQueue(const string& python_path)
+   {
+      return join(_T("\\\\.\\pipe\\"sv), zygoteName(python_path));
+   }
+
+   string zygoteMutex(const string& python_path)
+   {
+      return join(_T("Local\\"sv), zygoteName(python_path));
+   }
+
+   // Rewritten only when it differs from this driver's version
+   bool writeScript(const fs::path& fname)
+   {
+      if (fs::exists(fname)) {
+         std::ifstream inp(fname, std::ios::binary);
+         std::string current((std::istreambuf_iterator<char>(inp)), std::istreambuf_iterator<char>());
+         if (current == s_script) {
+            return true;
+         }
+      }
+
+      // Drivers of concurrent sessions may race here, the rename keeps the file whole
+      auto tmp = fname;
+      tmp += fmt::format(".{}", _getpid());
+      {
+         std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+         if (!(out << s_script)) {
+            return false;
+         }
+      }
+      return MoveFileEx(pathString(tmp).c_str(), pathString(fname).c_str(), MOVEFILE_REPLACE_EXISTING);
+   }
+
+} // namespace
+
+namespace zygote {
+
+   bool enabled()
+   {
+      auto value = _tgetenv(_T("DEEPDEBUGGER_PYTHON_ZYGOTE"));
+      return value && *value && *value != _T('0');
+   }
+
+   bool supports(std::span<TCHAR*> args)
+   {
+      if (args.empty()) {
+         return false;
+      }
+      string_view first = args[0];
+      if (first == _T("-m") || first == _T("-c")) {
+         return args.size() > 1;
+      }
+      return !first.starts_with(_T('-'));
+   }
+
+   DWORD claim(const string& python_path, std::span<TCHAR*> args)
+   {
+      auto queue = zygoteQueue(python_path);
+      HANDLE hPipe = CreateFile(queue.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+      if (hPipe == INVALID_HANDLE_VALUE) {
+         LOG("No zygote on {} ({})", queue, getErrorMessage());
+         return 0;
+      }
+      DWORD mode = PIPE_READMODE_MESSAGE;
+      ULONG pid = 0;
+      HANDLE hProcess = nullptr;
+      if (!SetNamedPipeHandleState(hPipe, &mode, nullptr, nullptr) || !GetNamedPipeServerProcessId(hPipe, &pid) || !(hProcess = OpenProcess(PROCESS_DUP_HANDLE, FALSE, pid))) {
+         ERROR("Cannot claim zygote on {} ({})", queue, getErrorMessage());
+         CloseHandle(hPipe);
+         return 0;
+      }
+
+      json job;
+      job["args"] = json::array();
+      for (auto arg : args) {
+         job["args"].push_back(arg);
+      }
+      job["cwd"] = fs::current_path().string();
+      job["env"] = json::object();
+      for (TCHAR** s = _tenviron; *s; s++) {
+         string_view var = *s;
+         auto eq = var.find(_T('='));
+         if (eq != string_view::npos && eq > 0) {
+            job["env"][string(var.substr(0, eq))] = string(var.substr(eq + 1));
+         }
+      }
+      job["stdio"] = json::array();
+      for (DWORD std_handle : { STD_INPUT_HANDLE, STD_OUTPUT_HANDLE, STD_ERROR_HANDLE }) {
+         HANDLE target = nullptr;
+         auto source = GetStdHandle(std_handle);
+         if (!source || source == INVALID_HANDLE_VALUE || !DuplicateHandle(GetCurrentProcess(), source, hProcess, &target, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+            target = nullptr;
+         }
+         job["stdio"].push_back((uint64_t)(uintptr_t)target);
+      }
+      CloseHandle(hProcess);
+      auto attach_timeout = _tgetenv(_T("DEEPDEBUGGER_PYTHON_ATTACH_TIMEOUT"));
+      job["attachTimeoutMs"] = attach_timeout ? _ttoi(attach_timeout) : s_default_attach_timeout_ms;
+
+      auto message = job.dump(-1, ' ', false, json::error_handler_t::replace);
+      DWORD written = 0, rlen = 0;
+      char reply[32] = {};
+      bool claimed = WriteFile(hPipe, message.data(), (DWORD)message.size(), &written, NULL) && ReadFile(hPipe, reply, sizeof(reply) - 1, &rlen, NULL) && rlen;
+      CloseHandle(hPipe);
+      if (!claimed) {
+         ERROR("Zygote {} did not take the session ({})", pid, getErrorMessage());
+         return 0;
+      }
+      LOG("Session handed to zygote {}", reply);
+      return (DWORD)atoi(reply);
+   }
+
+   void start(const string& python_path, const fs::path& script_dir)
+   {
+      if (HANDLE mutex = OpenMutex(SYNCHRONIZE, FALSE, zygoteMutex(python_path).c_str())) {
+         CloseHandle(mutex);
+         return;
+      }
+
+      auto script = script_dir / _T("zygote.py");
+      if (!writeScript(script)) {
+         ERROR("Cannot write {} ({})", script.string(), getErrorMessage());
+         return;
+      }
+
+      auto preload = _tgetenv(_T("DEEPDEBUGGER_PYTHON_PRELOAD"));
+      string cmd = joins(quote(python_path), quote(pathString(script)), zygoteQueue(python_path), zygoteMutex(python_path),
+         quote(preload ? preload : _T("")), fmt::format(_T("{}"), s_idle_timeout_s));
+      LOG("Starting zygote: {}", cmd);
+
+      STARTUPINFO si{};
+      si.cb = sizeof(si);
+      PROCESS_INFORMATION pi{};
+      if (!CreateProcess(nullptr, cmd.data(), NULL, NULL, FALSE, DETACHED_PROCESS | CREATE_NEW_PROCESS_GROUP, NULL, NULL, &si, &pi)) {
+         ERROR("Cannot start zygote ({})", getErrorMessage());
+         return;
+      }
+      CloseHandle(pi.hThread);
+      CloseHandle(pi.hProcess);
+   }
+
+} // namespace zygote
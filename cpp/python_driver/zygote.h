@@ -0,0 +1,33 @@
+#pragma once
+
+#include <span>
+
+#include "utils.h"
+
+// Warm interpreters for python debug sessions, enabled by DEEPDEBUGGER_PYTHON_ZYGOTE=1.
+//
+// Windows cannot fork, so a zygote here is a python process per interpreter path
+// (and preload list) that has imported debugpy and the modules listed in
+// DEEPDEBUGGER_PYTHON_PRELOAD (comma-separated) and waits on its queue. A session
+// claims it by sending its arguments, working directory, environment and standard
+// handles; the zygote starts its own replacement, takes them over, waits for a debugpy
+// client to connect and finish its configuration (DEEPDEBUGGER_PYTHON_ATTACH_TIMEOUT ms,
+// 30000 by default) and runs the program. The debug session attaches to the zygote by
+// its process ID instead of launching a fresh interpreter.
+//
+// Modules imported before the claim have seen the zygote's environment, not the
+// session's. A zygote exits after an hour without a session.
+namespace zygote {
+
+   bool enabled();
+
+   // Whether a zygote can run the interpreter arguments: a script, -m or -c
+   bool supports(std::span<TCHAR*> args);
+
+   // Hands the session to the zygote of the interpreter, returns its PID, 0 if none is ready
+   DWORD claim(const string& python_path, std::span<TCHAR*> args);
+
+   // Starts a zygote of the interpreter unless one is running or starting, the script goes to script_dir
+   void start(const string& python_path, const fs::path& script_dir);
+
+} // namespace zygote
@@ -0,0 +1,327 @@
+#include "pch.h"
+#include "output.h"
+#include "trace.h"
+
+namespace {
+   constexpr size_t s_gather_limit = 1 << 20;   // bytes combined into one write
+
+   size_t frameSize(const cOutputWriter::sFrame& frame)
+   {
+      auto retval = frame.text.size();
+      for (const auto& [offset, view] : frame.views) {
+         retval += view->blocks().size();
+      }
+      return retval;
+   }
+}
+
+bool cOutputWriter::parsePolicy(string_view name, ePolicy& policy)
+{
+   if (name == _T("block")) {
+      policy = ePolicy::block;
+   }
+   else if (name == _T("spill")) {
+      policy = ePolicy::spill;
+   }
+   else if (name == _T("reject")) {
+      policy = ePolicy::reject;
+   }
+   else {
+      return false;
+   }
+   return true;
+}
+
+cOutputWriter::cOutputWriter(HANDLE out, const sOptions& options)
+   : m_out(out), m_options(options), m_written(CreateEvent(nullptr, FALSE, FALSE, nullptr))
+{
+   m_options.capacity = std::max<size_t>(m_options.capacity, 1);
+   m_thread = std::thread(&cOutputWriter::run, this);
+}
+
+cOutputWriter::~cOutputWriter()
+{
+   stop();
+   if (m_spill) {
+      UnmapViewOfFile(m_spill);
+   }
+   if (m_spill_mapping) {
+      CloseHandle(m_spill_mapping);
+   }
+   if (m_spill_file != INVALID_HANDLE_VALUE) {
+      CloseHandle(m_spill_file);
+   }
+   CloseHandle(m_written);
+}
+
+bool cOutputWriter::push(sFrame&& frame)
+{
+   auto start_us = nowUs();
+   std::unique_lock lock(m_mutex);
+
+   bool full = m_queue.size() >= m_options.capacity || m_spill_frames;
+   if (full) {
+      switch (m_options.policy) {
+      case ePolicy::reject:
+         ++m_rejected;
+         LOG("Output queue full ({} frames), frame rejected", m_queue.size());
+         return false;
+      case ePolicy::spill:
+         if (spill(frame)) {
+            ++m_spilled;
+            m_depth.add();
+            m_ready.notify_one();
+            return true;
+         }
+         LOG("Output spill file full, blocking");
+         break;
+      case ePolicy::block:
+         break;
+      }
+      m_space.wait(lock, [this] { return m_stop || (m_queue.size() < m_options.capacity && !m_spill_frames); });
+      auto stall_us = nowUs() - start_us;
+      m_stall_us.record(stall_us);
+      LOG("Output stalled for {} us", stall_us);
+   }
+
+   m_queue.push_back(std::move(frame));
+   m_depth.add();
+   m_max_depth = std::max(m_max_depth, m_queue.size());
+   m_ready.notify_one();
+   return true;
+}
+
+void cOutputWriter::stop()
+{
+   {
+      std::lock_guard lock(m_mutex);
+      m_stop = true;
+   }
+   m_ready.notify_one();
+   m_space.notify_all();
+   if (m_thread.joinable()) {
+      m_thread.join();
+   }
+}
+
+size_t cOutputWriter::depth() const
+{
+   std::lock_guard lock(m_mutex);
+   return m_queue.size() + m_spill_frames;
+}
+
+string cOutputWriter::stats() const
+{
+   size_t max_depth;
+   {
+      std::lock_guard lock(m_mutex);
+      max_depth = m_max_depth;
+   }
+   return fmt::format(R"({{"depth":{},"maxDepth":{},"frames":{},"bytes":{},"writes":{},"spilled":{},"rejected":{},"stallUs":{},"writeUs":{}}})",
+      depth(), max_depth, m_frames.load(), m_bytes.load(), m_writes.load(), m_spilled.load(), m_rejected.load(), m_stall_us.json(), m_write_us.json());
+}
+
+void cOutputWriter::run()
+{
+   trace::threadName("output writer");
+
+   string data, frame;
+   sFrame shared_frame;
+   while (true) {
+      data.clear();
+      shared_frame = sFrame();
+      size_t frames = 0;
+      {
+         std::unique_lock lock(m_mutex);
+         m_ready.wait(lock, [this] { return m_stop || !m_queue.empty() || m_spill_frames; });
+         if (m_queue.empty() && !m_spill_frames) {
+            break;
+         }
+
+         // Everything in memory was queued before anything in the spill file
+         while (!m_queue.empty() && data.size() < s_gather_limit) {
+            // A frame with views is written on its own, pieces of it straight from the mappings
+            if (!m_queue.front().views.empty()) {
+               if (data.empty()) {
+                  shared_frame = std::move(m_queue.front());
+                  m_queue.pop_front();
+                  ++frames;
+               }
+               break;
+            }
+            data += m_queue.front().text;
+            m_queue.pop_front();
+            ++frames;
+         }
+         while (m_queue.empty() && data.size() < s_gather_limit && unspill(frame)) {
+            data += frame;
+            ++frames;
+         }
+         m_depth.sub(frames);
+      }
+      m_space.notify_all();
+
+      auto start_ns = nowNs();
+      bool written = shared_frame.views.empty() ? writeOut(data.data(), data.size() * sizeof(TCHAR)) : writeFrame(shared_frame);
+      if (!written) {
+         ERROR("Cannot write to stdout ({}), {} frames lost", getErrorMessage(), frames);
+      }
+      auto end_ns = nowNs();
+      trace::complete("write", start_ns, end_ns);
+      m_write_us.record((end_ns - start_ns) / 1000);
+      m_frames += frames;
+      m_bytes += (shared_frame.views.empty() ? data.size() : frameSize(shared_frame)) * sizeof(TCHAR);
+      SetEvent(m_written);
+   }
+}
+
+bool cOutputWriter::writeOut(const void* data, size_t size)
+{
+   // Pipes have no gathering write, frames are combined into one buffer instead
+   auto p = (const char*)data;
+   size_t left = size;
+   while (left) {
+      DWORD written = 0;
+      if (!WriteFile(m_out, p, (DWORD)std::min<size_t>(left, 1u << 30), &written, nullptr)) {
+         return false;
+      }
+      ++m_writes;
+      p += written;
+      left -= written;
+   }
+   return true;
+}
+
+bool cOutputWriter::writeFrame(const sFrame& frame)
+{
+   size_t pos = 0;
+   for (const auto& [offset, view] : frame.views) {
+      auto blocks = view->blocks();
+      if (!writeOut(frame.text.data() + pos, (offset - pos) * sizeof(TCHAR)) || !writeOut(blocks.data(), blocks.size() * sizeof(TCHAR))) {
+         return false;
+      }
+      pos = offset;
+   }
+   return writeOut(frame.text.data() + pos, (frame.text.size() - pos) * sizeof(TCHAR));
+}
+
+bool cOutputWriter::spill(const sFrame& frame)
+{
+   if (!m_spill) {
+      auto fname = fs::temp_directory_path() / fmt::format("deepdbg-spill-{}.bin", _getpid());
+      m_spill_file = CreateFile(pathString(fname).c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+      if (m_spill_file == INVALID_HANDLE_VALUE) {
+         ERROR("Cannot create spill file {} ({})", fname.string(), getErrorMessage());
+         return false;
+      }
+      uint64_t size = m_options.spill_size;
+      m_spill_mapping = CreateFileMapping(m_spill_file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+      if (m_spill_mapping) {
+         m_spill = (uint8_t*)MapViewOfFile(m_spill_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+      }
+      if (!m_spill) {
+         ERROR("Cannot map spill file {} ({})", fname.string(), getErrorMessage());
+         return false;
+      }
+      LOG("Spilling output to {}", fname.string());
+   }
+
+   // Views are copied, the spill file outlives them
+   uint32_t len = (uint32_t)(frameSize(frame) * sizeof(TCHAR));
+   if (m_spill_tail + sizeof(len) + len > m_options.spill_size) {
+      return false;
+   }
+   memcpy(m_spill + m_spill_tail, &len, sizeof(len));
+   auto p = m_spill + m_spill_tail + sizeof(len);
+   size_t pos = 0;
+   auto copy = [&p](const TCHAR* data, size_t size) {
+      memcpy(p, data, size * sizeof(TCHAR));
+      p += size * sizeof(TCHAR);
+   };
+   for (const auto& [offset, view] : frame.views) {
+      copy(frame.text.data() + pos, offset - pos);
+      copy(view->blocks().data(), view->blocks().size());
+      pos = offset;
+   }
+   copy(frame.text.data() + pos, frame.text.size() - pos);
+   m_spill_tail += sizeof(len) + len;
+   ++m_spill_frames;
+   return true;
+}
+
+bool cOutputWriter::unspill(string& frame)
+{
+   if (!m_spill_frames) {
+      return false;
+   }
+   uint32_t len;
+   memcpy(&len, m_spill + m_spill_head, sizeof(len));
+   frame.assign((const TCHAR*)(m_spill + m_spill_head + sizeof(len)), len / sizeof(TCHAR));
+   m_spill_head += sizeof(len) + len;
+   if (!--m_spill_frames) {
+      m_spill_head = m_spill_tail = 0;
+   }
+   return true;
+}
+
+cFrameBuilder::cFrameBuilder(uint64_t sequence, size_t count)
+{
+   if (count == 1) {
+      m_frame.text = _T("start|");
+   }
+   else {
+      m_frame.text = fmt::format(_T("batch|{}|{}|"), sequence, count);
+   }
+}
+
+void cFrameBuilder::add(const string& message, const std::shared_ptr<const shared::cView>& view)
+{
+   auto& data = m_frame.text;
+   auto blocks_size = view ? view->blocks().size() : 0;
+   if (protocol::isBinary(message)) {
+      fmt::format_to(std::back_inserter(data), _T("={}|"), message.size() + blocks_size);
+   }
+   data += message;
+   if (view) {
+      m_frame.views.emplace_back(data.size(), view);
+      m_shared_size += blocks_size;
+   }
+   data += _T('|');
+}
+
+cOutputWriter::sFrame cFrameBuilder::take(size_t& bytes)
+{
+   m_frame.text += _T("end");
+   bytes = (m_frame.text.size() + m_shared_size) * sizeof(TCHAR);
+   return std::move(m_frame);
+}
+
+sRequestHeader sRequestHeader::read(string_view message)
+{
+   auto header = message.substr(0, message.find(_T('\0')));
+   sRequestHeader retval;
+   retval.hook_queue = findJsonString(header, _T("deepDbgHookPipe"));
+   retval.parent_session_id = findJsonString(header, _T("deepDbgParentSessionID"));
+   retval.priority = findJsonString(header, _T("deepDbgPriority"));
+   retval.deadline_ms = _ttoi64(findJsonString(header, _T("deepDbgDeadlineMs")).c_str());
+   retval.connect_wait_us = findJsonString(header, _T("deepDbgConnectWaitUs"));
+   if (header.size() == message.size()) {
+      return retval;
+   }
+
+   retval.section = findJsonString(header, _T("deepDbgSection"));
+   if (!retval.section.empty()) {
+      retval.section_size = (size_t)_ttoi64(findJsonString(header, _T("deepDbgSectionSize")).c_str());
+   }
+   retval.compressed = !findJsonString(header, _T("deepDbgCodec")).empty();
+   if (retval.compressed) {
+      retval.raw_size = (uint64_t)_ttoi64(findJsonString(header, _T("deepDbgRawSize")).c_str());
+      retval.codec_us = (uint64_t)_ttoi64(findJsonString(header, _T("deepDbgCodecUs")).c_str());
+   }
+   return retval;
+}
+
+void addSessionId(string& message, const string& session_id)
+{
+   addJsonString(message, _T("deepDbgSessionID"), session_id);
+}
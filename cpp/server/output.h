@@ -0,0 +1,137 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "metrics.h"
+#include "pool.h"
+#include "shared.h"
+
+// Writes frames to the extension on a dedicated thread, so that a slow or paused
+// reader of the server's stdout does not stop the server accepting connections.
+// Frames are queued in order; when the queue is full the policy decides between
+// blocking the producer, spilling to a memory-mapped overflow file (drained after
+// the in-memory queue, so ordering is kept) or rejecting the frame. Request blocks
+// the server received in shared memory are written straight from their mappings.
+class cOutputWriter
+{
+public:
+   enum class ePolicy { block, spill, reject };
+
+   struct sOptions
+   {
+      size_t capacity = 1024;                // frames held in memory
+      ePolicy policy = ePolicy::block;
+      size_t spill_size = 64 << 20;          // bytes of the overflow file
+   };
+
+   // Text with the blocks of views spliced in at their offsets, in order. The charge of
+   // its requests is released once the frame leaves the queue.
+   struct sFrame
+   {
+      string text;
+      std::vector<std::pair<size_t, std::shared_ptr<const shared::cView>>> views;
+      cMemoryCharge charge;
+   };
+
+   static bool parsePolicy(string_view name, ePolicy& policy);
+
+   cOutputWriter(HANDLE out, const sOptions& options);
+   ~cOutputWriter();
+
+   // False if the frame was rejected
+   bool push(sFrame&& frame);
+   bool push(string&& frame)
+   {
+      return push(sFrame{ std::move(frame) });
+   }
+
+   // Writes out everything queued and stops the writer thread
+   void stop();
+
+   size_t depth() const;
+   string stats() const;
+
+   // Signalled after every write, the output queue may have room again
+   HANDLE writtenEvent() const
+   {
+      return m_written;
+   }
+
+private:
+   void run();
+   bool writeOut(const void* data, size_t size);
+   bool writeFrame(const sFrame& frame);
+
+   bool spill(const sFrame& frame);
+   bool unspill(string& frame);
+
+   HANDLE m_out;
+   sOptions m_options;
+   HANDLE m_written;
+
+   mutable std::mutex m_mutex;
+   std::condition_variable m_ready, m_space;
+   std::deque<sFrame> m_queue;
+   bool m_stop = false;
+
+   HANDLE m_spill_file = INVALID_HANDLE_VALUE;
+   HANDLE m_spill_mapping = nullptr;
+   uint8_t* m_spill = nullptr;
+   size_t m_spill_head = 0, m_spill_tail = 0, m_spill_frames = 0;
+
+   size_t m_max_depth = 0;
+   std::atomic<uint64_t> m_frames = 0, m_bytes = 0, m_writes = 0, m_spilled = 0, m_rejected = 0;
+   metrics::cGauge& m_depth = metrics::gauge("deepdbg_server_output_queue_depth", "Frames waiting to be written to the extension");
+   cHistogram& m_stall_us = metrics::histogram("deepdbg_server_output_stall_microseconds", "Time a producer was blocked on a full output queue");
+   cHistogram& m_write_us = metrics::histogram("deepdbg_server_output_write_microseconds", "Duration of the writes to the extension");
+
+   std::thread m_thread;
+};
+
+// Assembles the frame of requests the server emits together, in the order added:
+//
+//    start|<request>|end                                                   a single request
+//    batch|<sequence number of the first request>|<count>|<request>|...|<request>|end
+//
+// A protocol 2 request goes out as =<length>|<request>, its bytes may include '|'; blocks it
+// left in shared memory are spliced in by the output writer.
+class cFrameBuilder
+{
+public:
+   cFrameBuilder(uint64_t sequence, size_t count);
+
+   void add(const string& message, const std::shared_ptr<const shared::cView>& view);
+
+   // The frame, bytes is its size with the blocks of its views
+   cOutputWriter::sFrame take(size_t& bytes);
+
+private:
+   cOutputWriter::sFrame m_frame;
+   size_t m_shared_size = 0;
+};
+
+// What the server reads from the header of a request (of a protocol 2 request, the part
+// before its blocks), read once when the request gets there
+struct sRequestHeader
+{
+   string hook_queue;               // deepDbgHookPipe
+   string parent_session_id;        // deepDbgParentSessionID
+   string priority;                 // deepDbgPriority, empty for none
+   int64_t deadline_ms = 0;         // deepDbgDeadlineMs, 0 for none
+   string connect_wait_us;          // deepDbgConnectWaitUs, empty if the hook did not wait
+
+   // Protocol 2: blocks left in shared memory and compression, see shared.h and lz4.h
+   string section;                  // deepDbgSection
+   size_t section_size = 0;         // deepDbgSectionSize
+   bool compressed = false;         // deepDbgCodec
+   uint64_t raw_size = 0;           // deepDbgRawSize
+   uint64_t codec_us = 0;           // deepDbgCodecUs
+
+   static sRequestHeader read(string_view message);
+};
+
+// Hands the request the ID of the session the server gave it, in deepDbgSessionID
+void addSessionId(string& message, const string& session_id);
@@ -0,0 +1,230 @@
+#include "pch.h"
+#include "pool.h"
+
+namespace {
+
+   constexpr size_t s_buffer_chunk_size = 16 << 10;
+   constexpr size_t s_buffer_slab_chunks = 64;
+
+   std::atomic<size_t> s_cap = 256 << 20;
+   std::atomic<size_t> s_reserved = 0;
+   std::atomic<size_t> s_limit = 64 << 20;
+
+   struct sPoolMetrics
+   {
+      metrics::cGauge& reserved = metrics::gauge("deepdbg_server_pool_bytes", "Bytes of slabs held by the server's pools");
+      metrics::cGauge& used = metrics::gauge("deepdbg_server_pool_used_bytes", "Bytes of pool chunks in use");
+      metrics::cCounter& refused = metrics::counter("deepdbg_server_pool_refused_total", "Chunks refused because the pools reached the memory cap");
+      metrics::cGauge& charged = metrics::gauge("deepdbg_server_queued_message_bytes", "Bytes of read messages not yet emitted, counted against the memory cap");
+   };
+
+   sPoolMetrics& poolMetrics()
+   {
+      static sPoolMetrics s_metrics;
+      return s_metrics;
+   }
+
+} // namespace
+
+cSlabPool::cSlabPool(size_t chunk_size, size_t slab_chunks)
+   : m_chunk_size((std::max(chunk_size, sizeof(sFree)) + 63) & ~(size_t)63), m_slab_chunks(std::max<size_t>(slab_chunks, 1))
+{
+}
+
+void cSlabPool::setCap(size_t bytes)
+{
+   s_cap = bytes;
+}
+
+void* cSlabPool::allocate(bool force)
+{
+   auto& pool_metrics = poolMetrics();
+   std::lock_guard lock(m_mutex);
+   if (!m_free) {
+      auto slab_size = m_chunk_size * m_slab_chunks;
+      auto cap = s_cap.load();
+      if (s_reserved.fetch_add(slab_size) + slab_size > cap && cap && !force) {
+         s_reserved -= slab_size;
+         pool_metrics.refused.add();
+         return nullptr;
+      }
+      pool_metrics.reserved.add(slab_size);
+
+      // Pages are touched as chunks are first used, not here
+      m_slabs.emplace_back(new uint8_t[slab_size]);
+      auto slab = m_slabs.back().get();
+      for (size_t idx = m_slab_chunks; idx-- > 0;) {
+         auto chunk = (sFree*)(slab + idx * m_chunk_size);
+         chunk->next = m_free;
+         m_free = chunk;
+      }
+   }
+   auto chunk = m_free;
+   m_free = chunk->next;
+   pool_metrics.used.add(m_chunk_size);
+   return chunk;
+}
+
+void cSlabPool::release(void* chunk)
+{
+   std::lock_guard lock(m_mutex);
+   auto free = (sFree*)chunk;
+   free->next = m_free;
+   m_free = free;
+   poolMetrics().used.sub(m_chunk_size);
+}
+
+cMemoryCharge::~cMemoryCharge()
+{
+   release();
+}
+
+cMemoryCharge& cMemoryCharge::operator=(cMemoryCharge&& other) noexcept
+{
+   if (this != &other) {
+      release();
+      m_bytes = std::exchange(other.m_bytes, 0);
+   }
+   return *this;
+}
+
+bool cMemoryCharge::charge(size_t bytes)
+{
+   auto cap = s_cap.load();
+   if (s_reserved.fetch_add(bytes) + bytes > cap && cap) {
+      s_reserved -= bytes;
+      return false;
+   }
+   m_bytes += bytes;
+   poolMetrics().charged.add(bytes);
+   return true;
+}
+
+void cMemoryCharge::merge(cMemoryCharge&& other)
+{
+   m_bytes += std::exchange(other.m_bytes, 0);
+}
+
+void cMemoryCharge::release()
+{
+   if (m_bytes) {
+      s_reserved -= m_bytes;
+      poolMetrics().charged.sub(m_bytes);
+      m_bytes = 0;
+   }
+}
+
+cSlabPool& bufferPool()
+{
+   static cSlabPool s_pool(s_buffer_chunk_size, s_buffer_slab_chunks);
+   return s_pool;
+}
+
+void cMessageBuffer::setLimit(size_t bytes)
+{
+   s_limit = std::max(bytes, s_head_size);
+}
+
+cMessageBuffer::~cMessageBuffer()
+{
+   clear();
+}
+
+void* cMessageBuffer::space(DWORD& size)
+{
+   auto payload = bufferPool().chunkSize() - sizeof(sChunk);
+
+   // A discarded message is read over the first chunk, or the back half of the head
+   if (m_state != eState::complete) {
+      if (m_first) {
+         size = (DWORD)payload;
+         return m_first + 1;
+      }
+      size = (DWORD)(s_head_size - s_head_size / 2);
+      return m_head + s_head_size / 2;
+   }
+
+   if (m_size < s_head_size) {
+      size = (DWORD)(s_head_size - m_size);
+      return m_head + m_size;
+   }
+   if (!m_last || m_last_used == payload) {
+      auto chunk = (sChunk*)bufferPool().allocate();
+      if (!chunk) {
+         discard(eState::refused);
+         return space(size);
+      }
+      chunk->next = nullptr;
+      (m_last ? m_last->next : m_first) = chunk;
+      m_last = chunk;
+      m_last_used = 0;
+   }
+   size = (DWORD)(payload - m_last_used);
+   return (uint8_t*)(m_last + 1) + m_last_used;
+}
+
+void cMessageBuffer::commit(DWORD bytes)
+{
+   auto in_head = m_size < s_head_size;
+   m_size += bytes;
+   if (m_state != eState::complete) {
+      return;
+   }
+   if (!in_head) {
+      m_last_used += bytes;
+   }
+   if (m_size > s_limit) {
+      discard(eState::oversized);
+   }
+}
+
+string cMessageBuffer::take()
+{
+   string retval;
+   if (m_state != eState::complete) {
+      retval.assign((const TCHAR*)m_head, std::min(m_size, s_head_size / 2) / sizeof(TCHAR));
+      clear();
+      return retval;
+   }
+
+   retval.reserve(m_size / sizeof(TCHAR));
+   retval.append((const TCHAR*)m_head, std::min(m_size, s_head_size) / sizeof(TCHAR));
+   auto payload = bufferPool().chunkSize() - sizeof(sChunk);
+   for (auto chunk = m_first; chunk; chunk = chunk->next) {
+      retval.append((const TCHAR*)(chunk + 1), (chunk == m_last ? m_last_used : payload) / sizeof(TCHAR));
+   }
+   clear();
+   return retval;
+}
+
+void cMessageBuffer::discard(eState state)
+{
+   LOG("Message discarded after {} bytes ({})", m_size, state == eState::oversized ? "over the frame size limit" : "memory cap reached");
+   m_state = state;
+
+   // The first chunk, if any, stays for the rest to be read over
+   auto& pool = bufferPool();
+   for (auto chunk = m_first ? m_first->next : nullptr; chunk;) {
+      auto next = chunk->next;
+      pool.release(chunk);
+      chunk = next;
+   }
+   if (m_first) {
+      m_first->next = nullptr;
+   }
+   m_last = m_first;
+}
+
+void cMessageBuffer::clear()
+{
+   auto& pool = bufferPool();
+   for (auto chunk = m_first; chunk;) {
+      auto next = chunk->next;
+      pool.release(chunk);
+      chunk = next;
+   }
+   m_first = m_last = nullptr;
+   m_last_used = 0;
+   m_size = 0;
+   m_state = eState::complete;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "metrics.h"
+
+// Fixed-size chunks carved out of slabs that are never given back. A released chunk goes
+// on the free list and is handed out again, so once there are slabs for the peak load,
+// reading connections allocates nothing. All pools count their slabs against one cap,
+// --deep-debugger-memory-cap bytes: past it a pool refuses to grow and the request that
+// needed the chunk is turned away, instead of the server growing with whatever its
+// hooks send. Messages read and not yet emitted count against the same cap, see
+// cMemoryCharge.
+class cSlabPool
+{
+public:
+   cSlabPool(size_t chunk_size, size_t slab_chunks);
+   cSlabPool(const cSlabPool&) = delete;
+   cSlabPool& operator=(const cSlabPool&) = delete;
+
+   // Bytes all pools may hold in slabs, 0 for no cap
+   static void setCap(size_t bytes);
+
+   // nullptr when a new slab would pass the cap, unless forced past it
+   void* allocate(bool force = false);
+   void release(void* chunk);
+
+   size_t chunkSize() const
+   {
+      return m_chunk_size;
+   }
+
+private:
+   struct sFree
+   {
+      sFree* next;
+   };
+
+   size_t m_chunk_size, m_slab_chunks;
+   std::mutex m_mutex;
+   sFree* m_free = nullptr;
+   std::vector<std::unique_ptr<uint8_t[]>> m_slabs;
+};
+
+// Bytes held outside the pools on behalf of a request, a read message waiting in the
+// scheduler, the batcher or the output queue, counted against the memory cap until the
+// charge is released or destroyed. It moves along with the message.
+class cMemoryCharge
+{
+public:
+   cMemoryCharge() = default;
+   ~cMemoryCharge();
+   cMemoryCharge(cMemoryCharge&& other) noexcept
+      : m_bytes(std::exchange(other.m_bytes, 0))
+   {
+   }
+   cMemoryCharge& operator=(cMemoryCharge&& other) noexcept;
+
+   // False, and nothing charged, when the bytes would pass the cap
+   bool charge(size_t bytes);
+
+   // Takes over the bytes of other, never refused
+   void merge(cMemoryCharge&& other);
+
+   void release();
+
+   size_t bytes() const
+   {
+      return m_bytes;
+   }
+
+private:
+   size_t m_bytes = 0;
+};
+
+// A message read from a connection: its first bytes in the head, which the reader owns,
+// the rest in a chain of chunks from the buffer pool. A message past the frame size limit
+// (--deep-debugger-max-frame bytes), or one the pool refuses a chunk, is discarded as it
+// is read; the head is kept to tell where to send the answer.
+class cMessageBuffer
+{
+public:
+   enum class eState { complete, oversized, refused };
+
+   static constexpr size_t s_head_size = 2048;
+
+   // Largest message kept, in bytes
+   static void setLimit(size_t bytes);
+
+   cMessageBuffer() = default;
+   ~cMessageBuffer();
+   cMessageBuffer(const cMessageBuffer&) = delete;
+   cMessageBuffer& operator=(const cMessageBuffer&) = delete;
+
+   // Where the next read goes, and how much fits
+   void* space(DWORD& size);
+   void commit(DWORD bytes);
+
+   eState state() const
+   {
+      return m_state;
+   }
+   size_t size() const
+   {
+      return m_size;
+   }
+
+   // The message, in one allocation, or the head of one that was discarded; releases the chunks
+   string take();
+
+private:
+   struct sChunk
+   {
+      sChunk* next;
+   };
+
+   void discard(eState state);
+   void clear();
+
+   uint8_t m_head[s_head_size];
+   sChunk* m_first = nullptr;
+   sChunk* m_last = nullptr;
+   size_t m_last_used = 0;
+   size_t m_size = 0;
+   eState m_state = eState::complete;
+};
+
+// The pool of cMessageBuffer chunks
+cSlabPool& bufferPool();
@@ -0,0 +1,114 @@
+#include "pch.h"
+#include "scheduler.h"
+#include "trace.h"
+
+namespace {
+   constexpr const TCHAR* s_priority_names[cScheduler::s_classes] = { _T("interactive"), _T("normal"), _T("bulk") };
+}
+
+bool cScheduler::parsePriority(string_view name, ePriority& priority)
+{
+   for (size_t idx = 0; idx < s_classes; ++idx) {
+      if (name == s_priority_names[idx]) {
+         priority = (ePriority)idx;
+         return true;
+      }
+   }
+   return false;
+}
+
+cScheduler::cScheduler(cOutputWriter& writer, size_t max_depth)
+   : m_writer(writer), m_max_depth(std::max<size_t>(max_depth, 1))
+{
+}
+
+void cScheduler::add(ePriority priority, sRequest&& request)
+{
+   request.arrival_ns = nowNs();
+   if (request.deadline_ns) {
+      m_deadlines.push(request.deadline_ns);
+   }
+   m_pending[(size_t)priority].push_back(std::move(request));
+   m_waiting.add();
+}
+
+DWORD cScheduler::timeout() const
+{
+   if (m_deadlines.empty()) {
+      return INFINITE;
+   }
+   int64_t left = m_deadlines.top() - nowNs();
+   return left > 0 ? (DWORD)((left + 999999) / 1000000) : 0;
+}
+
+void cScheduler::dispatch(const fHandler& emit, const fHandler& expire, bool all)
+{
+   if (!m_deadlines.empty() && m_deadlines.top() <= nowNs()) {
+      this->expire(expire);
+   }
+
+   // The output queue is only asked while something waits, it takes a lock
+   for (size_t idx = 0; idx < s_classes; ++idx) {
+      auto& pending = m_pending[idx];
+      while (!pending.empty() && (all || m_writer.depth() < m_max_depth)) {
+         auto request = std::move(pending.front());
+         pending.pop_front();
+         m_waiting.sub();
+         auto now_ns = nowNs();
+         m_wait_us[idx]->record((now_ns - request.arrival_ns) / 1000);
+         trace::complete("schedule", request.arrival_ns, now_ns, request.trace_id);
+         emit(std::move(request));
+      }
+   }
+}
+
+void cScheduler::expire(const fHandler& handler)
+{
+   auto now_ns = nowNs();
+   size_t expired = 0;
+   for (size_t idx = 0; idx < s_classes; ++idx) {
+      expired += std::erase_if(m_pending[idx], [&](sRequest& request) {
+         if (!request.deadline_ns || request.deadline_ns > now_ns) {
+            return false;
+         }
+         m_wait_us[idx]->record((now_ns - request.arrival_ns) / 1000);
+         LOG("Request of {} expired after {} us waiting as {}", request.pid, (now_ns - request.arrival_ns) / 1000, s_priority_names[idx]);
+         handler(std::move(request));
+         return true;
+      });
+   }
+
+   // Deadlines gone by belong to requests expired just now or released earlier
+   while (!m_deadlines.empty() && m_deadlines.top() <= now_ns) {
+      m_deadlines.pop();
+   }
+   m_expired.add(expired);
+   m_waiting.sub(expired);
+}
+
+template <typename F>
+std::vector<string> cScheduler::dropIf(F&& dropped)
+{
+   std::vector<string> retval;
+   for (auto& pending : m_pending) {
+      std::erase_if(pending, [&](sRequest& r) {
+         if (!dropped(r)) {
+            return false;
+         }
+         retval.push_back(std::move(r.session_id));
+         return true;
+      });
+   }
+   m_waiting.sub(retval.size());
+   return retval;
+}
+
+std::vector<string> cScheduler::drop(DWORD pid)
+{
+   return dropIf([pid](const sRequest& r) { return r.pid == pid; });
+}
+
+std::vector<string> cScheduler::drop(const std::unordered_set<string>& session_ids)
+{
+   return dropIf([&session_ids](const sRequest& r) { return session_ids.contains(r.session_id); });
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <queue>
+#include <unordered_set>
+
+#include "output.h"
+
+// Holds requests until the output queue has room for them. They are released to the
+// batcher while fewer than --deep-debugger-schedule-depth frames wait to be written to
+// the extension, the highest priority class first and each class in arrival order; as
+// long as the extension keeps up nothing waits here at all. The classes are
+//
+//    interactive    direct children of a debug session, the user is likely waiting for them
+//    normal         everything else
+//    bulk           sessions --deep-debugger-bulk-depth or more levels down the tree
+//
+// unless the request names its class in deepDbgPriority, which the hook takes from
+// DEEPDEBUGGER_PRIORITY or from the hook variable it was started through. A request may
+// also carry deepDbgDeadlineMs: still waiting that long after it got here, it is expired
+// and its hook runs the program without a debugger.
+class cScheduler
+{
+public:
+   enum class ePriority { interactive, normal, bulk };
+   static constexpr size_t s_classes = 3;
+
+   struct sRequest
+   {
+      DWORD pid;
+      string message;
+      uint64_t trace_id;
+      std::shared_ptr<const shared::cView> view;
+      string session_id;
+      string hook_queue;
+      int64_t arrival_ns = 0;
+      int64_t deadline_ns = 0;            // 0 for none
+      cMemoryCharge charge;               // of message
+   };
+
+   using fHandler = std::function<void(sRequest&&)>;
+
+   static bool parsePriority(string_view name, ePriority& priority);
+
+   cScheduler(cOutputWriter& writer, size_t max_depth);
+
+   void add(ePriority priority, sRequest&& request);
+
+   // Time left until the nearest deadline, INFINITE if there is none
+   DWORD timeout() const;
+
+   // Passes the expired requests to expire, then releases requests to emit while the
+   // output queue has room, or all of them
+   void dispatch(const fHandler& emit, const fHandler& expire, bool all = false);
+
+   // Forgets the requests of a requester that is gone, or of sessions that were stopped;
+   // returns their sessions
+   std::vector<string> drop(DWORD pid);
+   std::vector<string> drop(const std::unordered_set<string>& session_ids);
+
+private:
+   void expire(const fHandler& handler);
+
+   template <typename F>
+   std::vector<string> dropIf(F&& dropped);
+
+   cOutputWriter& m_writer;
+   size_t m_max_depth;
+   std::deque<sRequest> m_pending[s_classes];
+
+   // Deadlines of the requests given one, some already released: the earliest tells when to look
+   std::priority_queue<int64_t, std::vector<int64_t>, std::greater<int64_t>> m_deadlines;
+
+   metrics::cGauge& m_waiting = metrics::gauge("deepdbg_server_scheduled_requests", "Requests waiting for room in the output queue");
+   metrics::cCounter& m_expired = metrics::counter("deepdbg_server_expired_requests_total", "Requests passed through undebugged because their deadline went by");
+   cHistogram* m_wait_us[s_classes] = {
+      &metrics::histogram("deepdbg_server_queue_wait_interactive_microseconds", "Time interactive requests waited for room in the output queue"),
+      &metrics::histogram("deepdbg_server_queue_wait_normal_microseconds", "Time normal requests waited for room in the output queue"),
+      &metrics::histogram("deepdbg_server_queue_wait_bulk_microseconds", "Time bulk requests waited for room in the output queue"),
+   };
+};
@@ -1,17 +1,548 @@
-
 #include "pch.h"
+#include "capture.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "output.h"
+#include "pool.h"
+#include "probes.h"
+#include "scheduler.h"
+#include "sessions.h"
+#include "shared.h"
+#include "trace.h"
+#include "watcher.h"
+#include "workers.h"
 
 static bool sClientConnected;
 
+namespace {
+
+   constexpr size_t queue_bufsize = 10000;
+   constexpr DWORD query_timeout_ms = 5000;
+
+   // Registered on first use, which is before the server starts listening, so every series is there from the start
+   struct sMetrics
+   {
+      metrics::cCounter& messages = metrics::counter("deepdbg_server_messages_received_total", "Messages read from the launcher queue");
+      metrics::cCounter& bytes = metrics::counter("deepdbg_server_bytes_received_total", "Bytes read from the launcher queue");
+      metrics::cGauge& connections = metrics::gauge("deepdbg_server_connections_in_flight", "Launcher queue connections being read");
+      metrics::cGauge& pending = metrics::gauge("deepdbg_server_pending_requests", "Requests waiting for their batch to be emitted");
+      cHistogram& frame_bytes = metrics::histogram("deepdbg_server_frame_bytes", "Size of the frames sent to the extension");
+      cHistogram& read_to_emit_us = metrics::histogram("deepdbg_server_read_to_emit_microseconds", "Time from reading a request to queueing its frame for the extension");
+      metrics::cCounter& rejected = metrics::counter("deepdbg_server_rejected_requests_total", "Requests told to retry later because the output queue was full");
+      metrics::cCounter& compressed = metrics::counter("deepdbg_server_compressed_requests_total", "Requests whose blocks came compressed");
+      metrics::cCounter& saved_bytes = metrics::counter("deepdbg_server_compression_saved_bytes_total", "Bytes not carried thanks to compression");
+      cHistogram& compression_ratio = metrics::histogram("deepdbg_server_compression_ratio_percent", "Size of compressed request blocks before compression, in percent of their size after");
+      cHistogram& codec_us = metrics::histogram("deepdbg_server_codec_microseconds", "Time the hooks spent compressing request blocks");
+      metrics::cCounter& shared_requests = metrics::counter("deepdbg_server_shared_requests_total", "Requests whose blocks came in shared memory");
+      metrics::cCounter& shared_bytes = metrics::counter("deepdbg_server_shared_bytes_total", "Bytes of request blocks mapped instead of read from the launcher queue");
+      metrics::cGauge& sessions = metrics::gauge("deepdbg_server_sessions", "Sessions in the session tree");
+      metrics::cCounter& stopped_sessions = metrics::counter("deepdbg_server_stopped_sessions_total", "Sessions stopped along with a subtree");
+      cHistogram& connect_wait_us = metrics::histogram("deepdbg_server_connect_wait_microseconds", "Time hooks waited for the launcher queue to appear, of those that had to");
+      metrics::cCounter& oversized = metrics::counter("deepdbg_server_oversized_requests_total", "Requests over the frame size limit, passed through undebugged");
+      metrics::cCounter& refused = metrics::counter("deepdbg_server_refused_requests_total", "Requests told to retry later because the memory cap was reached");
+   };
+
+   sMetrics& serverMetrics()
+   {
+      static sMetrics s_metrics;
+      return s_metrics;
+   }
+
+   // Compression as reported in the header of a version 2 request, sent is the size of its blocks
+   void recordCodec(const sRequestHeader& header, size_t sent)
+   {
+      if (!header.compressed) {
+         return;
+      }
+      auto& server_metrics = serverMetrics();
+      auto raw = header.raw_size;
+      server_metrics.compressed.add();
+      if (raw > sent && sent) {
+         server_metrics.saved_bytes.add(raw - sent);
+         server_metrics.compression_ratio.record(raw * 100 / sent);
+      }
+      server_metrics.codec_us.record(header.codec_us);
+   }
+
+   // The blocks of a version 2 request that left them in shared memory, see shared.h. Only a
+   // request without blocks after the header is looked at, a captured one carries them.
+   // nullptr when the section cannot be mapped, the hook is then asked for the blocks inline
+   std::shared_ptr<const shared::cView> openSection(DWORD pid, const sRequestHeader& header)
+   {
+      const auto& handle = header.section;
+      auto size = header.section_size;
+      auto view = shared::cView::open(pid, handle, size);
+      if (!view) {
+         const auto& hook_queue = header.hook_queue;
+         ERROR("Cannot map section {} of the request of {}, asking {} for the blocks", handle, pid, hook_queue);
+         if (hook_queue.empty() || !writeQueue(hook_queue, _T("inline"))) {
+            ERROR("Cannot send inline to the hook of {} ({})", pid, hook_queue.empty() ? _T("no hook queue in the request"s) : getErrorMessage());
+         }
+         return nullptr;
+      }
+      auto& server_metrics = serverMetrics();
+      server_metrics.shared_requests.add();
+      server_metrics.shared_bytes.add(size);
+      return view;
+   }
+
+   // Listening end of the launcher queue. A pipe instance is always kept pending,
+   // so that clients connecting while the previous message is being processed
+   // queue up instead of failing to open the pipe. The queue appears whole, with
+   // its first instance, and belongs to this server alone.
+   class cListener
+   {
+   public:
+      cListener(const string& queue)
+         : m_queue(queue), m_event(CreateEvent(nullptr, TRUE, FALSE, nullptr))
+      {
+      }
+      ~cListener()
+      {
+         if (m_pipe != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_pipe);
+         }
+         CloseHandle(m_event);
+      }
+
+      // Creates the queue, false when it cannot or another server owns it. An earlier
+      // server that was told to stop may still be on its way out, it gets a second.
+      bool start()
+      {
+         for (int attempt = 0; attempt < 100; ++attempt) {
+            if (listen(true)) {
+               return true;
+            }
+            if (GetLastError() != ERROR_ACCESS_DENIED) {
+               break;
+            }
+            Sleep(10);
+         }
+         return false;
+      }
+
+      // Returns the connected pipe, nullptr on timeout or when woken up, INVALID_HANDLE_VALUE on failure
+      HANDLE accept(DWORD timeout_ms, std::initializer_list<HANDLE> wake)
+      {
+         if (!m_pending && !listen()) {
+            return INVALID_HANDLE_VALUE;
+         }
+
+         if (m_connecting) {
+            HANDLE handles[MAXIMUM_WAIT_OBJECTS] = { m_event };
+            std::copy(wake.begin(), wake.end(), handles + 1);
+            auto wait = WaitForMultipleObjects(1 + (DWORD)wake.size(), handles, FALSE, timeout_ms);
+            if (wait == WAIT_TIMEOUT || (wait > WAIT_OBJECT_0 && wait <= WAIT_OBJECT_0 + wake.size())) {
+               return nullptr;
+            }
+            DWORD dummy = 0;
+            if (wait != WAIT_OBJECT_0 || !GetOverlappedResult(m_pipe, &m_ov, &dummy, FALSE)) {
+               ERROR("Cannot connect queue {} ({})", m_queue, getErrorMessage());
+               CloseHandle(m_pipe);
+               m_pipe = INVALID_HANDLE_VALUE;
+               m_pending = false;
+               return INVALID_HANDLE_VALUE;
+            }
+         }
+
+         HANDLE connected = m_pipe;
+         m_pipe = INVALID_HANDLE_VALUE;
+         m_pending = false;
+         listen();
+         return connected;
+      }
+
+   private:
+      bool listen(bool first = false)
+      {
+         DWORD pipeMode = PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT;
+         DWORD openMode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0);
+         m_pipe = CreateNamedPipe(m_queue.c_str(), openMode, pipeMode, PIPE_UNLIMITED_INSTANCES, queue_bufsize, queue_bufsize, NMPWAIT_USE_DEFAULT_WAIT, nullptr);
+         if (m_pipe == INVALID_HANDLE_VALUE) {
+            auto error = GetLastError();
+            ERROR("Cannot create queue {} ({})", m_queue, getErrorMessage());
+            SetLastError(error);
+            return false;
+         }
+
+         m_ov = OVERLAPPED{};
+         m_ov.hEvent = m_event;
+         ResetEvent(m_event);
+         m_connecting = false;
+         if (!ConnectNamedPipe(m_pipe, &m_ov)) {
+            switch (GetLastError()) {
+            case ERROR_IO_PENDING:
+               m_connecting = true;
+               break;
+            case ERROR_PIPE_CONNECTED:
+               break;
+            default:
+               ERROR("Cannot connect queue {} ({})", m_queue, getErrorMessage());
+               CloseHandle(m_pipe);
+               m_pipe = INVALID_HANDLE_VALUE;
+               return false;
+            }
+         }
+         m_pending = true;
+         return true;
+      }
+
+      string m_queue;
+      HANDLE m_event;
+      HANDLE m_pipe = INVALID_HANDLE_VALUE;
+      OVERLAPPED m_ov{};
+      bool m_pending = false;
+      bool m_connecting = false;
+   };
+
+   // Reads one message, which ends when the client disconnects
+   bool readMessage(HANDLE hPipe, cMessageBuffer& message)
+   {
+      HANDLE event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+      bool success = true;
+      while (true) {
+         OVERLAPPED ov{};
+         ov.hEvent = event;
+         DWORD size = 0, rlen = 0;
+         auto buf = message.space(size);
+         if (!ReadFile(hPipe, buf, size, &rlen, &ov) && (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(hPipe, &ov, &rlen, TRUE))) {
+            if (GetLastError() == ERROR_BROKEN_PIPE) {
+               LOG("Client disconnected");
+            }
+            else {
+               ERROR("ReadFile failed ({})", getErrorMessage());
+               success = false;
+            }
+            break;
+         }
+         if (!rlen) {
+            continue;
+         }
+         LOG("Read from queue: {} bytes", rlen);
+         message.commit(rlen);
+      }
+      CloseHandle(event);
+      CloseHandle(hPipe);
+      return success;
+   }
+
+   // Coalesces launch requests into batch frames. Requests are numbered in the order
+   // the scheduler releases them and are always emitted in that order: a batch frame,
+   // see cFrameBuilder, is written once the window since its first request elapses or
+   // the batch is full. Single requests keep the plain start|<request>|end framing.
+   class cBatcher
+   {
+   public:
+      cBatcher(cOutputWriter& writer, int64_t window_us, size_t max_size, DWORD retry_after_ms)
+         : m_writer(writer), m_window_us(window_us), m_max_size(std::max<size_t>(max_size, 1)), m_retry_after_ms(retry_after_ms)
+      {
+      }
+
+      // Time left until the pending batch must be emitted, INFINITE if there is none
+      DWORD timeout() const
+      {
+         if (m_pending.empty()) {
+            return INFINITE;
+         }
+         int64_t left = m_first_us + m_window_us - nowUs();
+         return left > 0 ? (DWORD)((left + 999) / 1000) : 0;
+      }
+
+      // Both return the sessions of a frame the output writer rejected, their hooks were told to retry
+      std::vector<string> add(DWORD pid, string&& message, string&& session_id, uint64_t trace_id = 0, std::shared_ptr<const shared::cView> view = nullptr, cMemoryCharge&& charge = {})
+      {
+         if (m_pending.empty()) {
+            m_first_us = nowUs();
+         }
+         m_pending.push_back({ pid, std::move(message), std::move(session_id), trace_id, nowNs(), std::move(view), std::move(charge) });
+         m_metrics.pending.add();
+         if (m_window_us <= 0 || m_pending.size() >= m_max_size || !timeout()) {
+            return flush();
+         }
+         return {};
+      }
+
+      std::vector<string> flush()
+      {
+         std::vector<string> rejected;
+         if (m_pending.empty()) {
+            return rejected;
+         }
+
+         cFrameBuilder builder(m_sequence, m_pending.size());
+         for (const auto& request : m_pending) {
+            builder.add(request.message, request.view);
+         }
+         size_t frame_bytes;
+         auto frame = builder.take(frame_bytes);
+         for (auto& request : m_pending) {
+            frame.charge.merge(std::move(request.charge));
+         }
+         LOG("stdout: {}", frame.text);
+         m_metrics.frame_bytes.record(frame_bytes);
+         PROBE_FRAME_EMIT(m_sequence, m_pending.size(), frame_bytes);
+
+         // The numbers of a rejected frame are given to the next one, the extension never sees them
+         bool accepted = m_writer.push(std::move(frame));
+         if (!accepted) {
+            rejected = reject();
+         }
+
+         auto now_ns = nowNs();
+         for (const auto& request : m_pending) {
+            m_metrics.read_to_emit_us.record((now_ns - request.arrival_ns) / 1000);
+            trace::complete("batch", request.arrival_ns, now_ns, request.trace_id);
+         }
+         m_metrics.pending.sub(m_pending.size());
+
+         auto latency = nowUs() - m_first_us;
+         m_latency_us.record(latency);
+         m_sizes.record(m_pending.size());
+         LOG("Batch {} {}: {} requests, {} us", m_sequence, accepted ? "emitted" : "rejected", m_pending.size(), latency);
+
+         if (accepted) {
+            m_sequence += m_pending.size();
+         }
+         m_pending.clear();
+         return rejected;
+      }
+
+      // Forgets the requests of a requester that is gone, or of sessions that were stopped;
+      // returns their sessions
+      std::vector<string> drop(DWORD pid)
+      {
+         return dropIf([pid](const sRequest& r) { return r.pid == pid; });
+      }
+      std::vector<string> drop(const std::unordered_set<string>& session_ids)
+      {
+         return dropIf([&session_ids](const sRequest& r) { return session_ids.contains(r.session_id); });
+      }
+
+      string stats() const
+      {
+         return fmt::format(R"({{"requests":{},"batchLatencyUs":{},"batchSize":{},"output":{}}})", m_sequence, m_latency_us.json(), m_sizes.json(), m_writer.stats());
+      }
+
+   private:
+      // Tells every hook of a rejected frame to send its request again later, returns their
+      // sessions: a request sent again gets a new one
+      std::vector<string> reject()
+      {
+         string reply = fmt::format(_T("retry-after|{}"), m_retry_after_ms);
+         m_metrics.rejected.add(m_pending.size());
+         std::vector<string> retval;
+         for (auto& request : m_pending) {
+            auto hook_queue = findJsonString(request.message, _T("deepDbgHookPipe"));
+            if (hook_queue.empty() || !writeQueue(hook_queue, reply)) {
+               ERROR("Cannot send {} to {} ({})", reply, hook_queue, getErrorMessage());
+            }
+            retval.push_back(std::move(request.session_id));
+         }
+         return retval;
+      }
+
+      template <typename F>
+      std::vector<string> dropIf(F&& dropped)
+      {
+         std::vector<string> retval;
+         std::erase_if(m_pending, [&](sRequest& r) {
+            if (!dropped(r)) {
+               return false;
+            }
+            retval.push_back(std::move(r.session_id));
+            return true;
+         });
+         m_metrics.pending.sub(retval.size());
+         return retval;
+      }
+
+      struct sRequest
+      {
+         DWORD pid;
+         string message;
+         string session_id;
+         uint64_t trace_id;
+         int64_t arrival_ns;
+         std::shared_ptr<const shared::cView> view;
+         cMemoryCharge charge;
+      };
+
+      cOutputWriter& m_writer;
+      int64_t m_window_us;
+      size_t m_max_size;
+      DWORD m_retry_after_ms;
+      int64_t m_first_us = 0;
+      uint64_t m_sequence = 0;
+      std::vector<sRequest> m_pending;
+      cHistogram m_latency_us, m_sizes;
+      sMetrics& m_metrics = serverMetrics();
+   };
+
+   // Queries are answered on a queue named after the server's and on no other, so that a
+   // control request cannot make the server write to just any pipe
+   string replyQueuePrefix(const string& queue)
+   {
+      return join(queue, _T(".query."sv));
+   }
+
+   bool isReplyQueue(const string& queue, string_view reply_queue)
+   {
+      auto prefix = replyQueuePrefix(queue);
+      return reply_queue.size() > prefix.size() && reply_queue.starts_with(prefix);
+   }
+
+   // Asks a running server something, the server writes the answer to the reply queue
+   // named last in the control request:
+   //
+   //    stats|<reply queue>                  its metrics
+   //    parent|<session id>|<reply queue>    {"parent": <ID of the session's parent, null for a root>}
+   bool query(const string& queue, const string& request, string& reply)
+   {
+      auto reply_queue = fmt::format(_T("{}{}"), replyQueuePrefix(queue), _getpid());
+      DWORD pipeMode = PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT;
+      HANDLE hPipe = CreateNamedPipe(reply_queue.c_str(), PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED, pipeMode, 1, queue_bufsize, queue_bufsize, NMPWAIT_USE_DEFAULT_WAIT, nullptr);
+      if (hPipe == INVALID_HANDLE_VALUE) {
+         ERROR("Cannot create reply queue {} ({})", reply_queue, getErrorMessage());
+         return false;
+      }
+      if (!writeQueue(queue, join(request, _T("|"sv), reply_queue))) {
+         ERROR("Cannot write to queue {} ({})", queue, getErrorMessage());
+         CloseHandle(hPipe);
+         return false;
+      }
+
+      OVERLAPPED ov{};
+      ov.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+      bool connected = ConnectNamedPipe(hPipe, &ov) || GetLastError() == ERROR_PIPE_CONNECTED;
+      if (!connected && GetLastError() == ERROR_IO_PENDING) {
+         DWORD dummy = 0;
+         connected = WaitForSingleObject(ov.hEvent, query_timeout_ms) == WAIT_OBJECT_0 && GetOverlappedResult(hPipe, &ov, &dummy, FALSE);
+         if (!connected) {
+            CancelIoEx(hPipe, &ov);
+         }
+      }
+      CloseHandle(ov.hEvent);
+      if (!connected) {
+         ERROR("No reply on {} ({})", reply_queue, getErrorMessage());
+         CloseHandle(hPipe);
+         return false;
+      }
+      cMessageBuffer message;
+      bool success = readMessage(hPipe, message) && message.state() == cMessageBuffer::eState::complete;
+      reply = message.take();
+      return success && !reply.empty();
+   }
+
+   // Answers the hook of a request that was discarded as it was read, or that was read but
+   // does not fit under the memory cap, from its head: one over the frame size limit runs
+   // undebugged, one that met the memory cap is sent again
+   void turnAway(DWORD pid, cMessageBuffer::eState state, const string& head, DWORD retry_after_ms)
+   {
+      auto& server_metrics = serverMetrics();
+      string reply;
+      if (state == cMessageBuffer::eState::oversized) {
+         server_metrics.oversized.add();
+         reply = _T("passthrough");
+      }
+      else {
+         server_metrics.refused.add();
+         reply = fmt::format(_T("retry-after|{}"), retry_after_ms);
+      }
+      auto hook_queue = findJsonString(string_view(head).substr(0, head.find(_T('\0'))), _T("deepDbgHookPipe"));
+      if (hook_queue.empty() || !writeQueue(hook_queue, reply)) {
+         ERROR("Cannot send {} to the hook of {} ({})", reply, pid, hook_queue.empty() ? _T("no hook queue in the request"s) : getErrorMessage());
+      }
+   }
+
+} // namespace
+
 int _tmain(int argc, TCHAR* argv[])
 {
-   TCHAR* log = nullptr, * posArg[2] = { nullptr, nullptr };
+   TCHAR* log = nullptr, * capture_file = nullptr, * trace_file = nullptr, * metrics_file = nullptr, * posArg[2] = { nullptr, nullptr };
+   DWORD metrics_interval_ms = 5000;
+   string query_request;
+   int64_t batch_window_us = 0;
+   size_t batch_size = 64;
+   DWORD retry_after_ms = 100;
+   size_t worker_count = 1;
+   size_t schedule_depth = 4, bulk_depth = 4;
+   cOutputWriter::sOptions output_options;
    for (int idx = 1, ai = 0; idx < argc; ++idx) {
       if (argv[idx] == _T("--deep-debugger-log-file"sv)) {
          log = argv[++idx];
          continue;
       }
-      posArg[ai++] = argv[idx];
+      if (argv[idx] == _T("--deep-debugger-batch-window"sv) && idx + 1 < argc) {
+         batch_window_us = _ttoi64(argv[++idx]);
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-batch-size"sv) && idx + 1 < argc) {
+         batch_size = (size_t)_ttoi64(argv[++idx]);
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-output-queue"sv) && idx + 1 < argc) {
+         output_options.capacity = (size_t)_ttoi64(argv[++idx]);
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-output-policy"sv) && idx + 1 < argc) {
+         cOutputWriter::parsePolicy(argv[++idx], output_options.policy);
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-spill-size"sv) && idx + 1 < argc) {
+         output_options.spill_size = (size_t)_ttoi64(argv[++idx]);
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-retry-after"sv) && idx + 1 < argc) {
+         retry_after_ms = (DWORD)_ttoi64(argv[++idx]);
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-schedule-depth"sv) && idx + 1 < argc) {
+         schedule_depth = (size_t)_ttoi64(argv[++idx]);
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-bulk-depth"sv) && idx + 1 < argc) {
+         bulk_depth = std::max<size_t>((size_t)_ttoi64(argv[++idx]), 2);
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-memory-cap"sv) && idx + 1 < argc) {
+         cSlabPool::setCap((size_t)_ttoi64(argv[++idx]));
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-max-frame"sv) && idx + 1 < argc) {
+         cMessageBuffer::setLimit((size_t)_ttoi64(argv[++idx]));
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-workers"sv) && idx + 1 < argc) {
+         worker_count = std::clamp<size_t>((size_t)_ttoi64(argv[++idx]), 1, 64);
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-capture"sv) && idx + 1 < argc) {
+         capture_file = argv[++idx];
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-trace"sv) && idx + 1 < argc) {
+         trace_file = argv[++idx];
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-metrics-file"sv) && idx + 1 < argc) {
+         metrics_file = argv[++idx];
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-metrics-interval"sv) && idx + 1 < argc) {
+         metrics_interval_ms = (DWORD)_ttoi64(argv[++idx]);
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-stats"sv)) {
+         query_request = _T("stats");
+         continue;
+      }
+      if (argv[idx] == _T("--deep-debugger-parent"sv) && idx + 1 < argc) {
+         query_request = join(_T("parent|"sv), argv[++idx]);
+         continue;
+      }
+      if (ai < 2) {
+         posArg[ai++] = argv[idx];
+      }
    }
    if (log) {
       ENABLE_LOGGING(log, _T("server"));
@@ -23,72 +554,289 @@ int _tmain(int argc, TCHAR* argv[])
    }
 
    string queue = posArg[0];
-   DWORD pipeMode = PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT;
-   const size_t queue_bufsize = 10000;
 
-   DWORD rlen = 0;
+   if (!query_request.empty()) {
+      string reply;
+      if (!query(queue, query_request, reply)) {
+         return 1;
+      }
+      fmt::print(_T("{}\n"), reply);
+      return 0;
+   }
 
    if (auto buf = posArg[1]) {
-      const auto size = (DWORD)_tcslen(buf);
-      HANDLE hPipe = CreateFile(queue.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
-      if (hPipe == INVALID_HANDLE_VALUE) {
-         ERROR("Cannot open queue {}, exiting ({})", queue, getErrorMessage());
+      trace::init(_T("stopper"), trace_file);
+      trace::cSpan span("reply");
+      if (!writeQueue(queue, buf)) {
+         ERROR("Cannot write to queue {}, exiting ({})", queue, getErrorMessage());
          return 1;
       }
-      auto success = WriteFile(hPipe, buf, size, &rlen, nullptr);
-      CloseHandle(hPipe);
-      if (!success || !rlen) {
-         if (GetLastError() == ERROR_BROKEN_PIPE) {
-            LOG("Client disconnected");
-         }
-         else {
-            ERROR("WriteFile failed ({})", getErrorMessage());
-         }
+      return 0;
+   }
+
+   trace::init(_T("server"), trace_file);
+   trace::threadName("listener");
+
+   cListener listener(queue);
+   if (!listener.start()) {
+      return 1;
+   }
+   cOutputWriter writer(GetStdHandle(STD_OUTPUT_HANDLE), output_options);
+   cBatcher batcher(writer, batch_window_us, batch_size, retry_after_ms);
+   cScheduler scheduler(writer, schedule_depth);
+   auto& server_metrics = serverMetrics();
+   LOG("Listening on {}, batch window {} us, batch size {}, output queue {}, schedule depth {}", queue, batch_window_us, batch_size, output_options.capacity, schedule_depth);
+
+   cProcessWatcher watcher;
+   cSessionTree sessions;
+
+   metrics::cExporter exporter;
+   if (metrics_file) {
+      exporter.start(metrics_file, metrics_interval_ms);
+      LOG("Writing metrics to {} every {} ms", metrics_file, metrics_interval_ms);
+   }
+
+   cCaptureWriter capture;
+   if (capture_file) {
+      if (capture.open(capture_file)) {
+         LOG("Capturing requests to {}", capture_file);
+      }
+      else {
+         ERROR("Cannot open capture file {} ({})", capture_file, getErrorMessage());
+      }
+   }
+
+   // Connections are read on this thread unless there are workers
+   cWorkerPool workers;
+   if (worker_count > 1) {
+      if (!workers.start(worker_count)) {
          return 1;
       }
-      return 0;
+      LOG("Reading connections on {} workers", worker_count);
    }
 
+   // Tells the hooks of a subtree of sessions that their sessions are over, and the extension
+   // to stop them, in one frame: stopped|<session id>,...|end
+   auto stopSessions = [&](const string& id) {
+      auto stopped = sessions.remove(id);
+      if (stopped.empty()) {
+         return;
+      }
+      server_metrics.sessions.sub(stopped.size());
+      server_metrics.stopped_sessions.add(stopped.size());
+
+      // Requests of the subtree still waiting go with it, their hooks are told below; other
+      // requests of the same requesters, a supervisor's, are not touched
+      std::unordered_set<string> stopped_ids;
+      for (const auto& session : stopped) {
+         stopped_ids.insert(session.id);
+      }
+      scheduler.drop(stopped_ids);
+      batcher.drop(stopped_ids);
+
+      string ids;
+      for (const auto& session : stopped) {
+         if (!session.hook_queue.empty() && !writeQueue(session.hook_queue, _T("stopped"))) {
+            LOG("Cannot tell {} its session {} is stopped ({})", session.hook_queue, session.id, getErrorMessage());
+         }
+         ids += join(ids.empty() ? _T(""sv) : _T(","sv), session.id);
+      }
+      LOG("Sessions stopped: {}", ids);
+      writer.push(fmt::format(_T("stopped|{}|end"), ids));
+   };
+
+   // Sessions of requests that will not reach the extension
+   auto forget = [&](const std::vector<string>& ids) {
+      for (const auto& id : ids) {
+         server_metrics.sessions.sub(sessions.remove(id).size());
+      }
+   };
+
+   // Requests leave the scheduler for the batcher, or go back to their hooks to run undebugged
+   auto emit = [&](cScheduler::sRequest&& request) {
+      forget(batcher.add(request.pid, std::move(request.message), std::move(request.session_id), request.trace_id, std::move(request.view), std::move(request.charge)));
+   };
+   auto expire = [&](cScheduler::sRequest&& request) {
+      server_metrics.sessions.sub(sessions.remove(request.session_id).size());
+      if (request.hook_queue.empty() || !writeQueue(request.hook_queue, _T("passthrough"))) {
+         ERROR("Cannot send passthrough to {} ({})", request.hook_queue, getErrorMessage());
+      }
+      trace::instant("expired", request.trace_id);
+   };
+
+   // Explicit in the request, otherwise by the depth of its session
+   auto classify = [&](const string& name, const string& session_id) {
+      auto priority = cScheduler::ePriority::normal;
+      if (!name.empty() && cScheduler::parsePriority(name, priority)) {
+         return priority;
+      }
+      auto depth = sessions.depth(session_id);
+      return depth >= bulk_depth ? cScheduler::ePriority::bulk : depth == 1 ? cScheduler::ePriority::interactive : priority;
+   };
+
+   // Everything after the read, on this thread: requests are numbered and emitted in the order
+   // they get here. False once the server is told to stop.
+   auto handle = [&](DWORD pid, string&& data, uint64_t trace_id, cMessageBuffer::eState state) {
+      if (data.empty()) {
+         return true;
+      }
+      if (state != cMessageBuffer::eState::complete) {
+         turnAway(pid, state, data, retry_after_ms);
+         return true;
+      }
+      server_metrics.messages.add();
+      server_metrics.bytes.add(data.size() * sizeof(TCHAR));
+      if (data.starts_with(_T("stats|"))) {
+         auto reply_queue = data.substr(6);
+         if (!isReplyQueue(queue, reply_queue)) {
+            ERROR("Stats not sent to {}, not a reply queue of {}", reply_queue, queue);
+         }
+         else if (!writeQueue(reply_queue, metrics::json())) {
+            ERROR("Cannot send stats to {} ({})", reply_queue, getErrorMessage());
+         }
+         return true;
+      }
+      if (data.starts_with(_T("parent|"))) {
+         string_view args = data;
+         args.remove_prefix(7);
+         string id(readUntil(args, _T('|'))), parent_id;
+         auto reply = !sessions.parent(id, parent_id) || parent_id.empty() ? _T(R"({"parent":null})"s) : fmt::format(_T(R"({{"parent":"{}"}})"), parent_id);
+         if (!isReplyQueue(queue, args)) {
+            ERROR("{} not sent to {}, not a reply queue of {}", reply, args, queue);
+         }
+         else if (!writeQueue(string(args), reply)) {
+            ERROR("Cannot send {} to {} ({})", reply, args, getErrorMessage());
+         }
+         return true;
+      }
+      // The extension stops a subtree of sessions only when the user stops its root; a
+      // session that is simply over leaves the tree alone, its children become roots
+      if (data.starts_with(_T("stop|"))) {
+         stopSessions(data.substr(5));
+         return true;
+      }
+      if (data.starts_with(_T("end|"))) {
+         if (sessions.end(data.substr(4))) {
+            server_metrics.sessions.sub();
+         }
+         return true;
+      }
+      if (data == _T("stopped")) {
+         LOG(_T("Stop message received"));
+         scheduler.dispatch(emit, expire, true);
+         batcher.flush();
+         string stats = join(_T("stats|"sv), batcher.stats(), _T("|end"sv));
+         LOG("stdout: {}", stats);
+         writer.push(std::move(stats));
+         writer.stop();
+         exporter.stop();
+         return false;
+      }
+
+      // Until it is emitted the message counts against the memory cap like the chunks it was read into
+      cMemoryCharge charge;
+      if (!charge.charge(data.size() * sizeof(TCHAR))) {
+         turnAway(pid, cMessageBuffer::eState::refused, data, retry_after_ms);
+         return true;
+      }
+
+      // The request's header is read once, here, see sRequestHeader
+      auto header = sRequestHeader::read(data);
+      std::shared_ptr<const shared::cView> view;
+      if (protocol::isBinary(data)) {
+         auto blocks_size = data.size() - data.find(_T('\0')) - 1;
+         if (!blocks_size && !header.section.empty()) {
+            if (!(view = openSection(pid, header))) {
+               return true;
+            }
+            blocks_size = view->blocks().size();
+         }
+         recordCodec(header, blocks_size);
+      }
+      if (!header.connect_wait_us.empty()) {
+         server_metrics.connect_wait_us.record((uint64_t)_ttoi64(header.connect_wait_us.c_str()));
+      }
+      if (capture_file && !capture.append(pid, view ? join(data, view->blocks()) : data)) {
+         ERROR("Cannot write to capture file {} ({})", capture_file, getErrorMessage());
+      }
+      if (pid) {
+         watcher.watch(pid, header.hook_queue);
+      }
+      auto session_id = sessions.add(header.parent_session_id, pid, header.hook_queue);
+      server_metrics.sessions.add();
+      auto priority = classify(header.priority, session_id);
+      addSessionId(data, session_id);
+      auto deadline_ns = header.deadline_ms > 0 ? nowNs() + header.deadline_ms * 1000000 : 0;
+      scheduler.add(priority, { pid, std::move(data), trace_id, std::move(view), session_id, std::move(header.hook_queue), 0, deadline_ns, std::move(charge) });
+      scheduler.dispatch(emit, expire);
+      return true;
+   };
+
+   // The extension starts the debuggee once the queue is there
+   writer.push(fmt::format(_T("ready|{}|sessions|end"), GetCurrentProcessId()));
+
+   // Connections read on this thread, one at a time, share one buffer
+   cMessageBuffer buffer;
+
    while (true) {
-      HANDLE hPipe = CreateNamedPipe(queue.c_str(), PIPE_ACCESS_DUPLEX, pipeMode, 100, queue_bufsize, queue_bufsize, NMPWAIT_USE_DEFAULT_WAIT, nullptr);
+      HANDLE hPipe = listener.accept(std::min(batcher.timeout(), scheduler.timeout()), { watcher.wakeEvent(), workers.wakeEvent(), writer.writtenEvent() });
+
+      // Also while connections keep coming without a wait
+      for (auto& message : workers.received()) {
+         server_metrics.connections.sub();
+         if (!handle(message.pid, std::move(message.data), message.trace_id, message.state)) {
+            return 0;
+         }
+      }
+      if (!hPipe) {
+         for (auto& requester : watcher.exited()) {
+            // Their sessions go too, the extension never heard of them
+            auto dropped = scheduler.drop(requester.pid);
+            std::ranges::move(batcher.drop(requester.pid), std::back_inserter(dropped));
+            forget(dropped);
+            LOG("Requester {} exited, {} pending requests dropped", requester.pid, dropped.size());
+            for (const auto& hook_queue : requester.hook_queues) {
+               writer.push(fmt::format(_T("exited|{}|{}|end"), requester.pid, hook_queue));
+            }
+         }
+         scheduler.dispatch(emit, expire);
+         if (!batcher.timeout()) {
+            forget(batcher.flush());
+         }
+         continue;
+      }
       if (hPipe == INVALID_HANDLE_VALUE) {
-         ERROR("Cannot create queue {}, exiting ({})", queue, getErrorMessage());
+         batcher.flush();
+         writer.stop();
          return 1;
       }
-      LOG("Queue created successfully: {}, waiting for messages...", queue);
 
-      if (!ConnectNamedPipe(hPipe, NULL)) {
-         ERROR("Cannot connect queue {}, exiting ({})", queue, getErrorMessage());
-         CloseHandle(hPipe);
+      DWORD pid = 0;
+      GetNamedPipeClientProcessId(hPipe, &pid);
+      PROBE_SERVER_ACCEPT(pid);
+      server_metrics.connections.add();
+      if (workers.size()) {
+         workers.add(hPipe, pid);
+         continue;
       }
-      else {
-         static TCHAR buf[queue_bufsize];
-         const auto size = std::size(buf) - sizeof(*buf);
-         string data = _T("start|");
-         while (true) {
-            auto success = ReadFile(hPipe, buf, size, &rlen, nullptr);
-            if (!success || !rlen) {
-               if (GetLastError() == ERROR_BROKEN_PIPE) {
-                  LOG("Client disconnected");
-               }
-               else {
-                  ERROR("ReadFile failed ({})", getErrorMessage());
-               }
-               break;
-            }
-            buf[rlen] = 0;
-            LOG("Read from queue: {} {}", rlen, buf);
-            if (string_view(buf) == _T("stopped")) {
-               LOG(_T("Stop message received"));
-               CloseHandle(hPipe);
-               return 0;
-            }
-            data += buf;
+
+      string data;
+      uint64_t trace_id = 0;
+      auto state = cMessageBuffer::eState::complete;
+      {
+         trace::cSpan span("read");
+         readMessage(hPipe, buffer);
+         state = buffer.state();
+         data = buffer.take();
+         server_metrics.connections.sub();
+         if (trace::enabled()) {
+            trace_id = trace::parseId(findJsonString(data, _T("deepDbgTraceID")));
+            span.setId(trace_id);
+            trace::flow('t', trace_id);
          }
-         LOG("stdout: {}", data);
-         data += _T("|end");
-         printf("%s", data.c_str());
-         fflush(stdout);
+      }
+      if (!handle(pid, std::move(data), trace_id, state)) {
+         return 0;
       }
    }
 }
@@ -0,0 +1,146 @@
+#include "pch.h"
+#include "sessions.h"
+
+cSessionTree::cSessionTree()
+   : m_prefix(fmt::format(_T("{}."), GetCurrentProcessId()))
+{
+}
+
+string cSessionTree::add(const string& parent_id, DWORD pid, const string& hook_queue)
+{
+   auto parent = s_none;
+   if (!parent_id.empty()) {
+      parent = find(parent_id);
+      if (parent == s_none) {
+         parent = insert({ parent_id, 0, string() }, s_none);
+      }
+   }
+   auto id = join(m_prefix, fmt::format(_T("{}"), ++m_last));
+   insert({ id, pid, hook_queue }, parent);
+   return id;
+}
+
+bool cSessionTree::parent(const string& id, string& parent_id) const
+{
+   auto idx = find(id);
+   if (idx == s_none) {
+      return false;
+   }
+   auto parent = m_nodes[idx].parent;
+   parent_id = parent == s_none ? string() : m_nodes[parent].session.id;
+   return true;
+}
+
+size_t cSessionTree::depth(const string& id) const
+{
+   auto idx = find(id);
+   return idx == s_none ? 0 : m_nodes[idx].depth;
+}
+
+std::vector<cSessionTree::sSession> cSessionTree::remove(const string& id)
+{
+   auto root = find(id);
+   if (root == s_none) {
+      return {};
+   }
+
+   // Unlinked from its parent, the subtree is on its own
+   unlink(root);
+
+   // Breadth first, the list of the subtree is its own work queue
+   std::vector<uint32_t> subtree = { root };
+   for (size_t pos = 0; pos < subtree.size(); ++pos) {
+      for (auto child = m_nodes[subtree[pos]].first_child; child != s_none; child = m_nodes[child].next) {
+         subtree.push_back(child);
+      }
+   }
+
+   std::vector<sSession> retval;
+   retval.reserve(subtree.size());
+   for (auto idx : subtree) {
+      m_index.erase(m_nodes[idx].session.id);
+      retval.push_back(std::move(m_nodes[idx].session));
+      m_nodes[idx] = sNode();
+      m_free.push_back(idx);
+   }
+   return retval;
+}
+
+bool cSessionTree::end(const string& id)
+{
+   auto idx = find(id);
+   if (idx == s_none) {
+      return false;
+   }
+   unlink(idx);
+
+   // Its children become roots, their subtrees move up, breadth first so that every
+   // parent is renumbered before its children
+   std::vector<uint32_t> moved;
+   for (auto child = m_nodes[idx].first_child; child != s_none;) {
+      auto& node = m_nodes[child];
+      auto next = node.next;
+      node.parent = node.prev = node.next = s_none;
+      moved.push_back(child);
+      child = next;
+   }
+   for (size_t pos = 0; pos < moved.size(); ++pos) {
+      auto& node = m_nodes[moved[pos]];
+      node.depth = node.parent == s_none ? 0 : m_nodes[node.parent].depth + 1;
+      for (auto child = node.first_child; child != s_none; child = m_nodes[child].next) {
+         moved.push_back(child);
+      }
+   }
+
+   m_index.erase(m_nodes[idx].session.id);
+   m_nodes[idx] = sNode();
+   m_free.push_back(idx);
+   return true;
+}
+
+void cSessionTree::unlink(uint32_t idx)
+{
+   auto& node = m_nodes[idx];
+   if (node.prev != s_none) {
+      m_nodes[node.prev].next = node.next;
+   }
+   else if (node.parent != s_none) {
+      m_nodes[node.parent].first_child = node.next;
+   }
+   if (node.next != s_none) {
+      m_nodes[node.next].prev = node.prev;
+   }
+}
+
+uint32_t cSessionTree::insert(sSession&& session, uint32_t parent)
+{
+   uint32_t idx;
+   if (m_free.empty()) {
+      idx = (uint32_t)m_nodes.size();
+      m_nodes.emplace_back();
+   }
+   else {
+      idx = m_free.back();
+      m_free.pop_back();
+   }
+
+   auto& node = m_nodes[idx];
+   node.session = std::move(session);
+   node.parent = parent;
+   if (parent != s_none) {
+      node.depth = m_nodes[parent].depth + 1;
+      node.next = m_nodes[parent].first_child;
+      if (node.next != s_none) {
+         m_nodes[node.next].prev = idx;
+      }
+      m_nodes[parent].first_child = idx;
+   }
+   m_index.emplace(node.session.id, idx);
+   return idx;
+}
+
+uint32_t cSessionTree::find(const string& id) const
+{
+   auto it = m_index.find(id);
+   return it == m_index.end() ? s_none : it->second;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <unordered_map>
+
+// The tree of the debug sessions requested through this server. The server numbers them
+// itself: a request gets the next ID, <server PID>.<number>, under the session its hook
+// names in deepDbgParentSessionID, and carries it to the extension in deepDbgSessionID.
+// Sessions the server did not number, the ones the extension started, are taken in as
+// roots when first named as a parent.
+//
+// Nodes are kept in one vector and linked to their parent and siblings by index, IDs are
+// looked up in a hash map: adding, finding, unlinking a session and telling its depth take
+// constant time, removing a subtree takes time in its size and no recursion, however deep
+// it is. Ending a single session makes roots of its children, their subtrees are
+// renumbered in time in their size.
+class cSessionTree
+{
+public:
+   struct sSession
+   {
+      string id;
+      DWORD pid;              // of the requester
+      string hook_queue;
+   };
+
+   cSessionTree();
+
+   // Adds a session under parent_id, returns its ID
+   string add(const string& parent_id, DWORD pid, const string& hook_queue);
+
+   // ID of the session's parent, empty for a root; false for an unknown session
+   bool parent(const string& id, string& parent_id) const;
+
+   // Number of sessions above the session, 0 for a root or an unknown session
+   size_t depth(const string& id) const;
+
+   // Removes the session and all of its descendants, returns them parents first
+   std::vector<sSession> remove(const string& id);
+
+   // Removes the session alone, its children become roots; false for an unknown session
+   bool end(const string& id);
+
+   size_t size() const
+   {
+      return m_index.size();
+   }
+
+private:
+   static constexpr uint32_t s_none = UINT32_MAX;
+
+   struct sNode
+   {
+      sSession session;
+      uint32_t parent = s_none;
+      uint32_t first_child = s_none;
+      uint32_t prev = s_none;
+      uint32_t next = s_none;
+      uint32_t depth = 0;     // set when added, and when an ancestor's end moves the session up
+   };
+
+   uint32_t insert(sSession&& session, uint32_t parent);
+   void unlink(uint32_t idx);
+   uint32_t find(const string& id) const;
+
+   string m_prefix;
+   uint64_t m_last = 0;
+   std::vector<sNode> m_nodes;
+   std::vector<uint32_t> m_free;
+   std::unordered_map<string, uint32_t> m_index;
+};
@@ -0,0 +1,93 @@
+#include "pch.h"
+#include "watcher.h"
+
+cProcessWatcher::cProcessWatcher()
+   : m_wake(CreateEvent(nullptr, FALSE, FALSE, nullptr))
+{
+}
+
+cProcessWatcher::~cProcessWatcher()
+{
+   for (auto& [pid, entry] : m_entries) {
+      release(*entry);
+   }
+   CloseHandle(m_wake);
+}
+
+bool cProcessWatcher::watch(DWORD pid, const string& hook_queue)
+{
+   std::lock_guard lock(m_mutex);
+
+   if (auto it = m_entries.find(pid); it != m_entries.end()) {
+      auto& hook_queues = it->second->requester.hook_queues;
+      if (std::find(hook_queues.begin(), hook_queues.end(), hook_queue) == hook_queues.end()) {
+         hook_queues.push_back(hook_queue);
+      }
+      return true;
+   }
+
+   auto entry = std::make_unique<sEntry>(sEntry{ this, { pid, { hook_queue } } });
+   entry->process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+   if (!entry->process) {
+      ERROR("Cannot watch requester {} ({})", pid, getErrorMessage());
+      return false;
+   }
+   if (!RegisterWaitForSingleObject(&entry->wait, entry->process, onExit, entry.get(), INFINITE, WT_EXECUTEONLYONCE)) {
+      ERROR("Cannot watch requester {} ({})", pid, getErrorMessage());
+      CloseHandle(entry->process);
+      return false;
+   }
+   LOG("Watching requester {} ({})", pid, hook_queue);
+   m_entries.emplace(pid, std::move(entry));
+   return true;
+}
+
+void CALLBACK cProcessWatcher::onExit(PVOID context, BOOLEAN)
+{
+   auto entry = (sEntry*)context;
+   auto watcher = entry->watcher;
+   {
+      std::lock_guard lock(watcher->m_mutex);
+      watcher->m_exited.push_back(entry->requester.pid);
+   }
+   SetEvent(watcher->m_wake);
+}
+
+std::vector<cProcessWatcher::sRequester> cProcessWatcher::exited()
+{
+   std::vector<std::unique_ptr<sEntry>> entries;
+   {
+      std::lock_guard lock(m_mutex);
+      for (auto pid : m_exited) {
+         if (auto it = m_entries.find(pid); it != m_entries.end()) {
+            entries.push_back(std::move(it->second));
+            m_entries.erase(it);
+         }
+      }
+      m_exited.clear();
+   }
+
+   std::vector<sRequester> retval;
+   for (auto& entry : entries) {
+      release(*entry);
+      retval.push_back(std::move(entry->requester));
+   }
+   return retval;
+}
+
+size_t cProcessWatcher::size() const
+{
+   std::lock_guard lock(m_mutex);
+   return m_entries.size();
+}
+
+void cProcessWatcher::release(sEntry& entry)
+{
+   // Waits for a running callback, so it must not be called with m_mutex held
+   if (entry.wait) {
+      UnregisterWaitEx(entry.wait, INVALID_HANDLE_VALUE);
+   }
+   if (entry.process) {
+      CloseHandle(entry.process);
+   }
+}
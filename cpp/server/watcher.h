@@ -0,0 +1,50 @@
+#pragma once
+
+#include <mutex>
+
+// Watches the processes that sent requests to the server. Each requester's process
+// handle is waited on by the system thread pool; when one exits it is reported
+// through exited(), and the wake event is signalled so that the accept loop can
+// release everything still held on its behalf. A requester may have sent several
+// requests, a supervisor sends one per child, so all of their hook queues are kept.
+class cProcessWatcher
+{
+public:
+   struct sRequester
+   {
+      DWORD pid;
+      std::vector<string> hook_queues;
+   };
+
+   cProcessWatcher();
+   ~cProcessWatcher();
+
+   HANDLE wakeEvent() const
+   {
+      return m_wake;
+   }
+
+   bool watch(DWORD pid, const string& hook_queue);
+
+   // Requesters that exited since the last call
+   std::vector<sRequester> exited();
+
+   size_t size() const;
+
+private:
+   struct sEntry
+   {
+      cProcessWatcher* watcher;
+      sRequester requester;
+      HANDLE process = nullptr;
+      HANDLE wait = nullptr;
+   };
+
+   static void CALLBACK onExit(PVOID context, BOOLEAN timed_out);
+   void release(sEntry& entry);
+
+   HANDLE m_wake;
+   mutable std::mutex m_mutex;
+   std::map<DWORD, std::unique_ptr<sEntry>> m_entries;
+   std::vector<DWORD> m_exited;
+};
@@ -0,0 +1,248 @@
+#include "pch.h"
+#include "pool.h"
+#include "trace.h"
+#include "workers.h"
+
+#include <set>
+
+namespace {
+
+   constexpr DWORD s_drain_timeout_ms = 1000;
+   constexpr size_t s_connection_slab = 256;
+
+   // Completion keys: a new connection, a read, the end of the loop
+   constexpr ULONG_PTR s_key_add = 1;
+   constexpr ULONG_PTR s_key_read = 2;
+   constexpr ULONG_PTR s_key_stop = 3;
+
+   // One per connection, the OVERLAPPED of its reads comes first
+   struct sConnection
+   {
+      OVERLAPPED ov{};
+      HANDLE pipe;
+      DWORD pid;
+      int64_t start_ns;
+      cMessageBuffer message;
+   };
+
+   // Connections count against the memory cap but are never refused: one that cannot be
+   // read cannot be answered either, and its hook would wait for the server to go
+   cSlabPool& connectionPool()
+   {
+      static cSlabPool s_pool(sizeof(sConnection), s_connection_slab);
+      return s_pool;
+   }
+
+   sConnection* newConnection(HANDLE hPipe, DWORD pid)
+   {
+      auto connection = new (connectionPool().allocate(true)) sConnection;
+      connection->pipe = hPipe;
+      connection->pid = pid;
+      connection->start_ns = nowNs();
+      return connection;
+   }
+
+   void deleteConnection(sConnection* connection)
+   {
+      connection->~sConnection();
+      connectionPool().release(connection);
+   }
+
+} // namespace
+
+class cWorkerPool::cWorker
+{
+public:
+   cWorker(cWorkerPool& pool, size_t idx)
+      : m_pool(pool), m_name(fmt::format("worker-{}", idx)), m_port(CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1))
+   {
+   }
+   ~cWorker()
+   {
+      stop();
+      if (m_port) {
+         CloseHandle(m_port);
+      }
+   }
+
+   bool start()
+   {
+      if (!m_port) {
+         return false;
+      }
+      m_thread = std::thread(&cWorker::run, this);
+      return true;
+   }
+
+   void stop()
+   {
+      if (m_thread.joinable()) {
+         PostQueuedCompletionStatus(m_port, 0, s_key_stop, nullptr);
+         m_thread.join();
+      }
+   }
+
+   void add(HANDLE hPipe, DWORD pid)
+   {
+      auto connection = newConnection(hPipe, pid);
+      if (!PostQueuedCompletionStatus(m_port, 0, s_key_add, &connection->ov)) {
+         ERROR("Cannot pass connection of {} to {} ({})", pid, m_name, getErrorMessage());
+         CloseHandle(hPipe);
+         deleteConnection(connection);
+         m_pool.deliver({ pid, string(), 0 });
+      }
+   }
+
+private:
+   void run()
+   {
+      trace::threadName(m_name.c_str());
+      while (true) {
+         DWORD rlen = 0;
+         ULONG_PTR key = 0;
+         LPOVERLAPPED ov = nullptr;
+         BOOL success = GetQueuedCompletionStatus(m_port, &rlen, &key, &ov, INFINITE);
+         if (!ov) {
+            if (success && key == s_key_stop) {
+               break;
+            }
+            ERROR("{} cannot wait for its connections ({})", m_name, getErrorMessage());
+            break;
+         }
+
+         auto connection = (sConnection*)ov;
+         if (key == s_key_add) {
+            m_connections.insert(connection);
+            if (CreateIoCompletionPort(connection->pipe, m_port, s_key_read, 0) != m_port) {
+               ERROR("Cannot read connection of {} ({})", connection->pid, getErrorMessage());
+               finish(connection);
+               continue;
+            }
+            read(connection);
+            continue;
+         }
+
+         if (!success) {
+            // The message ends when the client disconnects
+            if (GetLastError() != ERROR_BROKEN_PIPE) {
+               ERROR("ReadFile failed ({})", getErrorMessage());
+            }
+            finish(connection);
+            continue;
+         }
+         if (rlen) {
+            LOG("Read from queue: {} bytes from {}", rlen, connection->pid);
+            connection->message.commit(rlen);
+         }
+         read(connection);
+      }
+      drain();
+   }
+
+   // The completion comes through the port either way, unless the read failed right away
+   void read(sConnection* connection)
+   {
+      connection->ov = OVERLAPPED{};
+      DWORD size = 0;
+      auto buf = connection->message.space(size);
+      if (!ReadFile(connection->pipe, buf, size, nullptr, &connection->ov) && GetLastError() != ERROR_IO_PENDING) {
+         if (GetLastError() != ERROR_BROKEN_PIPE) {
+            ERROR("ReadFile failed ({})", getErrorMessage());
+         }
+         finish(connection);
+      }
+   }
+
+   void finish(sConnection* connection)
+   {
+      m_connections.erase(connection);
+      CloseHandle(connection->pipe);
+
+      auto state = connection->message.state();
+      auto data = connection->message.take();
+      uint64_t trace_id = 0;
+      if (trace::enabled()) {
+         trace_id = trace::parseId(findJsonString(data, _T("deepDbgTraceID")));
+         trace::complete("read", connection->start_ns, nowNs(), trace_id);
+         trace::flow('t', trace_id);
+      }
+      m_pool.deliver({ connection->pid, std::move(data), trace_id, state });
+      deleteConnection(connection);
+   }
+
+   // Closing the pipes cancels their reads, whose completions must arrive before the buffers go
+   void drain()
+   {
+      for (auto connection : m_connections) {
+         CloseHandle(connection->pipe);
+         connection->pipe = INVALID_HANDLE_VALUE;
+      }
+      while (!m_connections.empty()) {
+         DWORD rlen = 0;
+         ULONG_PTR key = 0;
+         LPOVERLAPPED ov = nullptr;
+         if (!GetQueuedCompletionStatus(m_port, &rlen, &key, &ov, s_drain_timeout_ms) && !ov) {
+            ERROR("{} gave up on {} connections", m_name, m_connections.size());
+            break;
+         }
+         if (m_connections.erase((sConnection*)ov)) {
+            deleteConnection((sConnection*)ov);
+         }
+      }
+   }
+
+   cWorkerPool& m_pool;
+   std::string m_name;
+   HANDLE m_port;
+   std::thread m_thread;
+   std::set<sConnection*> m_connections;
+};
+
+cWorkerPool::cWorkerPool()
+   : m_wake(CreateEvent(nullptr, FALSE, FALSE, nullptr))
+{
+}
+
+cWorkerPool::~cWorkerPool()
+{
+   stop();
+   CloseHandle(m_wake);
+}
+
+bool cWorkerPool::start(size_t count)
+{
+   for (size_t idx = 0; idx < count; ++idx) {
+      auto& worker = m_workers.emplace_back(std::make_unique<cWorker>(*this, idx));
+      if (!worker->start()) {
+         ERROR("Cannot start worker {} ({})", idx, getErrorMessage());
+         stop();
+         return false;
+      }
+   }
+   return true;
+}
+
+void cWorkerPool::stop()
+{
+   m_workers.clear();
+}
+
+void cWorkerPool::add(HANDLE hPipe, DWORD pid)
+{
+   m_workers[m_next++ % m_workers.size()]->add(hPipe, pid);
+}
+
+std::vector<cWorkerPool::sMessage> cWorkerPool::received()
+{
+   std::lock_guard lock(m_mutex);
+   return std::exchange(m_inbox, {});
+}
+
+void cWorkerPool::deliver(sMessage&& message)
+{
+   {
+      std::lock_guard lock(m_mutex);
+      m_inbox.push_back(std::move(message));
+   }
+   SetEvent(m_wake);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "pool.h"
+
+// Readers of the launcher queue connections, --deep-debugger-workers <count> of them.
+// The accept loop hands each connection to the next worker in turn. A worker runs its
+// own event loop on an I/O completion port and reads all of its connections at once,
+// so that a slow or stalled hook holds up nothing but itself. Complete messages are
+// passed back through one inbox, and the wake event tells the accept loop to collect
+// them: everything after the read (control messages, batching, the single writer to
+// stdout) stays on the accept loop's thread, which numbers and emits requests in the
+// order it receives them.
+class cWorkerPool
+{
+public:
+   struct sMessage
+   {
+      DWORD pid;
+      string data;                  // the head of a message that was discarded
+      uint64_t trace_id;
+      cMessageBuffer::eState state = cMessageBuffer::eState::complete;
+   };
+
+   cWorkerPool();
+   ~cWorkerPool();
+
+   bool start(size_t count);
+   void stop();
+
+   size_t size() const
+   {
+      return m_workers.size();
+   }
+
+   HANDLE wakeEvent() const
+   {
+      return m_wake;
+   }
+
+   // Takes over a connected pipe
+   void add(HANDLE hPipe, DWORD pid);
+
+   // Messages read since the last call, an empty one for a connection that sent nothing
+   std::vector<sMessage> received();
+
+private:
+   class cWorker;
+
+   void deliver(sMessage&& message);
+
+   HANDLE m_wake;
+   std::vector<std::unique_ptr<cWorker>> m_workers;
+   size_t m_next = 0;
+   std::mutex m_mutex;
+   std::vector<sMessage> m_inbox;
+};
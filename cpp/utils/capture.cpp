@@ -0,0 +1,79 @@
+#include "pch.h"
+#include "capture.h"
+
+uint64_t captureTimeUs()
+{
+   // FILETIME counts 100 ns intervals since 1601
+   static constexpr uint64_t epoch_offset = 116444736000000000ull;
+
+   FILETIME ft;
+   GetSystemTimePreciseAsFileTime(&ft);
+   uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+   return (t - epoch_offset) / 10;
+}
+
+cCaptureWriter::~cCaptureWriter()
+{
+   if (m_file != INVALID_HANDLE_VALUE) {
+      CloseHandle(m_file);
+   }
+}
+
+bool cCaptureWriter::open(const fs::path& fname)
+{
+   m_file = CreateFile(pathString(fname).c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (m_file == INVALID_HANDLE_VALUE) {
+      return false;
+   }
+
+   LARGE_INTEGER size{};
+   if (GetFileSizeEx(m_file, &size) && size.QuadPart == 0) {
+      sCaptureHeader header;
+      DWORD written = 0;
+      if (!WriteFile(m_file, &header, sizeof(header), &written, NULL)) {
+         CloseHandle(m_file);
+         m_file = INVALID_HANDLE_VALUE;
+         return false;
+      }
+   }
+   return true;
+}
+
+bool cCaptureWriter::append(DWORD pid, const string_view& message)
+{
+   if (m_file == INVALID_HANDLE_VALUE) {
+      return false;
+   }
+
+   // One write per record, so that a record is never split by a concurrent reader
+   sCaptureRecord record{ captureTimeUs(), (uint32_t)pid, (uint32_t)(message.size() * sizeof(TCHAR)) };
+   m_buf.resize((sizeof(record) + record.size + sizeof(TCHAR) - 1) / sizeof(TCHAR));
+   memcpy(m_buf.data(), &record, sizeof(record));
+   memcpy((char*)m_buf.data() + sizeof(record), message.data(), record.size);
+
+   DWORD written = 0;
+   if (!WriteFile(m_file, m_buf.data(), (DWORD)(sizeof(record) + record.size), &written, NULL)) {
+      return false;
+   }
+   ++m_records;
+   return true;
+}
+
+bool cCaptureReader::open(const fs::path& fname)
+{
+   m_file.open(fname, std::ios::binary);
+   sCaptureHeader header, expected;
+   if (!m_file.read((char*)&header, sizeof(header))) {
+      return false;
+   }
+   return !memcmp(header.magic, expected.magic, sizeof(header.magic)) && header.version == expected.version && header.char_size == expected.char_size;
+}
+
+bool cCaptureReader::next(sCaptureRecord& record, string& message)
+{
+   if (!m_file.read((char*)&record, sizeof(record))) {
+      return false;
+   }
+   message.resize(record.size / sizeof(TCHAR));
+   return (bool)m_file.read((char*)message.data(), record.size);
+}
@@ -0,0 +1,186 @@
+#include "pch.h"
+#include "lock.h"
+#include "histogram.h"
+
+namespace {
+   // The locked byte lies far beyond the statistics, so that it never overlaps the mapped view
+   constexpr uint64_t s_lock_offset = 1ull << 40;
+
+   OVERLAPPED lockOverlapped(HANDLE event = nullptr)
+   {
+      OVERLAPPED ov{};
+      ov.Offset = (DWORD)s_lock_offset;
+      ov.OffsetHigh = (DWORD)(s_lock_offset >> 32);
+      ov.hEvent = event;
+      return ov;
+   }
+}
+
+cProcessLock::~cProcessLock()
+{
+   close();
+}
+
+void cProcessLock::close()
+{
+   if (m_stats) {
+      UnmapViewOfFile(m_stats);
+      m_stats = nullptr;
+   }
+   if (m_mapping) {
+      CloseHandle(m_mapping);
+      m_mapping = nullptr;
+   }
+   if (m_event) {
+      CloseHandle(m_event);
+      m_event = nullptr;
+   }
+   if (m_file != INVALID_HANDLE_VALUE) {
+      CloseHandle(m_file);
+      m_file = INVALID_HANDLE_VALUE;
+   }
+}
+
+bool cProcessLock::open(const fs::path& fname)
+{
+   close();
+
+   auto lock_file = fname;
+   lock_file += _T(".lck");
+
+   m_file = CreateFile(pathString(lock_file).c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_ALWAYS, FILE_FLAG_OVERLAPPED, NULL);
+   if (m_file == INVALID_HANDLE_VALUE) {
+      return false;
+   }
+
+   // Mapping a new, empty lock file extends it with zeroed statistics
+   m_mapping = CreateFileMapping(m_file, NULL, PAGE_READWRITE, 0, sizeof(sStats), NULL);
+   if (m_mapping) {
+      m_stats = (sStats*)MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(sStats));
+   }
+   m_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+   if (!m_stats || !m_event) {
+      close();
+      return false;
+   }
+   return true;
+}
+
+bool cProcessLock::lock(DWORD timeout_ms)
+{
+   if (!isOpen()) {
+      return false;
+   }
+
+   auto start_ns = nowNs();
+   if (timeout_ms == INFINITE) {
+      m_local.lock();
+   }
+   else if (!m_local.try_lock_for(std::chrono::milliseconds(timeout_ms))) {
+      m_stats->timeouts.fetch_add(1, std::memory_order_relaxed);
+      return false;
+   }
+
+   // On an overlapped handle even the immediate attempt may report a pending operation
+   DWORD dummy = 0;
+   ResetEvent(m_event);
+   auto ov = lockOverlapped(m_event);
+   bool contended = !LockFileEx(m_file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &ov)
+      && !(GetLastError() == ERROR_IO_PENDING && GetOverlappedResult(m_file, &ov, &dummy, TRUE));
+   if (contended) {
+
+      DWORD left = INFINITE;
+      if (timeout_ms != INFINITE) {
+         auto elapsed_ms = (nowNs() - start_ns) / 1000000;
+         left = elapsed_ms < timeout_ms ? timeout_ms - (DWORD)elapsed_ms : 0;
+      }
+
+      ResetEvent(m_event);
+      ov = lockOverlapped(m_event);
+      bool locked = LockFileEx(m_file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov);
+      if (!locked && GetLastError() == ERROR_IO_PENDING) {
+         if (WaitForSingleObject(m_event, left) != WAIT_OBJECT_0) {
+            CancelIoEx(m_file, &ov);
+         }
+         // The lock may have been granted while cancelling
+         locked = GetOverlappedResult(m_file, &ov, &dummy, TRUE);
+      }
+      if (!locked) {
+         m_stats->timeouts.fetch_add(1, std::memory_order_relaxed);
+         m_local.unlock();
+         return false;
+      }
+   }
+
+   m_acquired_ns = nowNs();
+   auto wait_ns = (uint64_t)(m_acquired_ns - start_ns);
+
+   // The owner is cleared on unlock, so a PID still there belongs to a holder that died
+   m_recovered = m_stats->owner.exchange(GetCurrentProcessId()) != 0;
+   if (m_recovered) {
+      m_stats->recovered.fetch_add(1, std::memory_order_relaxed);
+   }
+   m_stats->acquisitions.fetch_add(1, std::memory_order_relaxed);
+   if (contended) {
+      m_stats->contended.fetch_add(1, std::memory_order_relaxed);
+   }
+   m_stats->wait_ns.fetch_add(wait_ns, std::memory_order_relaxed);
+   for (auto max = m_stats->max_wait_ns.load(std::memory_order_relaxed); wait_ns > max && !m_stats->max_wait_ns.compare_exchange_weak(max, wait_ns, std::memory_order_relaxed);) {
+   }
+   return true;
+}
+
+void cProcessLock::unlock()
+{
+   m_stats->hold_ns.fetch_add(nowNs() - m_acquired_ns, std::memory_order_relaxed);
+   m_stats->owner = 0;
+
+   auto ov = lockOverlapped();
+   UnlockFileEx(m_file, 0, 1, 0, &ov);
+   m_local.unlock();
+}
+
+string cProcessLock::stats() const
+{
+   if (!isOpen()) {
+      return _T("{}");
+   }
+   return fmt::format(_T(R"({{"acquisitions":{},"contended":{},"timeouts":{},"recovered":{},"waitNs":{},"maxWaitNs":{},"holdNs":{},"owner":{}}})"),
+      m_stats->acquisitions.load(), m_stats->contended.load(), m_stats->timeouts.load(), m_stats->recovered.load(),
+      m_stats->wait_ns.load(), m_stats->max_wait_ns.load(), m_stats->hold_ns.load(), m_stats->owner.load());
+}
+
+void cProcessLock::resetStats()
+{
+   if (isOpen()) {
+      m_stats->acquisitions = 0;
+      m_stats->contended = 0;
+      m_stats->timeouts = 0;
+      m_stats->recovered = 0;
+      m_stats->wait_ns = 0;
+      m_stats->max_wait_ns = 0;
+      m_stats->hold_ns = 0;
+   }
+}
+
+namespace dbg {
+
+   static cProcessLock& logLock()
+   {
+      static cProcessLock s_lock(log_path);
+      return s_lock;
+   }
+
+   bool getLock()
+   {
+      // Better an interleaved line than a process hanging on its log
+      return logLock().lock(5000);
+   }
+   void releaseLock(bool locked)
+   {
+      if (locked) {
+         logLock().unlock();
+      }
+   }
+
+} // namespace dbg
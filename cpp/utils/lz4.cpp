@@ -0,0 +1,155 @@
+#include "pch.h"
+#include "lz4.h"
+
+#include <cstring>
+#include <vector>
+
+namespace {
+
+   constexpr size_t s_min_match = 4;
+   constexpr size_t s_last_literals = 5;    // a block ends with at least this many literals
+   constexpr size_t s_match_limit = 12;     // and its last match starts at least this far from the end
+   constexpr size_t s_max_offset = 65535;
+   constexpr int s_hash_bits = 12;
+   constexpr int s_skip_trigger = 6;        // misses before the search starts skipping ahead
+
+   uint32_t read32(const uint8_t* p)
+   {
+      uint32_t retval;
+      memcpy(&retval, p, sizeof(retval));
+      return retval;
+   }
+
+   uint32_t hash(uint32_t sequence)
+   {
+      return (sequence * 2654435761u) >> (32 - s_hash_bits);
+   }
+
+   // 15 in the token, then bytes of 255 and a final one below it
+   void writeLength(std::string& out, size_t len)
+   {
+      for (; len >= 255; len -= 255) {
+         out += (char)255;
+      }
+      out += (char)len;
+   }
+
+   bool readLength(const uint8_t*& ip, const uint8_t* end, size_t& len)
+   {
+      if (len != 15) {
+         return true;
+      }
+      for (uint8_t b = 255; b == 255; len += b) {
+         if (ip == end) {
+            return false;
+         }
+         b = *ip++;
+      }
+      return true;
+   }
+
+   void writeSequence(std::string& out, const uint8_t* literals, size_t literals_len, size_t offset, size_t match_len)
+   {
+      auto match_code = match_len - s_min_match;
+      out += (char)(std::min<size_t>(literals_len, 15) << 4 | std::min<size_t>(match_code, 15));
+      if (literals_len >= 15) {
+         writeLength(out, literals_len - 15);
+      }
+      out.append((const char*)literals, literals_len);
+      out += (char)(offset & 0xff);
+      out += (char)(offset >> 8);
+      if (match_code >= 15) {
+         writeLength(out, match_code - 15);
+      }
+   }
+
+} // namespace
+
+namespace lz4 {
+
+   std::string compress(std::string_view input)
+   {
+      auto src = (const uint8_t*)input.data();
+      size_t size = input.size();
+
+      std::string out;
+      out.reserve(size + size / 255 + 16);
+
+      size_t anchor = 0;
+      if (size > s_match_limit) {
+         std::vector<uint32_t> table(1 << s_hash_bits, 0);
+         const size_t search_end = size - s_match_limit, match_end = size - s_last_literals;
+         size_t misses = 0;
+         for (size_t pos = 0; pos < search_end;) {
+            auto sequence = read32(src + pos);
+            auto& slot = table[hash(sequence)];
+            size_t ref = slot;
+            slot = (uint32_t)pos;
+            if (ref >= pos || pos - ref > s_max_offset || read32(src + ref) != sequence) {
+               pos += 1 + (misses++ >> s_skip_trigger);
+               continue;
+            }
+            misses = 0;
+
+            while (pos > anchor && ref > 0 && src[pos - 1] == src[ref - 1]) {
+               --pos;
+               --ref;
+            }
+            size_t len = s_min_match;
+            while (pos + len < match_end && src[pos + len] == src[ref + len]) {
+               ++len;
+            }
+            writeSequence(out, src + anchor, pos - anchor, pos - ref, len);
+            pos += len;
+            anchor = pos;
+         }
+      }
+
+      auto literals_len = size - anchor;
+      out += (char)(std::min<size_t>(literals_len, 15) << 4);
+      if (literals_len >= 15) {
+         writeLength(out, literals_len - 15);
+      }
+      out.append((const char*)src + anchor, literals_len);
+      return out;
+   }
+
+   bool decompress(std::string_view block, size_t raw_size, std::string& output)
+   {
+      output.resize(raw_size);
+      auto ip = (const uint8_t*)block.data(), end = ip + block.size();
+      auto dst = (uint8_t*)output.data();
+      size_t op = 0;
+      while (ip < end) {
+         uint8_t token = *ip++;
+         size_t literals_len = token >> 4;
+         if (!readLength(ip, end, literals_len) || (size_t)(end - ip) < literals_len || raw_size - op < literals_len) {
+            return false;
+         }
+         memcpy(dst + op, ip, literals_len);
+         ip += literals_len;
+         op += literals_len;
+         if (ip == end) {
+            break;
+         }
+
+         if (end - ip < 2) {
+            return false;
+         }
+         size_t offset = ip[0] | ip[1] << 8;
+         ip += 2;
+         size_t match_len = token & 15;
+         if (!offset || offset > op || !readLength(ip, end, match_len) || raw_size - op < match_len + s_min_match) {
+            return false;
+         }
+         match_len += s_min_match;
+         // Overlapping copies repeat the last offset bytes
+         for (auto from = dst + op - offset, to = dst + op, last = to + match_len; to != last;) {
+            *to++ = *from++;
+         }
+         op += match_len;
+      }
+      return op == raw_size;
+   }
+
+} // namespace lz4
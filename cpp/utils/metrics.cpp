@@ -0,0 +1,211 @@
+#include "pch.h"
+#include "metrics.h"
+
+#include <memory>
+
+namespace metrics {
+
+   namespace {
+
+      enum class eType { counter, gauge, histogram, function };
+
+      struct sEntry
+      {
+         std::string name, help;
+         eType type;
+         std::unique_ptr<cCounter> counter;
+         std::unique_ptr<cGauge> gauge;
+         std::unique_ptr<cHistogram> histogram;
+         std::function<int64_t()> read;
+      };
+
+      // Bucket bounds reported to Prometheus, the histogram's own buckets are far too many
+      constexpr uint64_t s_bounds[] = {
+         1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000,
+         100000, 200000, 500000, 1000000, 2000000, 5000000, 10000000, 20000000, 50000000,
+      };
+
+      std::mutex s_mutex;
+      std::vector<sEntry> s_entries;
+
+      sEntry& add(const char* name, const char* help, eType type)
+      {
+         for (auto& e : s_entries) {
+            if (e.name == name) {
+               return e;
+            }
+         }
+         auto& e = s_entries.emplace_back();
+         e.name = name;
+         e.help = help;
+         e.type = type;
+         return e;
+      }
+
+      void histogramLines(std::string& out, const std::string& name, const cHistogram& h)
+      {
+         std::vector<std::pair<uint64_t, uint64_t>> buckets;
+         h.forEachBucket([&](uint64_t highest, uint64_t n) { buckets.push_back({ highest, n }); });
+
+         uint64_t cumulative = 0;
+         size_t idx = 0;
+         for (auto bound : s_bounds) {
+            for (; idx < buckets.size() && buckets[idx].first <= bound; ++idx) {
+               cumulative += buckets[idx].second;
+            }
+            fmt::format_to(std::back_inserter(out), "{}_bucket{{le=\"{}\"}} {}\n", name, bound, cumulative);
+         }
+         for (; idx < buckets.size(); ++idx) {
+            cumulative += buckets[idx].second;
+         }
+         // Buckets and count are updated separately, keep the series monotonic
+         auto count = std::max(cumulative, h.count());
+         fmt::format_to(std::back_inserter(out), "{}_bucket{{le=\"+Inf\"}} {}\n{}_sum {}\n{}_count {}\n", name, count, name, h.sum(), name, count);
+      }
+
+   } // namespace
+
+   cCounter& counter(const char* name, const char* help)
+   {
+      std::lock_guard lock(s_mutex);
+      auto& e = add(name, help, eType::counter);
+      if (!e.counter) {
+         e.counter = std::make_unique<cCounter>();
+      }
+      return *e.counter;
+   }
+
+   cGauge& gauge(const char* name, const char* help)
+   {
+      std::lock_guard lock(s_mutex);
+      auto& e = add(name, help, eType::gauge);
+      if (!e.gauge) {
+         e.gauge = std::make_unique<cGauge>();
+      }
+      return *e.gauge;
+   }
+
+   cHistogram& histogram(const char* name, const char* help)
+   {
+      std::lock_guard lock(s_mutex);
+      auto& e = add(name, help, eType::histogram);
+      if (!e.histogram) {
+         e.histogram = std::make_unique<cHistogram>();
+      }
+      return *e.histogram;
+   }
+
+   void gauge(const char* name, const char* help, std::function<int64_t()> read)
+   {
+      std::lock_guard lock(s_mutex);
+      add(name, help, eType::function).read = std::move(read);
+   }
+
+   std::string json()
+   {
+      std::lock_guard lock(s_mutex);
+      std::string out = "{";
+      for (const auto& e : s_entries) {
+         if (out.size() > 1) {
+            out += ',';
+         }
+         switch (e.type) {
+         case eType::counter:
+            fmt::format_to(std::back_inserter(out), R"("{}":{})", e.name, e.counter->value());
+            break;
+         case eType::gauge:
+            fmt::format_to(std::back_inserter(out), R"("{}":{})", e.name, e.gauge->value());
+            break;
+         case eType::histogram:
+            fmt::format_to(std::back_inserter(out), R"("{}":{})", e.name, e.histogram->json());
+            break;
+         case eType::function:
+            fmt::format_to(std::back_inserter(out), R"("{}":{})", e.name, e.read ? e.read() : 0);
+            break;
+         }
+      }
+      out += '}';
+      return out;
+   }
+
+   std::string prometheus()
+   {
+      std::lock_guard lock(s_mutex);
+      std::string out;
+      for (const auto& e : s_entries) {
+         const char* type = e.type == eType::counter ? "counter" : e.type == eType::histogram ? "histogram" : "gauge";
+         fmt::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", e.name, e.help, e.name, type);
+         switch (e.type) {
+         case eType::counter:
+            fmt::format_to(std::back_inserter(out), "{} {}\n", e.name, e.counter->value());
+            break;
+         case eType::gauge:
+            fmt::format_to(std::back_inserter(out), "{} {}\n", e.name, e.gauge->value());
+            break;
+         case eType::histogram:
+            histogramLines(out, e.name, *e.histogram);
+            break;
+         case eType::function:
+            fmt::format_to(std::back_inserter(out), "{} {}\n", e.name, e.read ? e.read() : 0);
+            break;
+         }
+      }
+      return out;
+   }
+
+   bool writeFile(const fs::path& fname)
+   {
+      // The textfile collector only reads *.prom, the temporary file is ignored
+      auto tmp = fname;
+      tmp += fmt::format(".{}.tmp", _getpid());
+      {
+         std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+         if (!(out << prometheus())) {
+            return false;
+         }
+      }
+      if (!MoveFileEx(pathString(tmp).c_str(), pathString(fname).c_str(), MOVEFILE_REPLACE_EXISTING)) {
+         DeleteFile(pathString(tmp).c_str());
+         return false;
+      }
+      return true;
+   }
+
+   cExporter::~cExporter()
+   {
+      stop();
+   }
+
+   void cExporter::start(const fs::path& fname, DWORD interval_ms)
+   {
+      m_fname = fname;
+      m_interval_ms = std::max<DWORD>(interval_ms, 100);
+      m_thread = std::thread(&cExporter::run, this);
+   }
+
+   void cExporter::stop()
+   {
+      {
+         std::lock_guard lock(m_mutex);
+         m_stop = true;
+      }
+      m_wake.notify_one();
+      if (m_thread.joinable()) {
+         m_thread.join();
+      }
+   }
+
+   void cExporter::run()
+   {
+      std::unique_lock lock(m_mutex);
+      for (bool stopping = false;; stopping = m_wake.wait_for(lock, std::chrono::milliseconds(m_interval_ms), [this] { return m_stop; })) {
+         if (!writeFile(m_fname)) {
+            ERROR("Cannot write metrics to {} ({})", m_fname.string(), getErrorMessage());
+         }
+         if (stopping) {
+            break;
+         }
+      }
+   }
+
+} // namespace metrics
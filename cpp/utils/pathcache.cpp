@@ -0,0 +1,286 @@
+#include "pch.h"
+#include "pathcache.h"
+
+namespace {
+
+   // The index: sHeader, then count entries of sEntry followed by the directory path and
+   // its file names, lower case and each enclosed in newlines ("\na.exe\nb.dll\n")
+   constexpr uint32_t s_magic = 0x43504444;   // "DDPC"
+   constexpr uint32_t s_version = sizeof(TCHAR);   // ANSI and Unicode builds do not share an index
+   constexpr size_t s_max_dirs = 512;
+
+   struct sHeader
+   {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t count;
+   };
+
+   struct sEntry
+   {
+      uint64_t mtime;
+      uint32_t path_len;
+      uint32_t names_len;
+   };
+
+   struct sDir
+   {
+      string_view path;
+      uint64_t mtime;
+      string_view names;
+   };
+
+   string lower(string_view s)
+   {
+      string retval(s);
+      std::transform(retval.begin(), retval.end(), retval.begin(), [](TCHAR c) { return (TCHAR)_totlower(c); });
+      return retval;
+   }
+
+   // 0 when the directory does not exist
+   uint64_t lastWriteTime(const string& dir)
+   {
+      WIN32_FILE_ATTRIBUTE_DATA data;
+      if (!GetFileAttributesEx(dir.c_str(), GetFileExInfoStandard, &data) || !(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+         return 0;
+      }
+      return (uint64_t)data.ftLastWriteTime.dwHighDateTime << 32 | data.ftLastWriteTime.dwLowDateTime;
+   }
+
+   string listFiles(const string& dir)
+   {
+      string retval = _T("\n");
+      WIN32_FIND_DATA data;
+      HANDLE hFind = FindFirstFile(pathString(fs::path(dir) / _T("*")).c_str(), &data);
+      if (hFind == INVALID_HANDLE_VALUE) {
+         return retval;
+      }
+      do {
+         if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            retval += lower(data.cFileName);
+            retval += _T('\n');
+         }
+      } while (FindNextFile(hFind, &data));
+      FindClose(hFind);
+      return retval;
+   }
+
+   class cIndex
+   {
+   public:
+      explicit cIndex(const fs::path& fname)
+         : m_fname(fname)
+      {
+         open();
+      }
+      ~cIndex()
+      {
+         close();
+      }
+
+      // The listing of dir (lower case), refreshed when its last write time differs
+      string_view names(const string& dir, uint64_t mtime)
+      {
+         for (const auto& d : m_dirs) {
+            if (d.path == dir) {
+               if (d.mtime == mtime) {
+                  return d.names;
+               }
+               break;
+            }
+         }
+         auto& fresh = m_fresh.emplace_back(dir, mtime, listFiles(dir));
+         return std::get<2>(fresh);
+      }
+
+      // Writes the index back when a directory was listed
+      void save()
+      {
+         if (m_fresh.empty()) {
+            return;
+         }
+
+         std::vector<sDir> dirs;
+         for (const auto& [path, mtime, names] : m_fresh) {
+            dirs.push_back({ path, mtime, names });
+         }
+         for (const auto& d : m_dirs) {
+            if (dirs.size() >= s_max_dirs) {
+               break;
+            }
+            if (std::none_of(m_fresh.begin(), m_fresh.end(), [&d](const auto& f) { return std::get<0>(f) == d.path; })) {
+               dirs.push_back(d);
+            }
+         }
+
+         std::string data;
+         sHeader header{ s_magic, s_version, (uint32_t)dirs.size() };
+         data.append((const char*)&header, sizeof(header));
+         for (const auto& d : dirs) {
+            sEntry entry{ d.mtime, (uint32_t)d.path.size(), (uint32_t)d.names.size() };
+            data.append((const char*)&entry, sizeof(entry));
+            data.append((const char*)d.path.data(), d.path.size() * sizeof(TCHAR));
+            data.append((const char*)d.names.data(), d.names.size() * sizeof(TCHAR));
+         }
+
+         // Mapped files cannot be replaced, other hooks may still map the old one: the next hook retries
+         close();
+         std::error_code ec;
+         fs::create_directories(m_fname.parent_path(), ec);
+         auto tmp = m_fname;
+         tmp += fmt::format(".{}", _getpid());
+         {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out.write(data.data(), data.size())) {
+               return;
+            }
+         }
+         if (!MoveFileEx(pathString(tmp).c_str(), pathString(m_fname).c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            LOG("Cannot replace {} ({})", m_fname.string(), getErrorMessage());
+            DeleteFile(pathString(tmp).c_str());
+         }
+      }
+
+   private:
+      void open()
+      {
+         m_file = CreateFile(pathString(m_fname).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+         if (m_file == INVALID_HANDLE_VALUE) {
+            return;
+         }
+         LARGE_INTEGER size;
+         if (!GetFileSizeEx(m_file, &size) || size.QuadPart < (LONGLONG)sizeof(sHeader)) {
+            return;
+         }
+         m_mapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+         if (!m_mapping) {
+            return;
+         }
+         m_view = MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+         if (!m_view) {
+            return;
+         }
+
+         // A damaged index is ignored and replaced
+         auto p = (const char*)m_view, end = p + size.QuadPart;
+         auto header = (const sHeader*)p;
+         if (header->magic != s_magic || header->version != s_version) {
+            return;
+         }
+         p += sizeof(sHeader);
+         for (uint32_t idx = 0; idx < header->count; ++idx) {
+            if (end - p < (ptrdiff_t)sizeof(sEntry)) {
+               m_dirs.clear();
+               return;
+            }
+            sEntry entry;
+            memcpy(&entry, p, sizeof(entry));
+            p += sizeof(sEntry);
+            if ((uint64_t)(end - p) < ((uint64_t)entry.path_len + entry.names_len) * sizeof(TCHAR)) {
+               m_dirs.clear();
+               return;
+            }
+            auto chars = (const TCHAR*)p;
+            m_dirs.push_back({ string_view(chars, entry.path_len), entry.mtime, string_view(chars + entry.path_len, entry.names_len) });
+            p += ((size_t)entry.path_len + entry.names_len) * sizeof(TCHAR);
+         }
+      }
+
+      void close()
+      {
+         m_dirs.clear();
+         if (m_view) {
+            UnmapViewOfFile(m_view);
+            m_view = nullptr;
+         }
+         if (m_mapping) {
+            CloseHandle(m_mapping);
+            m_mapping = nullptr;
+         }
+         if (m_file != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_file);
+            m_file = INVALID_HANDLE_VALUE;
+         }
+      }
+
+      fs::path m_fname;
+      HANDLE m_file = INVALID_HANDLE_VALUE;
+      HANDLE m_mapping = nullptr;
+      const void* m_view = nullptr;
+      std::vector<sDir> m_dirs;
+      std::list<std::tuple<string, uint64_t, string>> m_fresh;
+   };
+
+} // namespace
+
+namespace pathcache {
+
+   string resolve(const string& program)
+   {
+      fs::path program_path = program;
+      if (program_path.is_absolute()) {
+         return program;
+      }
+      auto in_cwd = fs::current_path() / program_path;
+      std::error_code ec;
+      if (program_path.has_parent_path() || fs::exists(in_cwd, ec)) {
+         return pathString(in_cwd);
+      }
+      auto path_var = _tgetenv(_T("PATH"));
+      if (!path_var) {
+         return pathString(in_cwd);
+      }
+
+      // Newline-enclosed, the way the index stores names
+      std::vector<string> candidates = { join(_T("\n"sv), lower(program), _T("\n"sv)) };
+      if (!program_path.has_extension()) {
+         auto pathext = _tgetenv(_T("PATHEXT"));
+         string_view exts = pathext ? pathext : _T(".COM;.EXE;.BAT;.CMD");
+         for (size_t pos = 0; pos < exts.size();) {
+            auto next = std::min(exts.find(_T(';'), pos), exts.size());
+            if (next > pos) {
+               candidates.push_back(join(_T("\n"sv), lower(program), lower(exts.substr(pos, next - pos)), _T("\n"sv)));
+            }
+            pos = next + 1;
+         }
+      }
+
+      cIndex index(fs::temp_directory_path() / _T("DeepDebugger") / _T("pathcache.bin"));
+      string retval;
+      string_view dirs = path_var;
+      for (size_t pos = 0; pos < dirs.size() && retval.empty();) {
+         auto next = std::min(dirs.find(_T(';'), pos), dirs.size());
+         auto dir = dirs.substr(pos, next - pos);
+         pos = next + 1;
+         if (dir.size() > 1 && dir.front() == _T('"') && dir.back() == _T('"')) {
+            dir = dir.substr(1, dir.size() - 2);
+         }
+         if (dir.empty()) {
+            continue;
+         }
+         auto key = lower(dir);
+         auto mtime = lastWriteTime(key);
+         if (!mtime) {
+            continue;
+         }
+         auto names = index.names(key, mtime);
+         for (const auto& candidate : candidates) {
+            if (names.find(candidate) != string_view::npos) {
+               // The name as given, the extension in lower case
+               auto found = fs::path(dir) / program_path;
+               found += string_view(candidate).substr(1 + program.size(), candidate.size() - 2 - program.size());
+               retval = pathString(found);
+               break;
+            }
+         }
+      }
+      index.save();
+
+      if (retval.empty()) {
+         LOG("{} not found along PATH", program);
+         return pathString(in_cwd);
+      }
+      return retval;
+   }
+
+} // namespace pathcache
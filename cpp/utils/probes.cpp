@@ -0,0 +1,23 @@
+#include "pch.h"
+#include "probes.h"
+
+// {308ca5bd-6b1e-51af-2134-b3641805673e}, the EventSource-style GUID of "DeepDebugger"
+TRACELOGGING_DEFINE_PROVIDER(g_deepdbg_provider, "DeepDebugger",
+   (0x308ca5bd, 0x6b1e, 0x51af, 0x21, 0x34, 0xb3, 0x64, 0x18, 0x05, 0x67, 0x3e));
+
+namespace {
+
+   // Every probe refers to the provider, which links this in wherever a probe is used
+   struct sProviderRegistration
+   {
+      sProviderRegistration()
+      {
+         TraceLoggingRegister(g_deepdbg_provider);
+      }
+      ~sProviderRegistration()
+      {
+         TraceLoggingUnregister(g_deepdbg_provider);
+      }
+   } s_registration;
+
+} // namespace
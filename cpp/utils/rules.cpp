@@ -0,0 +1,438 @@
+// rules.cpp : Match rules compiled into a memory-mapped automaton.
+//
+
+#include "pch.h"
+#include "framework.h"
+
+#include "rules.h"
+
+#include <queue>
+
+using namespace rules;
+
+namespace {
+   constexpr char s_magic[8] = { 'D', 'D', 'R', 'U', 'L', 'E', 'S', '1' };
+   constexpr uint32_t s_none = UINT32_MAX;
+}
+
+struct cMatchRules::sHeader
+{
+   char magic[8];
+   uint64_t mtime;
+   uint64_t size;
+   uint32_t default_action;
+   uint32_t rule_count;
+   uint32_t node_count;
+   uint32_t edge_count;
+   uint32_t strings_size;
+   uint32_t rules_offset;
+   uint32_t nodes_offset;
+   uint32_t edges_offset;
+   uint32_t strings_offset;
+};
+
+struct cMatchRules::sRule
+{
+   eAction action;
+   eKind kind;
+   uint16_t reserved;
+   uint32_t name_offset, name_len;       // env: variable name
+   uint32_t pattern_offset, pattern_len;
+};
+
+struct cMatchRules::sNode
+{
+   uint32_t first_edge;
+   uint32_t edge_count;
+   uint32_t fail;
+   uint32_t out;                         // lowest matching rule index, including fail links
+};
+
+struct cMatchRules::sEdge
+{
+   uint32_t ch;
+   uint32_t target;
+};
+
+bool rules::globMatch(string_view pattern, string_view str, bool icase)
+{
+   auto eq = [icase](TCHAR a, TCHAR b) { return a == b || (icase && _totlower(a) == _totlower(b)); };
+
+   size_t p = 0, s = 0, star = string_view::npos, mark = 0;
+   while (s < str.size()) {
+      if (p < pattern.size() && (pattern[p] == _T('?') || eq(pattern[p], str[s]))) {
+         ++p;
+         ++s;
+      }
+      else if (p < pattern.size() && pattern[p] == _T('*')) {
+         star = p++;
+         mark = s;
+      }
+      else if (star != string_view::npos) {
+         p = star + 1;
+         s = ++mark;
+      }
+      else {
+         return false;
+      }
+   }
+   while (p < pattern.size() && pattern[p] == _T('*')) {
+      ++p;
+   }
+   return p == pattern.size();
+}
+
+cMatchRules::~cMatchRules()
+{
+   unmap();
+}
+
+bool cMatchRules::load()
+{
+   auto fname = _tgetenv(_T("DEEPDEBUGGER_RULES"));
+   if (!fname || !*fname) {
+      return false;
+   }
+   return load(fname);
+}
+
+bool cMatchRules::load(const fs::path& fname)
+{
+   std::error_code ec;
+   uint64_t size = fs::file_size(fname, ec);
+   if (ec) {
+      ERROR("Cannot access rules file {} ({})", fname.string(), ec.message());
+      return false;
+   }
+   uint64_t mtime = fs::last_write_time(fname, ec).time_since_epoch().count();
+
+   auto cache_dir = fs::temp_directory_path(ec) / _T("DeepDebugger");
+   auto cache_name = cache_dir / fmt::format("rules-{:016x}.bin", std::hash<string>()(fs::absolute(fname, ec).string()));
+
+   if (map(cache_name, mtime, size)) {
+      return true;
+   }
+
+   LOG("Compiling rules {} into {}", fname.string(), cache_name.string());
+   fs::create_directories(cache_dir, ec);
+   if (!compile(fname, cache_name, mtime, size)) {
+      return false;
+   }
+   return map(cache_name, mtime, size);
+}
+
+bool cMatchRules::map(const fs::path& fname, uint64_t mtime, uint64_t size)
+{
+   unmap();
+
+   m_file = CreateFile(pathString(fname).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+   if (m_file == INVALID_HANDLE_VALUE) {
+      return false;
+   }
+
+   LARGE_INTEGER file_size{};
+   if (GetFileSizeEx(m_file, &file_size) && file_size.QuadPart >= (LONGLONG)sizeof(sHeader)) {
+      m_mapping = CreateFileMapping(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (m_mapping) {
+         m_base = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+      }
+   }
+
+   if (m_base) {
+      auto hdr = header();
+      uint64_t end = (uint64_t)hdr->strings_offset + (uint64_t)hdr->strings_size * sizeof(TCHAR);
+      if (memcmp(hdr->magic, s_magic, sizeof(s_magic)) == 0 && hdr->mtime == mtime && hdr->size == size && end <= (uint64_t)file_size.QuadPart) {
+         return true;
+      }
+      LOG("Rules cache {} is stale", fname.string());
+   }
+
+   unmap();
+   return false;
+}
+
+void cMatchRules::unmap()
+{
+   if (m_base) {
+      UnmapViewOfFile(m_base);
+      m_base = nullptr;
+   }
+   if (m_mapping) {
+      CloseHandle(m_mapping);
+      m_mapping = nullptr;
+   }
+   if (m_file != INVALID_HANDLE_VALUE) {
+      CloseHandle(m_file);
+      m_file = INVALID_HANDLE_VALUE;
+   }
+}
+
+bool cMatchRules::compile(const fs::path& fname, const fs::path& cache_name, uint64_t mtime, uint64_t size)
+{
+   ifstream inp(fname);
+   if (!inp) {
+      ERROR("Cannot open rules file {}", fname.string());
+      return false;
+   }
+
+   eAction default_action = eAction::debug;
+   std::vector<sRule> rule_list;
+   string strings;
+
+   struct sTrieNode
+   {
+      std::map<TCHAR, uint32_t> children;
+      uint32_t fail = 0;
+      uint32_t out = s_none;
+   };
+   std::vector<sTrieNode> trie(1);
+
+   auto parseAction = [](string_view s, eAction& action) {
+      if (s == _T("debug")) {
+         action = eAction::debug;
+         return true;
+      }
+      if (s == _T("skip")) {
+         action = eAction::skip;
+         return true;
+      }
+      return false;
+   };
+   auto addString = [&strings](string_view s) {
+      auto offset = (uint32_t)strings.size();
+      strings.append(s);
+      return offset;
+   };
+
+   string line;
+   for (size_t line_no = 1; std::getline(inp, line); ++line_no) {
+      string_view v = trim(line);
+      if (v.empty() || v.front() == _T('#')) {
+         continue;
+      }
+
+      auto action_str = readUntil(v, _T(' '));
+      v = ltrim(v);
+      if (action_str == _T("default")) {
+         if (!parseAction(trim(v), default_action)) {
+            ERROR("{}:{}: invalid default action", fname.string(), line_no);
+         }
+         continue;
+      }
+
+      sRule rule{};
+      auto kind_str = readUntil(v, _T(' '));
+      auto pattern = trim(v);
+      if (!parseAction(action_str, rule.action) || pattern.empty()) {
+         ERROR("{}:{}: cannot parse rule", fname.string(), line_no);
+         continue;
+      }
+
+      if (kind_str == _T("program")) {
+         rule.kind = eKind::program;
+      }
+      else if (kind_str == _T("arg")) {
+         rule.kind = eKind::arg;
+      }
+      else if (kind_str == _T("cmdline")) {
+         rule.kind = eKind::cmdline;
+         uint32_t state = 0;
+         for (TCHAR c : pattern) {
+            auto [it, inserted] = trie[state].children.try_emplace(c, (uint32_t)trie.size());
+            state = it->second;
+            if (inserted) {
+               trie.emplace_back();
+            }
+         }
+         trie[state].out = std::min(trie[state].out, (uint32_t)rule_list.size());
+      }
+      else if (kind_str == _T("env")) {
+         rule.kind = eKind::env;
+         auto name = readUntil(pattern, _T('='));
+         rule.name_offset = addString(name);
+         rule.name_len = (uint32_t)name.size();
+         if (pattern.empty()) {
+            pattern = _T("*");
+         }
+      }
+      else {
+         ERROR("{}:{}: unknown rule kind", fname.string(), line_no);
+         continue;
+      }
+
+      rule.pattern_offset = addString(pattern);
+      rule.pattern_len = (uint32_t)pattern.size();
+      rule_list.push_back(rule);
+   }
+
+   // Failure links, breadth first so that a node's fail target is always complete
+   std::queue<uint32_t> pending;
+   for (auto& [c, child] : trie[0].children) {
+      pending.push(child);
+   }
+   while (!pending.empty()) {
+      uint32_t state = pending.front();
+      pending.pop();
+      for (auto& [c, child] : trie[state].children) {
+         uint32_t f = trie[state].fail;
+         while (f && !trie[f].children.contains(c)) {
+            f = trie[f].fail;
+         }
+         auto it = trie[f].children.find(c);
+         trie[child].fail = it != trie[f].children.end() && it->second != child ? it->second : 0;
+         trie[child].out = std::min(trie[child].out, trie[trie[child].fail].out);
+         pending.push(child);
+      }
+   }
+
+   std::vector<sNode> nodes;
+   std::vector<sEdge> edges;
+   nodes.reserve(trie.size());
+   for (auto& t : trie) {
+      nodes.push_back({ (uint32_t)edges.size(), (uint32_t)t.children.size(), t.fail, t.out });
+      for (auto& [c, child] : t.children) {
+         edges.push_back({ (uint32_t)c, child });
+      }
+   }
+
+   sHeader hdr{};
+   memcpy(hdr.magic, s_magic, sizeof(s_magic));
+   hdr.mtime = mtime;
+   hdr.size = size;
+   hdr.default_action = (uint32_t)default_action;
+   hdr.rule_count = (uint32_t)rule_list.size();
+   hdr.node_count = (uint32_t)nodes.size();
+   hdr.edge_count = (uint32_t)edges.size();
+   hdr.strings_size = (uint32_t)strings.size();
+   hdr.rules_offset = sizeof(sHeader);
+   hdr.nodes_offset = hdr.rules_offset + hdr.rule_count * sizeof(sRule);
+   hdr.edges_offset = hdr.nodes_offset + hdr.node_count * sizeof(sNode);
+   hdr.strings_offset = hdr.edges_offset + hdr.edge_count * sizeof(sEdge);
+
+   // Written aside and renamed, so that concurrent hooks never map a partial image
+   auto tmp_name = cache_name;
+   tmp_name += fmt::format(".{}", _getpid());
+   {
+      std::ofstream out(tmp_name, std::ios::binary | std::ios::trunc);
+      out.write((const char*)&hdr, sizeof(hdr));
+      out.write((const char*)rule_list.data(), rule_list.size() * sizeof(sRule));
+      out.write((const char*)nodes.data(), nodes.size() * sizeof(sNode));
+      out.write((const char*)edges.data(), edges.size() * sizeof(sEdge));
+      out.write((const char*)strings.data(), strings.size() * sizeof(TCHAR));
+      if (!out) {
+         ERROR("Cannot write rules cache {}", tmp_name.string());
+         return false;
+      }
+   }
+
+   std::error_code ec;
+   fs::rename(tmp_name, cache_name, ec);
+   if (ec) {
+      // Another hook may be holding the old image mapped, it will pick ours up next time
+      fs::remove(tmp_name, ec);
+      return false;
+   }
+   LOG("Rules compiled: {} rules, {} automaton states", hdr.rule_count, hdr.node_count);
+   return true;
+}
+
+const cMatchRules::sHeader* cMatchRules::header() const
+{
+   return (const sHeader*)m_base;
+}
+
+const cMatchRules::sRule* cMatchRules::rule(uint32_t idx) const
+{
+   return (const sRule*)(m_base + header()->rules_offset) + idx;
+}
+
+const cMatchRules::sNode* cMatchRules::node(uint32_t idx) const
+{
+   return (const sNode*)(m_base + header()->nodes_offset) + idx;
+}
+
+const cMatchRules::sEdge* cMatchRules::edges(const sNode* n) const
+{
+   return (const sEdge*)(m_base + header()->edges_offset) + n->first_edge;
+}
+
+string_view cMatchRules::str(uint32_t offset, uint32_t len) const
+{
+   return string_view((const TCHAR*)(m_base + header()->strings_offset) + offset, len);
+}
+
+uint32_t cMatchRules::next(uint32_t state, TCHAR c) const
+{
+   while (true) {
+      auto n = node(state);
+      auto first = edges(n), last = first + n->edge_count;
+      auto it = std::lower_bound(first, last, (uint32_t)c, [](const sEdge& e, uint32_t ch) { return e.ch < ch; });
+      if (it != last && it->ch == (uint32_t)c) {
+         return it->target;
+      }
+      if (!state) {
+         return 0;
+      }
+      state = n->fail;
+   }
+}
+
+eAction cMatchRules::evaluate(string_view program, std::span<TCHAR*> args) const
+{
+   if (!m_base) {
+      return eAction::debug;
+   }
+
+   auto hdr = header();
+
+   uint32_t best = s_none;
+   if (hdr->node_count > 1) {
+      uint32_t state = 0;
+      for (size_t idx = 0; idx < args.size(); ++idx) {
+         if (idx) {
+            state = next(state, _T(' '));
+            best = std::min(best, node(state)->out);
+         }
+         for (auto s = args[idx]; *s; ++s) {
+            state = next(state, *s);
+            best = std::min(best, node(state)->out);
+         }
+      }
+   }
+
+#ifdef _WIN32
+   constexpr bool icase_paths = true;
+#else
+   constexpr bool icase_paths = false;
+#endif
+
+   uint32_t limit = std::min(best, hdr->rule_count);
+   for (uint32_t idx = 0; idx < limit; ++idx) {
+      auto r = rule(idx);
+      auto pattern = str(r->pattern_offset, r->pattern_len);
+      bool matched = false;
+      switch (r->kind) {
+      case eKind::program:
+         matched = globMatch(pattern, program, icase_paths);
+         break;
+      case eKind::arg:
+         matched = std::any_of(args.begin(), args.end(), [&pattern](const TCHAR* a) { return globMatch(pattern, a); });
+         break;
+      case eKind::env:
+         if (auto value = _tgetenv(string(str(r->name_offset, r->name_len)).c_str())) {
+            matched = globMatch(pattern, value);
+         }
+         break;
+      case eKind::cmdline:
+         break;
+      }
+      if (matched) {
+         best = idx;
+         break;
+      }
+   }
+
+   auto action = best < hdr->rule_count ? rule(best)->action : (eAction)hdr->default_action;
+   LOG("Rules evaluated for {}: {}", program, action == eAction::skip ? "skip" : "debug");
+   return action;
+}
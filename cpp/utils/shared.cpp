@@ -0,0 +1,70 @@
+#include "pch.h"
+#include "shared.h"
+
+namespace shared {
+
+   size_t threshold()
+   {
+      auto value = _tgetenv(_T("DEEPDEBUGGER_SHARED_MEMORY"));
+      return value ? (size_t)std::max<int64_t>(_ttoi64(value), 0) : 0;
+   }
+
+   HANDLE create(const string_view& blocks)
+   {
+      uint64_t size = blocks.size() * sizeof(TCHAR);
+      HANDLE section = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+      if (!section) {
+         ERROR("Cannot create a section of {} bytes ({})", size, getErrorMessage());
+         return nullptr;
+      }
+      auto view = MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, 0);
+      if (!view) {
+         ERROR("Cannot map a section of {} bytes ({})", size, getErrorMessage());
+         CloseHandle(section);
+         return nullptr;
+      }
+      memcpy(view, blocks.data(), size);
+
+      // Nobody writes to the blocks once they are out of view
+      UnmapViewOfFile(view);
+      return section;
+   }
+
+   std::shared_ptr<const cView> cView::open(DWORD pid, const string_view& handle, size_t size)
+   {
+      HANDLE hProcess = pid ? OpenProcess(PROCESS_DUP_HANDLE, FALSE, pid) : nullptr;
+      if (!hProcess) {
+         ERROR("Cannot open requester {} ({})", pid, getErrorMessage());
+         return nullptr;
+      }
+      HANDLE section = nullptr;
+      auto source = (HANDLE)(uintptr_t)_ttoi64(string(handle).c_str());
+      bool duplicated = DuplicateHandle(hProcess, source, GetCurrentProcess(), &section, FILE_MAP_READ, FALSE, 0);
+      CloseHandle(hProcess);
+      if (!duplicated) {
+         ERROR("Cannot take section {} of requester {} ({})", handle, pid, getErrorMessage());
+         return nullptr;
+      }
+
+      // The view keeps the section alive
+      auto view = MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(section);
+      if (!view) {
+         ERROR("Cannot map section {} of requester {} ({})", handle, pid, getErrorMessage());
+         return nullptr;
+      }
+      MEMORY_BASIC_INFORMATION info{};
+      if (!VirtualQuery(view, &info, sizeof(info)) || info.RegionSize < size) {
+         ERROR("Section {} of requester {} is smaller than {} bytes", handle, pid, size);
+         UnmapViewOfFile(view);
+         return nullptr;
+      }
+      return std::shared_ptr<const cView>(new cView(view, size));
+   }
+
+   cView::~cView()
+   {
+      UnmapViewOfFile(m_view);
+   }
+
+} // namespace shared
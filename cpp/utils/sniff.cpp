@@ -0,0 +1,317 @@
+#include "pch.h"
+#include "sniff.h"
+
+#include <mutex>
+#include <optional>
+
+namespace {
+
+   constexpr uint16_t s_elf_exec = 2;
+   constexpr uint16_t s_elf_dyn = 3;
+   constexpr uint16_t s_pe_dll = 0x2000;
+
+   uint16_t read16(std::string_view data, size_t offset, bool big_endian = false)
+   {
+      if (offset + 2 > data.size()) {
+         return 0;
+      }
+      auto b = (const uint8_t*)data.data() + offset;
+      return big_endian ? (uint16_t)(b[0] << 8 | b[1]) : (uint16_t)(b[1] << 8 | b[0]);
+   }
+
+   uint32_t read32(std::string_view data, size_t offset)
+   {
+      if (offset + 4 > data.size()) {
+         return 0;
+      }
+      uint32_t retval;
+      memcpy(&retval, data.data() + offset, sizeof(retval));
+      return retval;
+   }
+
+   string lower(string s)
+   {
+      std::transform(s.begin(), s.end(), s.begin(), [](TCHAR c) { return (TCHAR)_totlower(c); });
+      return s;
+   }
+
+   sniff::eKind interpreterKind(const string& interpreter)
+   {
+      auto name = lower(pathString(fs::path(interpreter).stem()));
+      if (name.starts_with(_T("python")) || name == _T("pypy") || name == _T("pypy3")) {
+         return sniff::eKind::python;
+      }
+      if (name == _T("node") || name == _T("nodejs")) {
+         return sniff::eKind::node;
+      }
+      if (name == _T("sh") || name == _T("bash") || name == _T("dash")) {
+         return sniff::eKind::shell;
+      }
+      return sniff::eKind::unknown;
+   }
+
+   // "#!/usr/bin/env -S python3 -u" names python3
+   string shebangInterpreter(std::string_view header)
+   {
+      auto line = header.substr(2, header.find('\n') - 2);
+      std::vector<std::string_view> words;
+      while (!line.empty()) {
+         auto start = line.find_first_not_of(" \t\r");
+         if (start == std::string_view::npos) {
+            break;
+         }
+         line.remove_prefix(start);
+         auto end = std::min(line.find_first_of(" \t\r"), line.size());
+         words.push_back(line.substr(0, end));
+         line.remove_prefix(end);
+      }
+      if (words.empty()) {
+         return string();
+      }
+      size_t idx = 0;
+      if (fs::path(words[0]).filename() == "env") {
+         for (idx = 1; idx < words.size() && (words[idx].starts_with('-') || words[idx].find('=') != std::string_view::npos); ++idx) {
+         }
+         if (idx == words.size()) {
+            return string();
+         }
+      }
+      return string(words[idx].begin(), words[idx].end());
+   }
+
+   struct sKey
+   {
+      DWORD volume;
+      uint64_t index;
+      uint64_t mtime;
+
+      auto operator<=>(const sKey&) const = default;
+   };
+
+   // The persisted cache: sHeader, then count entries of sEntry each followed by its
+   // interpreter, most recently classified first
+   constexpr uint32_t s_magic = 0x53504444;   // "DDPS"
+   constexpr uint32_t s_version = sizeof(TCHAR);   // ANSI and Unicode builds do not share a cache
+   constexpr size_t s_max_entries = 512;
+
+   struct sHeader
+   {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t count;
+   };
+
+   struct sEntry
+   {
+      uint64_t index;
+      uint64_t mtime;
+      uint32_t volume;
+      uint16_t machine;
+      uint8_t kind;
+      uint8_t is64;
+      uint32_t interpreter_len;
+   };
+
+   using tEntries = std::vector<std::pair<sKey, sniff::sInfo>>;
+
+   fs::path cacheFile()
+   {
+      return fs::temp_directory_path() / _T("DeepDebugger") / _T("sniffcache.bin");
+   }
+
+   // Empty when there is no cache or it is damaged
+   tEntries load()
+   {
+      tEntries retval;
+      std::ifstream in(cacheFile(), std::ios::binary);
+      std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+      sHeader header;
+      if (data.size() < sizeof(header)) {
+         return retval;
+      }
+      memcpy(&header, data.data(), sizeof(header));
+      if (header.magic != s_magic || header.version != s_version) {
+         return retval;
+      }
+      auto p = data.data() + sizeof(header), end = data.data() + data.size();
+      for (uint32_t idx = 0; idx < header.count; ++idx) {
+         sEntry entry;
+         if (end - p < (ptrdiff_t)sizeof(entry)) {
+            return tEntries();
+         }
+         memcpy(&entry, p, sizeof(entry));
+         p += sizeof(entry);
+         if ((uint64_t)(end - p) < (uint64_t)entry.interpreter_len * sizeof(TCHAR) || entry.kind > (uint8_t)sniff::eKind::node) {
+            return tEntries();
+         }
+         sniff::sInfo info{ (sniff::eKind)entry.kind, entry.machine, entry.is64 != 0, string((const TCHAR*)p, entry.interpreter_len) };
+         retval.emplace_back(sKey{ entry.volume, entry.index, entry.mtime }, std::move(info));
+         p += (size_t)entry.interpreter_len * sizeof(TCHAR);
+      }
+      return retval;
+   }
+
+   // Puts a program first, dropping what the cache held for an earlier version of it
+   void save(const sKey& key, const sniff::sInfo& info, const tEntries& entries)
+   {
+      std::string data;
+      auto append = [&data](const sKey& key, const sniff::sInfo& info) {
+         sEntry entry{ key.index, key.mtime, key.volume, info.machine, (uint8_t)info.kind, info.is64, (uint32_t)info.interpreter.size() };
+         data.append((const char*)&entry, sizeof(entry));
+         data.append((const char*)info.interpreter.data(), info.interpreter.size() * sizeof(TCHAR));
+      };
+      sHeader header{ s_magic, s_version, 1 };
+      data.append((const char*)&header, sizeof(header));
+      append(key, info);
+      for (const auto& [k, i] : entries) {
+         if (header.count >= s_max_entries) {
+            break;
+         }
+         if (k.volume != key.volume || k.index != key.index) {
+            append(k, i);
+            ++header.count;
+         }
+      }
+      memcpy(data.data(), &header, sizeof(header));
+
+      // Replaced as a whole, so that a concurrent hook reads either the old or the new version
+      auto fname = cacheFile();
+      std::error_code ec;
+      fs::create_directories(fname.parent_path(), ec);
+      auto tmp = fname;
+      tmp += fmt::format(".{}", _getpid());
+      {
+         std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+         if (!out.write(data.data(), data.size())) {
+            return;
+         }
+      }
+      if (!MoveFileEx(pathString(tmp).c_str(), pathString(fname).c_str(), MOVEFILE_REPLACE_EXISTING)) {
+         LOG("Cannot replace {} ({})", fname.string(), getErrorMessage());
+         DeleteFile(pathString(tmp).c_str());
+      }
+   }
+
+   // What this process has classified or found in the persisted cache
+   std::mutex s_cache_mutex;
+   std::map<sKey, sniff::sInfo> s_cache;
+
+} // namespace
+
+namespace sniff {
+
+   sInfo classify(const string& path, std::string_view header)
+   {
+      sInfo retval;
+      if (header.starts_with("MZ")) {
+         // PE signature, COFF machine and characteristics, assumed an executable if out of
+         // reach: past the bytes read, or a file cut short
+         size_t pe = read32(header, 0x3c);
+         if (pe + 4 <= header.size() && header.substr(pe, 4) == std::string_view("PE\0\0", 4)) {
+            retval.machine = read16(header, pe + 4);
+            if (read16(header, pe + 22) & s_pe_dll) {
+               return retval;
+            }
+            retval.is64 = read16(header, pe + 24) == 0x20b;
+         }
+         retval.kind = eKind::native;
+         return retval;
+      }
+      if (header.starts_with("\x7f" "ELF") && header.size() >= 20) {
+         bool big_endian = header[5] == 2;
+         auto type = read16(header, 16, big_endian);
+         if (type == s_elf_exec || type == s_elf_dyn) {
+            retval.kind = eKind::native;
+            retval.is64 = header[4] == 2;
+            retval.machine = read16(header, 18, big_endian);
+         }
+         return retval;
+      }
+      if (header.starts_with("#!")) {
+         auto interpreter = shebangInterpreter(header);
+         retval.interpreter = interpreter;
+         retval.kind = interpreterKind(interpreter);
+         return retval;
+      }
+      // Bytecode: a version-specific magic number, then "\r\n"
+      if (header.size() >= 4 && header.substr(2, 2) == "\r\n" && lower(pathString(fs::path(path).extension())) == _T(".pyc")) {
+         retval.kind = eKind::python;
+         return retval;
+      }
+
+      auto ext = lower(pathString(fs::path(path).extension()));
+      if (ext == _T(".py") || ext == _T(".pyw")) {
+         retval.kind = eKind::python;
+      }
+      else if (ext == _T(".js") || ext == _T(".mjs") || ext == _T(".cjs")) {
+         retval.kind = eKind::node;
+      }
+      else if (ext == _T(".sh")) {
+         retval.kind = eKind::shell;
+      }
+      return retval;
+   }
+
+   sInfo classify(const string& program)
+   {
+      HANDLE hFile = CreateFile(program.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+      if (hFile == INVALID_HANDLE_VALUE) {
+         LOG("Cannot open {} to classify it ({})", program, getErrorMessage());
+         return classify(program, std::string_view());
+      }
+
+      BY_HANDLE_FILE_INFORMATION info;
+      std::optional<sKey> key;
+      tEntries entries;
+      if (GetFileInformationByHandle(hFile, &info)) {
+         key = sKey{ info.dwVolumeSerialNumber, (uint64_t)info.nFileIndexHigh << 32 | info.nFileIndexLow,
+            (uint64_t)info.ftLastWriteTime.dwHighDateTime << 32 | info.ftLastWriteTime.dwLowDateTime };
+         std::lock_guard lock(s_cache_mutex);
+         if (auto it = s_cache.find(*key); it != s_cache.end()) {
+            CloseHandle(hFile);
+            return it->second;
+         }
+         entries = load();
+         for (const auto& [k, i] : entries) {
+            if (k == *key) {
+               CloseHandle(hFile);
+               return s_cache.emplace(*key, i).first->second;
+            }
+         }
+      }
+
+      char header[s_sniff_size];
+      DWORD len = 0;
+      if (!ReadFile(hFile, header, sizeof(header), &len, NULL)) {
+         len = 0;
+      }
+      CloseHandle(hFile);
+
+      auto retval = classify(program, std::string_view(header, len));
+      if (key) {
+         std::lock_guard lock(s_cache_mutex);
+         s_cache.emplace(*key, retval);
+         save(*key, retval, entries);
+      }
+      return retval;
+   }
+
+   string debuggerType(const string& program)
+   {
+      auto info = classify(program);
+      switch (info.kind) {
+      case eKind::native:
+         LOG("{} is a native program, machine {:#x}{}", program, info.machine, info.is64 ? _T(", 64-bit") : _T(""));
+         return _T("binary");
+      case eKind::shell:
+         return _T("bashdb");
+      case eKind::python:
+         return _T("python");
+      case eKind::node:
+         return _T("node");
+      default:
+         return string();
+      }
+   }
+
+} // namespace sniff
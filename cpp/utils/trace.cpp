@@ -0,0 +1,204 @@
+#include "pch.h"
+#include "trace.h"
+#include "lock.h"
+
+#include <mutex>
+
+namespace trace {
+
+   namespace {
+
+      constexpr size_t s_capacity = 4096;
+
+      struct sEvent
+      {
+         const char* name;
+         char phase;
+         int64_t ts_ns;
+         int64_t dur_ns;
+         uint64_t id;
+         DWORD tid;
+      };
+
+      // Events are only formatted when written out, which keeps a stamp well under a microsecond
+      class cRecorder
+      {
+      public:
+         ~cRecorder()
+         {
+            flush();
+         }
+
+         void open(const fs::path& fname, const string& process_name)
+         {
+            m_fname = fname;
+            m_process_name = process_name;
+            m_events.reserve(s_capacity);
+         }
+
+         void add(const sEvent& event)
+         {
+            std::unique_lock lock(m_mutex);
+            m_events.push_back(event);
+            if (m_events.size() >= s_capacity) {
+               write(lock);
+            }
+         }
+
+         void threadName(const char* name)
+         {
+            std::lock_guard lock(m_mutex);
+            m_thread_names.push_back({ GetCurrentThreadId(), name });
+         }
+
+         void flush()
+         {
+            std::unique_lock lock(m_mutex);
+            write(lock);
+         }
+
+      private:
+         void write(std::unique_lock<std::mutex>& lock)
+         {
+            if (m_events.empty() || m_fname.empty()) {
+               return;
+            }
+
+            auto pid = GetCurrentProcessId();
+            std::string out;
+            out.reserve(m_events.size() * 160);
+            if (!m_described) {
+               m_described = true;
+               fmt::format_to(std::back_inserter(out), R"({{"name":"process_name","ph":"M","pid":{},"args":{{"name":"{}"}}}},)" "\n", pid, m_process_name);
+            }
+            for (const auto& [tid, name] : m_thread_names) {
+               fmt::format_to(std::back_inserter(out), R"({{"name":"thread_name","ph":"M","pid":{},"tid":{},"args":{{"name":"{}"}}}},)" "\n", pid, tid, name);
+            }
+            m_thread_names.clear();
+
+            for (const auto& e : m_events) {
+               auto ts_us = (double)e.ts_ns / 1000;
+               switch (e.phase) {
+               case 'X':
+                  fmt::format_to(std::back_inserter(out), R"({{"name":"{}","cat":"deepdbg","ph":"X","ts":{:.3f},"dur":{:.3f},"pid":{},"tid":{},"args":{{"traceId":"{:016x}"}}}},)" "\n",
+                     e.name, ts_us, (double)e.dur_ns / 1000, pid, e.tid, e.id);
+                  break;
+               case 'i':
+                  fmt::format_to(std::back_inserter(out), R"({{"name":"{}","cat":"deepdbg","ph":"i","s":"t","ts":{:.3f},"pid":{},"tid":{},"args":{{"traceId":"{:016x}"}}}},)" "\n",
+                     e.name, ts_us, pid, e.tid, e.id);
+                  break;
+               default:
+                  fmt::format_to(std::back_inserter(out), R"({{"name":"request","cat":"deepdbg","ph":"{}","id":"0x{:016x}","bp":"e","ts":{:.3f},"pid":{},"tid":{}}},)" "\n",
+                     e.phase, e.id, ts_us, pid, e.tid);
+                  break;
+               }
+            }
+            m_events.clear();
+
+            // The file is shared by every traced process
+            lock.unlock();
+            cProcessLock file_lock(m_fname);
+            bool locked = file_lock.lock(1000);
+            HANDLE hFile = CreateFile(pathString(m_fname).c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (hFile != INVALID_HANDLE_VALUE) {
+               LARGE_INTEGER size{};
+               if (GetFileSizeEx(hFile, &size) && size.QuadPart == 0) {
+                  out.insert(0, "[\n");
+               }
+               DWORD written = 0;
+               WriteFile(hFile, out.data(), (DWORD)out.size(), &written, NULL);
+               CloseHandle(hFile);
+            }
+            if (locked) {
+               file_lock.unlock();
+            }
+            lock.lock();
+         }
+
+         std::mutex m_mutex;
+         fs::path m_fname;
+         std::string m_process_name;
+         std::vector<sEvent> m_events;
+         std::vector<std::pair<DWORD, const char*>> m_thread_names;
+         bool m_described = false;
+      };
+
+      cRecorder s_recorder;
+
+   } // namespace
+
+   void init(const TCHAR* process_name, const TCHAR* fname)
+   {
+      if (!fname) {
+         fname = _tgetenv(_T("DEEPDEBUGGER_TRACE"));
+      }
+      if (fname && *fname) {
+         // Trace files are JSON, process names go in as they are
+         std::string name;
+         for (auto s = process_name; *s; ++s) {
+            name += (char)*s;
+         }
+         s_recorder.open(fname, name);
+         s_enabled = true;
+      }
+   }
+
+   void threadName(const char* name)
+   {
+      if (enabled()) {
+         s_recorder.threadName(name);
+      }
+   }
+
+   uint64_t newId()
+   {
+      return ((uint64_t)GetCurrentProcessId() << 32) ^ (uint64_t)nowNs();
+   }
+
+   string formatId(uint64_t id)
+   {
+      return fmt::format(_T("{:016x}"), id);
+   }
+
+   uint64_t parseId(const string_view& id)
+   {
+      uint64_t retval = 0;
+      for (auto c : id) {
+         auto digit = _istdigit(c) ? c - _T('0') : _totlower(c) - _T('a') + 10;
+         if (digit < 0 || digit > 15) {
+            return 0;
+         }
+         retval = retval << 4 | (uint64_t)digit;
+      }
+      return retval;
+   }
+
+   void complete(const char* name, int64_t start_ns, int64_t end_ns, uint64_t id)
+   {
+      if (enabled()) {
+         s_recorder.add({ name, 'X', start_ns, end_ns - start_ns, id, GetCurrentThreadId() });
+      }
+   }
+
+   void instant(const char* name, uint64_t id)
+   {
+      if (enabled()) {
+         s_recorder.add({ name, 'i', nowNs(), 0, id, GetCurrentThreadId() });
+      }
+   }
+
+   void flow(char phase, uint64_t id)
+   {
+      if (enabled() && id) {
+         s_recorder.add({ nullptr, phase, nowNs(), 0, id, GetCurrentThreadId() });
+      }
+   }
+
+   void flush()
+   {
+      if (enabled()) {
+         s_recorder.flush();
+      }
+   }
+
+} // namespace trace
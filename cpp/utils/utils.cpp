@@ -5,10 +5,16 @@
 #include "framework.h"
 
 #include "utils.h"
+#include "lz4.h"
+#include "probes.h"
+#include "shared.h"
+#include "trace.h"
 
 #include "nlohmann/json.hpp"
 using namespace nlohmann;
 
+#include <random>
+
 std::string wstrToUtf8Str(const std::wstring& wstr)
 {
    if (!wstr.empty()) {
@@ -140,23 +146,92 @@ void cConfig::add(const string& key, const string& val)
    m_params[key] = val;
 }
 
+namespace {
+
+   // The header, deepDbgHookPipe first: of a request too large to keep the server reads no
+   // more than the head, and answers the hook through it. The other fields follow sorted.
+   string dumpHeader(const json& cfg, const string& hook_queue)
+   {
+      auto retval = cfg.dump();
+      retval.insert(1, fmt::format(_T("\"deepDbgHookPipe\":{},"), json(hook_queue).dump()));
+      return retval;
+   }
+
+   // Replaces the blocks with their LZ4 block when they reach the threshold and shrink
+   void compressBinaryBlocks(json& cfg, const string& hook_queue, string& message)
+   {
+      auto threshold = protocol::compressThreshold();
+      auto blocks = string_view(message).substr(message.find(_T('\0')) + 1);
+      if (!threshold || blocks.size() < threshold) {
+         return;
+      }
+
+      auto start_ns = nowNs();
+      auto compressed = lz4::compress(std::string_view((const char*)blocks.data(), blocks.size()));
+      auto codec_us = (nowNs() - start_ns) / 1000;
+      if (compressed.size() >= blocks.size()) {
+         LOG("Request blocks of {} bytes do not compress, sent raw", blocks.size());
+         return;
+      }
+      LOG("Request blocks compressed from {} to {} bytes in {} us", blocks.size(), compressed.size(), codec_us);
+
+      cfg["deepDbgCodec"] = "lz4";
+      cfg["deepDbgRawSize"] = fmt::format("{}", blocks.size());
+      cfg["deepDbgCodecUs"] = fmt::format("{}", codec_us);
+      message = dumpHeader(cfg, hook_queue);
+      message += _T('\0');
+      message.append((const TCHAR*)compressed.data(), compressed.size());
+   }
+
+   // Moves the blocks into a section when they reach the threshold, returns it, nullptr when they
+   // stay. The request as it was goes to unshared, for a server that cannot map the section.
+   HANDLE shareBlocks(string& message, string& unshared)
+   {
+      auto threshold = shared::threshold();
+      auto nul = message.find(_T('\0'));
+      if (!threshold || nul == string::npos || (message.size() - nul - 1) * sizeof(TCHAR) < threshold) {
+         return nullptr;
+      }
+      auto blocks = string_view(message).substr(nul + 1);
+      auto section = shared::create(blocks);
+      if (!section) {
+         return nullptr;
+      }
+      auto size = blocks.size() * sizeof(TCHAR);
+      LOG("Request blocks of {} bytes passed in section {}", size, (uintptr_t)section);
+
+      unshared = std::move(message);
+      message.assign(unshared, 0, nul + 1);
+      addJsonString(message, _T("deepDbgSection"), fmt::format(_T("{}"), (uintptr_t)section));
+      addJsonString(message, _T("deepDbgSectionSize"), fmt::format(_T("{}"), size));
+      return section;
+   }
+
+} // namespace
+
 string cConfig::makeConfig()
 {
+   PROBE_REQUEST_BUILD_START(GetCurrentProcessId());
+   bool binary = protocol::version() >= 2;
    json cfg;
+   if (binary) {
+      cfg["deepDbgProtocol"] = 2;
+   }
 
    if (!m_session_type.empty()) {
       LOG("Setting session type to {}", m_session_type);
-      cfg["type"] = base64::Encode(m_session_type);
+      cfg["type"] = binary ? m_session_type : base64::Encode(m_session_type);
    }
 
-   LOG("Setting session working dir");
-   cfg["cwd"] = base64::Encode(fs::current_path().string());
-
    auto concat = [](const string& retval, const string& s) { return retval + _T(" ") + s; };
    auto concat64 = [](const string& retval, const string& s) { return retval + _T("-") + base64::Encode(s); };
 
    LOG("Setting session command line to {}", std::accumulate(m_cmdline.begin(), m_cmdline.end(), string(), concat));
-   cfg["cmdline"] = std::accumulate(m_cmdline.begin(), m_cmdline.end(), string(), concat64);
+   if (!binary) {
+      LOG("Setting session working dir");
+      cfg["cwd"] = base64::Encode(fs::current_path().string());
+      cfg["cmdline"] = std::accumulate(m_cmdline.begin(), m_cmdline.end(), string(), concat64);
+   }
 
    if (auto parent_session_id = _tgetenv(_T("DEEPDEBUGGER_SESSION_ID"))) {
       m_parent_session_id = parent_session_id;
@@ -167,33 +242,104 @@ string cConfig::makeConfig()
       throw _T("Cannot retrieve parent session ID, exiting");
    }
 
-   for (const auto& [key, value] : m_params) {
-      cfg[key] = base64::Encode(value);
+   if (!binary) {
+      for (const auto& [key, value] : m_params) {
+         cfg[key] = base64::Encode(value);
+      }
+
+      size_t size = 0;
+      for (TCHAR** s = _tenviron; *s; s++) {
+         size += 1 + _tcslen(*s);
+      }
+
+      string env;
+      env.reserve(2 * size + 1);
+      for (TCHAR** s = _tenviron; *s; s++) {
+         env += base64::Encode(*s);
+         env += _T('-');
+      }
+      env.shrink_to_fit();
+
+      cfg["environment"] = env;
    }
 
-   size_t size = 0;
-   for (TCHAR** s = _tenviron; *s; s++) {
-      size += 1 + _tcslen(*s);
+   // One per request, a supervisor asks for sessions of several children at once
+   static std::atomic<uint32_t> s_requests = 0;
+   m_hook_queue = fmt::format(_T("{}.{}.{}"), m_queue, _getpid(), ++s_requests);
+
+   LOG("Setting hook queue name to {}", m_hook_queue);
+
+   if (m_trace_id) {
+      cfg["deepDbgTraceID"] = trace::formatId(m_trace_id);
    }
 
-   string env;
-   env.reserve(2 * size + 1);
-   for (TCHAR** s = _tenviron; *s; s++) {
-      env += base64::Encode(*s);
-      env += _T('-');
+   // Without a class the server goes by the depth of the session, without a deadline the request waits
+   if (auto priority = _tgetenv(_T("DEEPDEBUGGER_PRIORITY"))) {
+      m_priority = priority;
+   }
+   if (!m_priority.empty()) {
+      cfg["deepDbgPriority"] = m_priority;
+   }
+   if (auto deadline = _tgetenv(_T("DEEPDEBUGGER_DEADLINE")); deadline && _ttoi(deadline) > 0) {
+      cfg["deepDbgDeadlineMs"] = string(deadline);
    }
-   env.shrink_to_fit();
 
-   cfg["environment"] = env;
+   string message = dumpHeader(cfg, m_hook_queue);
+   if (binary) {
+      addBinaryBlocks(message);
+      compressBinaryBlocks(cfg, m_hook_queue, message);
+   }
+   PROBE_REQUEST_BUILD_END(GetCurrentProcessId(), message.size(), m_parent_session_id.c_str());
 
-   m_hook_queue = join(m_queue, _T("."), m_parent_session_id);
+   return message;
+}
 
-   LOG("Setting hook queue name to {}", m_hook_queue);
-   cfg["deepDbgHookPipe"] = m_hook_queue;
+// The blocks after the header of a version 2 request, copied without encoding
+void cConfig::addBinaryBlocks(string& message)
+{
+   auto cwd = fs::current_path().string();
 
-   string message = cfg.dump();
+   size_t params_size = 0;
+   for (const auto& [key, value] : m_params) {
+      params_size += key.size() + value.size() + 2;
+   }
+   size_t args_size = 0;
+   for (const auto& arg : m_cmdline) {
+      args_size += arg.size() + 1;
+   }
 
-   return message;
+   // NAME=VALUE\0...NAME=VALUE\0\0, the block without the final NUL
+   auto env = GetEnvironmentStrings();
+   auto env_end = env;
+   while (*env_end) {
+      env_end += _tcslen(env_end) + 1;
+   }
+   size_t env_size = env_end - env;
+
+   message.reserve(message.size() + 1 + 4 * 21 + cwd.size() + params_size + args_size + env_size);
+   message += _T('\0');
+   auto length = [&message](size_t size) { fmt::format_to(std::back_inserter(message), _T("{}:"), size); };
+
+   length(cwd.size());
+   message += cwd;
+
+   length(params_size);
+   for (const auto& [key, value] : m_params) {
+      message += key;
+      message += _T('=');
+      message += value;
+      message += _T('\0');
+   }
+
+   length(args_size);
+   for (const auto& arg : m_cmdline) {
+      message += arg;
+      message += _T('\0');
+   }
+
+   length(env_size);
+   message.append(env, env_size);
+   FreeEnvironmentStrings(env);
 }
 
 bool cConfig::send()
@@ -206,8 +352,13 @@ bool cConfig::send()
    m_queue = queue_name;
    LOG("Queue name: {}", m_queue);
 
+   if (trace::enabled()) {
+      m_trace_id = trace::newId();
+   }
+
    string message;
    try {
+      trace::cSpan span("makeConfig", m_trace_id);
       message = makeConfig();
       LOG("Debug session request: {}", message);
    }
@@ -221,42 +372,146 @@ bool cConfig::send()
       return false;
    }
 
-   HANDLE hPipe = CreateFile(m_queue.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+   // The reply queue exists before the request is sent, so the server can answer right away
+   auto queue_start_ns = trace::enabled() ? nowNs() : 0;
+   DWORD pipeMode = PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT;
+   HANDLE hPipe = CreateNamedPipe(m_hook_queue.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED, pipeMode, 1, 1000, 1000, NMPWAIT_USE_DEFAULT_WAIT, nullptr);
    if (hPipe == INVALID_HANDLE_VALUE) {
-      ERROR("Cannot open parent queue, exiting");
+      ERROR("Cannot create child queue {}, exiting ({})", m_hook_queue, getErrorMessage());
       return false;
    }
+   LOG("Child queue created successfully: {}", m_hook_queue);
+   if (queue_start_ns) {
+      trace::complete("create reply queue", queue_start_ns, nowNs(), m_trace_id);
+   }
 
-   LOG("Queue opened successfully");
+   // Kept open until the server has answered, it maps the section meanwhile
+   string unshared;
+   HANDLE section = shareBlocks(message, unshared);
+
+   constexpr int max_attempts = 100;
+   bool success = false;
+   for (int attempt = 1; attempt <= max_attempts; ++attempt) {
+      {
+         trace::cSpan span("send", m_trace_id);
+         trace::flow('s', m_trace_id);
+         PROBE_REQUEST_SEND(GetCurrentProcessId(), message.size(), attempt);
+         int64_t waited_us = 0;
+         HANDLE hQueue = openQueue(m_queue, protocol::connectTimeout(), &waited_us);
+         if (hQueue == INVALID_HANDLE_VALUE) {
+            ERROR("Cannot open parent queue, exiting ({})", getErrorMessage());
+            break;
+         }
 
-   DWORD dwWritten = 0;
-   WriteFile(hPipe, message.c_str(), (DWORD)message.length(), &dwWritten, NULL);
-   CloseHandle(hPipe);
+         // The server keeps the time hooks waited for it, requests that did not wait say nothing
+         bool sent;
+         if (waited_us) {
+            LOG("Parent queue opened after {} us", waited_us);
+            auto request = message;
+            addJsonString(request, _T("deepDbgConnectWaitUs"), fmt::format(_T("{}"), waited_us));
+            sent = sendMessage(hQueue, request);
+         }
+         else {
+            sent = sendMessage(hQueue, message);
+         }
+         if (!sent) {
+            ERROR("Cannot write to parent queue, exiting ({})", getErrorMessage());
+            break;
+         }
+      }
+      LOG("Request sent");
 
-   return await();
+      string reply;
+      trace::cSpan span("await", m_trace_id);
+      if (!await(hPipe, reply)) {
+         break;
+      }
+      PROBE_AWAIT_WAKE(GetCurrentProcessId(), reply.c_str());
+
+      string_view retry = reply;
+      if (readUntil(retry, _T('|')) == _T("retry-after")) {
+         auto delay_ms = _ttoi(string(retry).c_str());
+         LOG("Request rejected by the server, retrying in {} ms (attempt {})", delay_ms, attempt);
+         DisconnectNamedPipe(hPipe);
+         Sleep(delay_ms);
+         continue;
+      }
+      if (reply == _T("inline") && section) {
+         LOG("The server cannot map section {}, sending the blocks with the request (attempt {})", (uintptr_t)section, attempt);
+         DisconnectNamedPipe(hPipe);
+         CloseHandle(section);
+         section = nullptr;
+         message = std::move(unshared);
+         continue;
+      }
+
+      m_passthrough = reply == _T("passthrough");
+      if (m_passthrough) {
+         LOG("Request expired in the server, running undebugged");
+      }
+      success = true;
+      break;
+   }
+
+   CloseHandle(hPipe);
+   if (section) {
+      CloseHandle(section);
+   }
+   return success;
 }
 
-bool cConfig::await()
+bool cConfig::await(HANDLE hPipe, string& reply)
 {
-   DWORD pipeMode = PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT;
-   HANDLE hPipe = CreateNamedPipe(m_hook_queue.c_str(), PIPE_ACCESS_DUPLEX, pipeMode, 1, 1000, 1000, NMPWAIT_USE_DEFAULT_WAIT, nullptr);
-   if (hPipe == INVALID_HANDLE_VALUE) {
-      ERROR("Cannot create child queue {}, exiting ({})", m_hook_queue, getErrorMessage());
-      return false;
+   // Nobody is left to answer once the server is gone, stop waiting then
+   HANDLE hServer = nullptr;
+   if (auto server_pid = _tgetenv(_T("DEEPDEBUGGER_SERVER_PID"))) {
+      hServer = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)_ttoi(server_pid));
    }
-   LOG("Child queue created successfully: {}", m_hook_queue);
 
-   if (!ConnectNamedPipe(hPipe, NULL)) {
-      ERROR("Cannot open child queue {}, exiting ({})", m_hook_queue, getErrorMessage());
-      return false;
+   OVERLAPPED ov{};
+   ov.hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+   auto cleanup = [&]() {
+      CloseHandle(ov.hEvent);
+      if (hServer) {
+         CloseHandle(hServer);
+      }
+   };
+
+   if (!ConnectNamedPipe(hPipe, &ov)) {
+      switch (GetLastError()) {
+      case ERROR_PIPE_CONNECTED:
+         break;
+      case ERROR_IO_PENDING: {
+         HANDLE handles[] = { ov.hEvent, hServer };
+         auto wait = WaitForMultipleObjects(hServer ? 2 : 1, handles, FALSE, INFINITE);
+         DWORD dummy = 0;
+         if (wait == WAIT_OBJECT_0 + 1) {
+            ERROR("Server exited, stopped waiting on child queue {}", m_hook_queue);
+            CancelIoEx(hPipe, &ov);
+            cleanup();
+            return false;
+         }
+         if (wait == WAIT_OBJECT_0 && GetOverlappedResult(hPipe, &ov, &dummy, FALSE)) {
+            break;
+         }
+      }
+      [[fallthrough]];
+      default:
+         ERROR("Cannot open child queue {}, exiting ({})", m_hook_queue, getErrorMessage());
+         cleanup();
+         return false;
+      }
    }
 
-   size_t rlen = 0;
+   DWORD rlen = 0;
    string buf(' ', 100);
-   if (!ReadFile(hPipe, buf.data(), (DWORD)buf.size(), (DWORD*)&rlen, nullptr)) {
+   ResetEvent(ov.hEvent);
+   if (!ReadFile(hPipe, buf.data(), (DWORD)buf.size(), &rlen, &ov) && (GetLastError() != ERROR_IO_PENDING || !GetOverlappedResult(hPipe, &ov, &rlen, TRUE))) {
       ERROR("Cannot read child queue, exiting ({})", getErrorMessage());
+      cleanup();
       return false;
    }
+   cleanup();
    if (rlen >= buf.size()) {
       ERROR("Child queue reading overflow, exiting");
       return false;
@@ -268,9 +523,82 @@ bool cConfig::await()
       LOG(_T("Session closed message received"));
    }
 
+   reply = std::move(buf);
+   return true;
+}
+
+namespace protocol {
+
+   int version()
+   {
+      auto value = _tgetenv(_T("DEEPDEBUGGER_PROTOCOL"));
+      return value ? std::clamp(_ttoi(value), 1, s_max_version) : 1;
+   }
+
+   DWORD connectTimeout()
+   {
+      auto value = _tgetenv(_T("DEEPDEBUGGER_CONNECT_TIMEOUT"));
+      return value ? (DWORD)std::max(_ttoi(value), 0) : s_default_connect_timeout_ms;
+   }
+
+   size_t compressThreshold()
+   {
+      // The compressed block is bytes, wide builds send their requests raw
+      auto value = _tgetenv(_T("DEEPDEBUGGER_COMPRESS"));
+      return value && sizeof(TCHAR) == 1 ? (size_t)std::max<int64_t>(_ttoi64(value), 0) : 0;
+   }
+
+} // namespace protocol
+
+HANDLE openQueue(const string& queue, DWORD timeout_ms, int64_t* waited_us)
+{
+   constexpr DWORD s_min_delay_ms = 2, s_max_delay_ms = 250;
+
+   auto open = [&queue]() { return CreateFile(queue.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL); };
+   HANDLE hPipe = open();
+   if (hPipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipe(queue.c_str(), 1000)) {
+      hPipe = open();
+   }
+   if (waited_us) {
+      *waited_us = 0;
+   }
+
+   // A server that is still starting has not created the queue yet. Hooks started together
+   // must not come back together, so every delay is drawn from its upper half.
+   auto start_ns = nowNs();
+   thread_local std::minstd_rand rng(GetCurrentProcessId() ^ GetCurrentThreadId());
+   for (DWORD delay_ms = s_min_delay_ms; hPipe == INVALID_HANDLE_VALUE;) {
+      auto error = GetLastError();
+      auto left_ms = (int64_t)timeout_ms - (nowNs() - start_ns) / 1000000;
+      if ((error != ERROR_FILE_NOT_FOUND && error != ERROR_PIPE_BUSY) || left_ms <= 0) {
+         SetLastError(error);
+         break;
+      }
+      Sleep((DWORD)std::min<int64_t>(left_ms, delay_ms / 2 + rng() % (delay_ms / 2 + 1)));
+      delay_ms = std::min(2 * delay_ms, s_max_delay_ms);
+      hPipe = open();
+      if (waited_us) {
+         *waited_us = (nowNs() - start_ns) / 1000;
+      }
+   }
+   return hPipe;
+}
+
+bool sendMessage(HANDLE hPipe, const string_view& message)
+{
+   DWORD dwWritten = 0;
+   auto success = WriteFile(hPipe, message.data(), (DWORD)message.length(), &dwWritten, NULL);
    CloseHandle(hPipe);
+   return success && dwWritten;
+}
 
-   return true;
+bool writeQueue(const string& queue, const string_view& message)
+{
+   HANDLE hPipe = openQueue(queue);
+   if (hPipe == INVALID_HANDLE_VALUE) {
+      return false;
+   }
+   return sendMessage(hPipe, message);
 }
 
 string getErrorMessage()
@@ -321,11 +649,14 @@ int execute(const string_view& cmd)
       // Wait until child process exits.
       WaitForSingleObject(pi.hProcess, INFINITE);
 
+      DWORD exit_code = 0;
+      GetExitCodeProcess(pi.hProcess, &exit_code);
+
       // Close process and thread handles. 
       CloseHandle(pi.hProcess);
       CloseHandle(pi.hThread);
 
-      return 0;
+      return (int)exit_code;
    }
 
    return 1;
@@ -6,29 +6,61 @@ then
     LOGFILE="${DEEPDEBUGGER_LOGFILE}"
 fi
 
+# Locks are flock(1)s on a descriptor (second argument) open on <file>.lck, so a
+# killed holder never blocks anyone: the kernel drops the lock along with the descriptor.
+# The same file the native tools lock (cpp/include/lock.h). Fails after 5 s.
 lock () {
-    while ! mkdir -p "$1".lock 2>/dev/null
-    do
-        sleep .005
-    done
+    eval "exec $2>>\"\$1\".lck"
+    if ! flock -w 5 "$2"; then
+        eval "exec $2>&-"
+        return 1
+    fi
 }
 
 release_lock() {
-    rm -rf "$1".lock 2>/dev/null
+    eval "exec $2>&-"
 }
 
 LOG() {
     if [ -n "${LOGFILE}" ]
     then
-        lock "${LOGFILE}"
+        # Better an interleaved line than a process stuck on its log, as in the native tools
+        lock "${LOGFILE}" 8
         TIMESTAMP=$(date +"%4Y-%m-%d %H:%M:%S.%N"|cut -b -23)
         echo "[${TIMESTAMP}] ${PROCNAME} [$$] $1" >> "${LOGFILE}"
-        release_lock "${LOGFILE}"
+        release_lock "${LOGFILE}" 8
     fi
 }
 
+# The server may still be starting: waits for its queue with jittered exponential backoff,
+# for up to DEEPDEBUGGER_CONNECT_TIMEOUT ms (5000 by default)
+wait_queue() {
+    TIMEOUT_MS=${DEEPDEBUGGER_CONNECT_TIMEOUT:-5000}
+    WAITED_MS=0
+    DELAY_MS=2
+    while [ ! -p "$1" ]; do
+        if [ ${WAITED_MS} -ge ${TIMEOUT_MS} ]; then
+            return 1
+        fi
+        JITTER=$(od -An -N2 -tu2 /dev/urandom | tr -d ' ')
+        SLEEP_MS=$((DELAY_MS / 2 + JITTER % (DELAY_MS / 2 + 1)))
+        sleep "$(printf "%d.%03d" $((SLEEP_MS / 1000)) $((SLEEP_MS % 1000)))"
+        WAITED_MS=$((WAITED_MS + SLEEP_MS))
+        DELAY_MS=$((DELAY_MS < 125 ? DELAY_MS * 2 : 250))
+    done
+}
+
 LOG "Hook started: $*"
 
+# A hook variable may name the priority class of its requests, DEEPDEBUGGER_PRIORITY overrides it
+PRIORITY=""
+if [ "$1" = "--deep-debugger-priority" ] && [ $# -gt 2 ]
+then
+    PRIORITY="$2"
+    shift 2
+fi
+PRIORITY="${DEEPDEBUGGER_PRIORITY:-${PRIORITY}}"
+
 HOOK_QUEUE=${DEEPDEBUGGER_LAUNCHER_QUEUE}.$$
 PARAM_TYPE="\"type\": \"\""
 PARAM_CWD="\"cwd\": \"$(printf "%s" "${PWD}" | base64 -w 0)\""
@@ -39,22 +71,55 @@ LOG "Getting the environment"
 PARAM_ENV_CONT=$(printenv | while IFS= read -r LINE; do (printf "%s" "${LINE}" | base64 -w 0); printf "-"; done)
 PARAM_ENV="\"environment\": \"${PARAM_ENV_CONT}\""
 
-PARAMS_JSON="{${PARAM_TYPE},${PARAM_CWD},${PARAM_CMDLINE},${PARAM_PARENTSESSION},${PARAM_HOOKPIPE},${PARAM_ENV}}"
+PARAMS_JSON="{${PARAM_HOOKPIPE},${PARAM_TYPE},${PARAM_CWD},${PARAM_CMDLINE},${PARAM_PARENTSESSION},${PARAM_ENV}}"
+if [ -n "${PRIORITY}" ]
+then
+    PARAMS_JSON="${PARAMS_JSON%\}},\"deepDbgPriority\": \"${PRIORITY}\"}"
+fi
+if [ "${DEEPDEBUGGER_DEADLINE:-0}" -gt 0 ] 2>/dev/null
+then
+    PARAMS_JSON="${PARAMS_JSON%\}},\"deepDbgDeadlineMs\": \"${DEEPDEBUGGER_DEADLINE}\"}"
+fi
+
+if ! wait_queue "${DEEPDEBUGGER_LAUNCHER_QUEUE}"
+then
+    LOG "No queue ${DEEPDEBUGGER_LAUNCHER_QUEUE} after ${WAITED_MS} ms, exiting"
+    exit 1
+fi
+if [ ${WAITED_MS} -gt 0 ]
+then
+    LOG "Waited ${WAITED_MS} ms for ${DEEPDEBUGGER_LAUNCHER_QUEUE}"
+fi
 
 LOG "Sending data to ${DEEPDEBUGGER_LAUNCHER_QUEUE}: ${PARAMS_JSON}"
-lock "${DEEPDEBUGGER_LAUNCHER_QUEUE}"
+if ! lock "${DEEPDEBUGGER_LAUNCHER_QUEUE}" 9
+then
+    LOG "Cannot lock ${DEEPDEBUGGER_LAUNCHER_QUEUE}, exiting"
+    exit 1
+fi
 printf "%s" "${PARAMS_JSON}" > "${DEEPDEBUGGER_LAUNCHER_QUEUE}"
-release_lock "${DEEPDEBUGGER_LAUNCHER_QUEUE}"
+release_lock "${DEEPDEBUGGER_LAUNCHER_QUEUE}" 9
 
-lock "${HOOK_QUEUE}"
+if ! lock "${HOOK_QUEUE}" 9
+then
+    LOG "Cannot lock ${HOOK_QUEUE}, exiting"
+    exit 1
+fi
 if [ ! -p "${HOOK_QUEUE}" ]
 then
-    trap 'lock ${HOOK_QUEUE}; rm -f ${HOOK_QUEUE}; release_lock ${HOOK_QUEUE}' EXIT
+    trap 'lock ${HOOK_QUEUE} 9 && rm -f ${HOOK_QUEUE}; release_lock ${HOOK_QUEUE} 9' EXIT
     LOG "Creating fifo ${HOOK_QUEUE}"
     mkfifo "${HOOK_QUEUE}"
 fi
-release_lock "${HOOK_QUEUE}"
+release_lock "${HOOK_QUEUE}" 9
 
 LOG "Waiting on ${HOOK_QUEUE}"
 IFS= read -r LINE < "${HOOK_QUEUE}"
 LOG "Received ${LINE}"
+
+# The server gave up on the request before its session started
+if [ "${LINE}" = "passthrough" ]
+then
+    LOG "Request expired in the server, running undebugged"
+    exec "$@"
+fi
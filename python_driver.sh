@@ -5,24 +5,29 @@ SCRIPT_DIR="$(dirname "${BASH_ARGV0:-$0}")"
 CMDLINE=$*
 PROCNAME='python driver'
 
+# Locks are flock(1)s on a descriptor (second argument) open on <file>.lck, so a
+# killed holder never blocks anyone: the kernel drops the lock along with the descriptor.
+# The same file the native tools lock (cpp/include/lock.h). Fails after 5 s.
 lock () {
-    while ! mkdir -p "$1".lock 2>/dev/null
-    do
-        sleep .005
-    done
+    eval "exec $2>>\"\$1\".lck"
+    if ! flock -w 5 "$2"; then
+        eval "exec $2>&-"
+        return 1
+    fi
 }
 
 release_lock() {
-    rm -rf "$1".lock 2>/dev/null
+    eval "exec $2>&-"
 }
 
 LOG() {
     if [ -n "${LOGFILE}" ]
     then
-        lock "${LOGFILE}"
+        # Better an interleaved line than a process stuck on its log, as in the native tools
+        lock "${LOGFILE}" 8
         TIMESTAMP=$(date +"%4Y-%m-%d %H:%M:%S.%N"|cut -b -23)
         echo "[${TIMESTAMP}] ${PROCNAME} [$$] $1" >> "${LOGFILE}"
-        release_lock "${LOGFILE}"
+        release_lock "${LOGFILE}" 8
     fi
 }
 
@@ -78,20 +83,28 @@ LOG "Getting the environment"
 PARAM_ENV_CONT=$(printenv | while IFS= read -r LINE; do (printf "%s" "${LINE}" | base64 -w 0); printf "-"; done)
 PARAM_ENV="\"environment\": \"${PARAM_ENV_CONT}\""
 
-PARAMS_JSON="{${PARAM_TYPE},${PARAM_PROGRAM},${PARAM_CWD},${PARAM_CMDLINE},${PARAM_HOOKPIPE},${PARAM_ENV}}"
+PARAMS_JSON="{${PARAM_HOOKPIPE},${PARAM_TYPE},${PARAM_PROGRAM},${PARAM_CWD},${PARAM_CMDLINE},${PARAM_ENV}}"
 
 LOG "Sending data to ${DEEPDEBUGGER_LAUNCHER_QUEUE}: ${PARAMS_JSON}"
-lock "${DEEPDEBUGGER_LAUNCHER_QUEUE}"
+if ! lock "${DEEPDEBUGGER_LAUNCHER_QUEUE}" 9
+then
+    LOG "Cannot lock ${DEEPDEBUGGER_LAUNCHER_QUEUE}, exiting"
+    exit 1
+fi
 printf "%s" "${PARAMS_JSON}" > "${DEEPDEBUGGER_LAUNCHER_QUEUE}"
-release_lock "${DEEPDEBUGGER_LAUNCHER_QUEUE}"
+release_lock "${DEEPDEBUGGER_LAUNCHER_QUEUE}" 9
 
-lock "${HOOK_QUEUE}"
+if ! lock "${HOOK_QUEUE}" 9
+then
+    LOG "Cannot lock ${HOOK_QUEUE}, exiting"
+    exit 1
+fi
 if [ ! -p "${HOOK_QUEUE}" ]; then
-    trap 'lock ${HOOK_QUEUE}; rm -f ${HOOK_QUEUE}; release_lock ${HOOK_QUEUE}' EXIT
+    trap 'lock ${HOOK_QUEUE} 9 && rm -f ${HOOK_QUEUE}; release_lock ${HOOK_QUEUE} 9' EXIT
     LOG "Creating fifo ${HOOK_QUEUE}"
     mkfifo "${HOOK_QUEUE}"
 fi
-release_lock "${HOOK_QUEUE}"
+release_lock "${HOOK_QUEUE}" 9
 
 LOG "Waiting on ${HOOK_QUEUE}"
 IFS= read -r LINE < "${HOOK_QUEUE}"
@@ -21,24 +21,29 @@ then
     shift
 fi
 
+# Locks are flock(1)s on a descriptor (second argument) open on <file>.lck, so a
+# killed holder never blocks anyone: the kernel drops the lock along with the descriptor.
+# The same file the native tools lock (cpp/include/lock.h). Fails after 5 s.
 lock () {
-    while ! mkdir -p "$1".lock 2>/dev/null
-    do
-        sleep .005
-    done
+    eval "exec $2>>\"\$1\".lck"
+    if ! flock -w 5 "$2"; then
+        eval "exec $2>&-"
+        return 1
+    fi
 }
 
 release_lock() {
-    rm -rf "$1".lock 2>/dev/null
+    eval "exec $2>&-"
 }
 
 LOG() {
     if [ -n "${LOGFILE}" ]
     then
-        lock "${LOGFILE}"
+        # Better an interleaved line than a process stuck on its log, as in the native tools
+        lock "${LOGFILE}" 8
         TIMESTAMP=$(date +"%4Y-%m-%d %H:%M:%S.%N"|cut -b -23)
         echo "[${TIMESTAMP}] ${PROCNAME} [$$] $1" >> "${LOGFILE}"
-        release_lock "${LOGFILE}"
+        release_lock "${LOGFILE}" 8
     fi
 }
 
@@ -46,7 +51,10 @@ LOG "Logging started"
 LOG "Command line: ${CMDLINE}"
 
 if [ -n "${STOP}" ]; then
-    lock "${PIPE}"
+    if ! lock "${PIPE}" 9; then
+        LOG "Cannot lock ${PIPE}, exiting"
+        exit 1
+    fi
     if [ ! -p "${PIPE}" ]; then
         LOG "${PIPE} does not exist or is not a pipe, exiting"
     else
@@ -57,16 +65,23 @@ if [ -n "${STOP}" ]; then
             rm "${PIPE}"
         fi
     fi
-    release_lock "${PIPE}"
+    release_lock "${PIPE}" 9
     exit 0
 fi
 
-release_lock "${PIPE}"
-lock "${PIPE}"
+if ! lock "${PIPE}" 9; then
+    LOG "Cannot lock ${PIPE}, exiting"
+    exit 1
+fi
 LOG "Creating ${PIPE}"
-trap 'lock ${PIPE}; rm -f ${PIPE}; release_lock ${PIPE}' EXIT
-mkfifo "${PIPE}"
-release_lock "${PIPE}"
+trap 'lock ${PIPE} 9 && rm -f ${PIPE}; release_lock ${PIPE} 9' EXIT
+# Made aside and renamed into place, so the queue appears whole
+mkfifo "${PIPE}.$$"
+mv -f "${PIPE}.$$" "${PIPE}"
+release_lock "${PIPE}" 9
+
+# The extension starts the debuggee once the queue is there
+printf "%s" "ready|$$|end"
 
 while true; do
     LOG "Waiting on ${PIPE}"
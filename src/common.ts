@@ -1,7 +1,7 @@
 
+import * as cp from 'child_process';
 import * as fs from 'fs';
 import * as path from 'path';
-import * as cp from 'child_process';
 
 import * as vscode from 'vscode';
 import { LoggingDebugSession } from 'vscode-debugadapter';
@@ -21,30 +21,102 @@ export function setExtensionContext(context: vscode.ExtensionContext) {
 	extensionContext = context;
 }
 
-function sleep(ms) {
+// Cross-process lock on <fname>.lck, the one the native tools (cpp/include/lock.h) and the shell
+// scripts take. Node cannot lock a byte range, so a helper process takes the lock and holds it
+// for the extension: lock --hold on Windows, flock(1) elsewhere. The lock is released through the
+// function this resolves to, or by the system if the extension dies; undefined if it could not be
+// taken within timeoutMs.
+export function getLock(platform: IPlatform, fname: string, timeoutMs: number = 5000): Promise<(() => void) | undefined> {
 	return new Promise((resolve) => {
-	  setTimeout(resolve, ms);
+		var [command, ...args] = platform.lockHolder(fname, timeoutMs);
+		var holder = cp.spawn(command, args, {stdio: ['pipe', 'pipe', 'ignore']});
+		holder.stdout.once('data', () => resolve(() => holder.stdin.end()));
+		holder.once('error', () => resolve(undefined));
+		holder.once('exit', () => resolve(undefined));
 	});
 }
 
-export async function getLock(fname: string) {
-	while (true) {
-		try {
-			fs.mkdirSync(fname + '.lock', { recursive: true });
-			break;
+// Launch type of a program from its first bytes, for requests that carry none (the shell hooks);
+// the same rules as the native hook's (cpp/include/sniff.h, keep the two in step), cached by inode and modification time
+var sniffCache = new Map<string, {mtimeMs: number, type: string | undefined}>();
+
+function interpreterType(interpreter: string) {
+	var name = path.parse(interpreter).name.toLowerCase();
+	if (name.startsWith('python') || name === 'pypy' || name === 'pypy3') {
+		return 'python';
+	}
+	if (name === 'node' || name === 'nodejs') {
+		return 'node';
+	}
+	if (name === 'sh' || name === 'bash' || name === 'dash') {
+		return 'bashdb';
+	}
+	return undefined;
+}
+
+function sniffHeader(program: string, header: Buffer) {
+	if (header.toString('latin1', 0, 2) === 'MZ') {
+		// not a DLL, assumed an executable when the PE header is out of reach
+		var pe = header.length >= 0x40 ? header.readUInt32LE(0x3c) : 0;
+		if (pe + 24 <= header.length && header.toString('latin1', pe, pe + 4) === 'PE\0\0' && (header.readUInt16LE(pe + 22) & 0x2000)) {
+			return undefined;
 		}
-		catch (e) {
-			await sleep(5);
+		return 'binary';
+	}
+	if (header.length >= 20 && header.readUInt32BE(0) === 0x7f454c46) {
+		// executables and shared objects, which position independent executables are
+		var elfType = header[5] === 2 ? header.readUInt16BE(16) : header.readUInt16LE(16);
+		return elfType === 2 || elfType === 3 ? 'binary' : undefined;
+	}
+	if (header.toString('latin1', 0, 2) === '#!') {
+		var words = header.toString('latin1', 2).split('\n')[0].trim().split(/[ \t\r]+/);
+		var i = 0;
+		if (path.basename(words[0]) === 'env') {
+			for (i = 1; i < words.length && (words[i].startsWith('-') || words[i].includes('=')); ++i) {
+			}
 		}
+		return interpreterType(words[i] ?? '');
+	}
+	var ext = path.extname(program).toLowerCase();
+	// bytecode: a version-specific magic number, then "\r\n"
+	if (header.length >= 4 && header.toString('latin1', 2, 4) === '\r\n' && ext === '.pyc') {
+		return 'python';
 	}
+	switch (ext) {
+		case '.py':
+		case '.pyw':
+			return 'python';
+		case '.js':
+		case '.mjs':
+		case '.cjs':
+			return 'node';
+		case '.sh':
+			return 'bashdb';
+	}
+	return undefined;
 }
 
-export function releaseLock(fname: string) {
+export function sniffConfigType(program: string) {
 	try {
-		fs.rmdirSync(fname + '.lock');
+		var stats = fs.statSync(program);
+		var key = stats.dev + ':' + stats.ino;
+		var cached = sniffCache.get(key);
+		if (cached && cached.mtimeMs === stats.mtimeMs) {
+			return cached.type;
+		}
+		var header = Buffer.alloc(512);
+		var fd = fs.openSync(program, 'r');
+		try {
+			var type = sniffHeader(program, header.subarray(0, fs.readSync(fd, header, 0, header.length, 0)));
+		}
+		finally {
+			fs.closeSync(fd);
+		}
+		sniffCache.set(key, {mtimeMs: stats.mtimeMs, type: type});
+		return type;
 	}
 	catch (e) {
-		// do nothing
+		return undefined;
 	}
 }
 
@@ -53,8 +125,14 @@ export class IPlatform {
 	pipePrefix: string = '';
 	envSetCommand: string = '';
 	listSeparator: string = '';
+	// the request encoding the platform's hooks and server can carry, advertised in DEEPDEBUGGER_PROTOCOL
+	protocolVersion: number = 1;
+	// runs a command with the hook supervising its process tree (cpp/hook/supervisor.h), empty where there is none
+	superviseSwitch: string = '';
 	public isNode(f) { return false; };
 	public makeExecutable(fpath) { return path.join(getExtensionPath(), fpath + this.exeSuffix); }
+	// command line of a process holding <fname>.lck until its stdin is closed, see getLock
+	public lockHolder(fname: string, timeoutMs: number) { return [this.makeExecutable('lock'), '--timeout', String(timeoutMs), '--hold', fname]; }
 	public setBinaryConfigType(cfg) {}
 	public setConfigType(cfg) {}
 	public quote(s: string) { return s; }
@@ -67,6 +145,8 @@ export class PlatformWin32 extends IPlatform {
 		this.pipePrefix = '\\\\?\\pipe\\';
 		this.envSetCommand = 'set';
 		this.listSeparator = ';';
+		this.protocolVersion = 2;
+		this.superviseSwitch = '--deep-debugger-supervise';
 	}
 	public isNode(f) { return f.toLowerCase() === 'node.exe'; };
 	public setBinaryConfigType(cfg) {
@@ -104,6 +184,9 @@ export class Platform extends IPlatform {
 		}
 		return fpath;
 	};
+	public lockHolder(fname: string, timeoutMs: number) {
+		return ['flock', '-w', String(timeoutMs / 1000), fname + '.lck', 'sh', '-c', 'echo locked; cat > /dev/null'];
+	}
 	public setBinaryConfigType(cfg) {
 		cfg.type = 'cppdbg';
 		cfg.MIMode = 'gdb';
@@ -116,15 +199,9 @@ export class Platform extends IPlatform {
 		];
 	}
 	public setConfigType(cfg) {
-		var result = cp.execSync('file -b ' + cfg.program).toString().split(', ')[0];
-		switch (result) {
-			case 'ELF 64-bit LSB shared object':
-				cfg.type = 'binary';
-				break;
-			case 'POSIX shell script':
-			case 'Bourne-Again shell script':
-				cfg.type = 'bashdb';
-				break;
+		var type = sniffConfigType(cfg.program);
+		if (type) {
+			cfg.type = type;
 		}
 	}
 	public quote(s: string) {
@@ -151,4 +228,7 @@ export class DeepDebugSessionBase extends LoggingDebugSession {
 
     public decodeEnvironment(cfg) {
     }
+
+    public log(data: string) {
+    }
 };
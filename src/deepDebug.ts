@@ -19,12 +19,11 @@ import {
     deepDebuggerSessionNameSwitch,
     deepDebuggerSessionCwdSwitch,
 	deepDebuggerLogFileSwitch,
-	DeepDebugSessionBase,
-	getLock,
-	releaseLock
+	DeepDebugSessionBase
 } from './common';
 
 import * as python from './python';
+import { decompressBlock } from './lz4';
 
 const envNameSessionId = 'DEEPDEBUGGER_SESSION_ID';
 const envNameParentSessionId = 'DEEPDEBUGGER_PARENT_SESSION_ID';
@@ -62,10 +61,20 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 	private _configurationDone = new Subject();
 
 	private server: any = undefined;
+	private serverReady: (() => void) | undefined;
+	private launcherQueue: string = '';
+
+	// with a server that keeps the session tree (cpp/server/sessions.h): the sessions of this
+	// launch, those the server has stopped along with an ancestor, and the root launches the
+	// user stopped before they were over
+	private serverSessions: boolean = false;
+	private sessions = new Set<string>();
+	private cascaded = new Set<string>();
+	private stoppedRoots = new Set<string>();
 
 	public deepDbgSettings = vscode.workspace.getConfiguration('deepdbg');
 	public logfile;
-	public logLock;
+	public tracefile;
 
 	/**
 	 * Creates a new debug adapter that is used for one debug session.
@@ -77,16 +86,27 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 		var logfile = this.deepDbgSettings.get<string>('logfile');
 		if (logfile) {
 			this.logfile = path.join(tempName.dir, "DeepDebugger", logfile);
-			this.logLock = this.logfile + '.lock';
-			releaseLock(this.logfile); // just in case
-			getLock(this.logfile);
 			try {
 				fs.unlinkSync(this.logfile);
 			}
 			catch (e) {
 				//
 			}
-			releaseLock(this.logfile);
+		}
+
+		var tracefile = this.deepDbgSettings.get<string>('traceFile');
+		if (tracefile) {
+			// the native processes append to the same file, each under its lock
+			this.tracefile = path.resolve(path.join(tempName.dir, "DeepDebugger"), tracefile);
+			try {
+				fs.mkdirSync(path.dirname(this.tracefile), { recursive: true });
+				fs.writeFileSync(this.tracefile, '[\n');
+				this.trace([{ name: 'process_name', ph: 'M', pid: process.pid, args: { name: 'extension' } }]);
+			}
+			catch (e: any) {
+				this.log('Cannot open trace file ' + this.tracefile + ': ' + e.message);
+				this.tracefile = undefined;
+			}
 		}
 
 		vscode.debug.onDidStartDebugSession(session => {
@@ -100,29 +120,66 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 				delete DeepDebugSession.sessionDict[session.configuration[propNameSessionId]];
 			}
 			if (session.configuration.hasOwnProperty('deepDbgHookPipe')) {
-				this.stopServer(session.configuration.deepDbgHookPipe);
+				this.onSessionTerminated(session.configuration);
 				delete session.configuration.deepDbgHookPipe;
 			}
 		});
+
+		// a disconnect or terminate request before the debuggee has exited is the user stopping it
+		vscode.debug.registerDebugAdapterTrackerFactory('*', {
+			createDebugAdapterTracker: session => {
+				var id = session.configuration[propNameSessionId];
+				if (!id || session.configuration.deepDbgHookPipe !== this.launcherQueue) {
+					return undefined;
+				}
+				var over = false;
+				return {
+					onDidSendMessage: message => {
+						if (message.type === 'event' && (message.event === 'exited' || message.event === 'terminated')) {
+							over = true;
+						}
+					},
+					onWillReceiveMessage: message => {
+						if (!over && message.type === 'request' && (message.command === 'disconnect' || message.command === 'terminate')) {
+							this.stoppedRoots.add(id);
+						}
+					},
+				};
+			}
+		});
 	}
 
 	public log(data: string) {
 		if (this.logfile) {
-			getLock(this.logfile);
+			// a single appending write, which does not interleave with the native processes' lines
 			var timestamp = DateTime.now().toISO().replace('T', ' ').replace(/-\d{2}:\d{2}/, '');
 			var log = fs.openSync(this.logfile, 'as'); // appending, in sync mode
 			fs.writeFileSync(log, '[' + timestamp + '] [DeepDebugSession] ' + data + '\n');
 			fs.closeSync(log);
-			releaseLock(this.logfile);
 		}
 	}
 
-	protected stopServer(pipeName: string) {
+	// Appends Chrome trace events, stamped with process.hrtime, the clock the native processes use too
+	public trace(events: object[]) {
+		if (this.tracefile) {
+			fs.appendFileSync(this.tracefile, events.map(e => JSON.stringify(e) + ',\n').join(''));
+		}
+	}
+
+	protected traceNowUs() {
+		var [sec, nsec] = process.hrtime();
+		return sec * 1000000 + nsec / 1000;
+	}
+
+	protected stopServer(pipeName: string, message: string = 'stopped') {
 		var serverExe = this.platform.makeExecutable(SERVER_NAME);
-		var serverArgs = [pipeName, 'stopped'];
+		var serverArgs = [pipeName, message];
 		if (this.logfile) {
 			serverArgs = serverArgs.concat([deepDebuggerLogFileSwitch, this.logfile]);
 		}
+		if (this.tracefile) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'trace', this.tracefile]);
+		}
 		return cp.spawnSync(serverExe, serverArgs);
 	}
 
@@ -132,6 +189,58 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 		if (this.logfile) {
 			serverArgs = serverArgs.concat([deepDebuggerLogFileSwitch, this.logfile]);
 		}
+		var outputPolicy = this.deepDbgSettings.get<string>('outputPolicy');
+		if (outputPolicy) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'output-policy', outputPolicy]);
+		}
+		var outputQueue = this.deepDbgSettings.get<number>('outputQueue');
+		if (outputQueue) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'output-queue', String(outputQueue)]);
+		}
+		var captureFile = this.deepDbgSettings.get<string>('captureFile');
+		if (captureFile) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'capture', captureFile]);
+		}
+		if (this.tracefile) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'trace', this.tracefile]);
+		}
+		var metricsFile = this.deepDbgSettings.get<string>('metricsFile');
+		if (metricsFile) {
+			// a *.prom file in the node exporter's textfile collector directory
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'metrics-file', metricsFile]);
+			var metricsInterval = this.deepDbgSettings.get<number>('metricsInterval');
+			if (metricsInterval) {
+				serverArgs = serverArgs.concat([deepDebuggerPrefix + 'metrics-interval', String(metricsInterval)]);
+			}
+		}
+		var batchWindow = this.deepDbgSettings.get<number>('batchWindow');
+		if (batchWindow) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'batch-window', String(batchWindow)]);
+			var batchSize = this.deepDbgSettings.get<number>('batchSize');
+			if (batchSize) {
+				serverArgs = serverArgs.concat([deepDebuggerPrefix + 'batch-size', String(batchSize)]);
+			}
+		}
+		var serverWorkers = this.deepDbgSettings.get<number>('serverWorkers');
+		if (serverWorkers) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'workers', String(serverWorkers)]);
+		}
+		var memoryCap = this.deepDbgSettings.get<number>('serverMemoryCap');
+		if (memoryCap !== undefined) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'memory-cap', String(memoryCap)]);
+		}
+		var maxFrame = this.deepDbgSettings.get<number>('maxRequestSize');
+		if (maxFrame) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'max-frame', String(maxFrame)]);
+		}
+		var scheduleDepth = this.deepDbgSettings.get<number>('scheduleDepth');
+		if (scheduleDepth) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'schedule-depth', String(scheduleDepth)]);
+		}
+		var bulkDepth = this.deepDbgSettings.get<number>('bulkDepth');
+		if (bulkDepth) {
+			serverArgs = serverArgs.concat([deepDebuggerPrefix + 'bulk-depth', String(bulkDepth)]);
+		}
 		return cp.spawn(serverExe, serverArgs);
 	}
 
@@ -161,8 +270,11 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 		}
 	}
 
-	protected getHook(mode, block: boolean = true) {
+	protected getHook(mode, block: boolean = true, priority?: string) {
 		var hookPath = this.platform.makeExecutable('hook');
+		if (priority) {
+			return hookPath + ' ' + deepDebuggerPrefix + 'priority ' + priority + ' ';
+		}
 		return hookPath + ' ';
 	}
 
@@ -208,8 +320,10 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 
 	public decodeEnvironment(cfg) {
 		var curSessionId;
-		var cfgEnv = cfg.environment.split('-').map(x => {
-			var u = Buffer.from(x, DeepDebugSession.inEnc).toString(DeepDebugSession.outEnc);
+		var vars: string[] = Array.isArray(cfg.environment) ? cfg.environment : cfg.environment.split('-').map(x => {
+			return Buffer.from(x, DeepDebugSession.inEnc).toString(DeepDebugSession.outEnc);
+		});
+		var cfgEnv = vars.map(u => {
 			var i = u.indexOf('=');
 			if (i <= 0) {
 				return u;
@@ -218,8 +332,8 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 			var value = u.substring(i + 1);
 			if (name === envNameSessionId) {
 				curSessionId = value;
-				value = DeepDebugSession.sessionID.toString();
-				++DeepDebugSession.sessionID;
+				// a server that keeps the session tree has numbered the session already
+				value = cfg[propNameSessionId] ?? String(DeepDebugSession.sessionID++);
 				cfg[propNameSessionId] = value;
 			}
 			return {name: name, value: value};
@@ -250,6 +364,7 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 		return cfgEnv;
 	}
 
+	// The native hook sends an absolute program (cpp/include/pathcache.h), this covers the other senders
 	protected resolveCfgProgram(cfg) {
 		if (!path.isAbsolute(cfg.program)) {
 			cfg.program = path.join(cfg.cwd, cfg.program);
@@ -272,12 +387,51 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 		}
 	}
 
+	// Protocol 2 requests: a JSON header, a NUL and the length-prefixed working directory,
+	// parameters, arguments and environment, see cpp/include/utils.h
+	protected parseRequest(param: string) {
+		var nul = param.indexOf('\0');
+		if (nul < 0) {
+			return JSON.parse(param);
+		}
+		var cfg = JSON.parse(param.substring(0, nul));
+		var blocks = param.substring(nul + 1);
+		if (cfg.deepDbgCodec === 'lz4') {
+			blocks = decompressBlock(Buffer.from(blocks, 'latin1'), Number(cfg.deepDbgRawSize)).toString('latin1');
+		}
+		var pos = 0;
+		var block = () => {
+			var colon = blocks.indexOf(':', pos);
+			var end = colon + 1 + Number(blocks.substring(pos, colon));
+			if (colon < 0 || end > blocks.length) {
+				throw new Error('truncated request');
+			}
+			pos = end;
+			return Buffer.from(blocks.substring(colon + 1, end), 'latin1').toString(DeepDebugSession.outEnc);
+		};
+		var strings = (data: string) => {
+			return data.split('\0').slice(0, -1);
+		};
+		cfg.cwd = block();
+		for (var p of strings(block())) {
+			var i = p.indexOf('=');
+			cfg[p.substring(0, i)] = p.substring(i + 1);
+		}
+		cfg.cmdline = strings(block());
+		cfg.environment = strings(block());
+		return cfg;
+	}
+
 	protected decodeConfig(cfg) {
 
-		cfg.cwd = Buffer.from(cfg.cwd, DeepDebugSession.inEnc).toString(DeepDebugSession.outEnc);
+		var decode = (x: string) => {
+			return cfg.deepDbgProtocol >= 2 ? x : Buffer.from(x, DeepDebugSession.inEnc).toString(DeepDebugSession.outEnc);
+		};
 
-		var args = cfg.cmdline.split('-').map(x => {
-			return this.platform.quote(Buffer.from(x, DeepDebugSession.inEnc).toString(DeepDebugSession.outEnc));
+		cfg.cwd = decode(cfg.cwd);
+
+		var args = (Array.isArray(cfg.cmdline) ? cfg.cmdline : cfg.cmdline.split('-')).map(x => {
+			return this.platform.quote(decode(x));
 		}).filter(x => {
 			return x !== '';
 		});
@@ -286,9 +440,12 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 			cfg.program = args[0];
 			cfg.args = args.slice(1);
 		} else {
-			cfg.program = Buffer.from(cfg.program, DeepDebugSession.inEnc).toString(DeepDebugSession.outEnc);
+			cfg.program = decode(cfg.program);
 			cfg.args = args;
 		}
+		if (cfg.processId) {
+			cfg.processId = Number(decode(cfg.processId));
+		}
 		delete(cfg.cmdline);
 
 		var unquote = require('unquote');
@@ -318,12 +475,13 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 		}
 
 		if (cfg.type) {
-			cfg.type = Buffer.from(cfg.type, DeepDebugSession.inEnc).toString(DeepDebugSession.outEnc);
+			cfg.type = decode(cfg.type);
 		} else if (!this.setConfigType(cfg)) {
 			this.platform.setConfigType(cfg);
 		}
 
-		cfg.request = 'launch';
+		// the process runs already when the request names it (attach-on-exec hook, python zygote)
+		cfg.request = cfg.processId ? 'attach' : 'launch';
 		cfg.stopAtEntry = false;
 		cfg.console = 'integratedTerminal';
 	}
@@ -331,7 +489,7 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 	protected onStart(param) {
 		this.log('onStart param: ' + param);
 		try {
-			var cfg = JSON.parse(param);
+			var cfg = this.parseRequest(param);
 			this.decodeConfig(cfg);
 			var parentSession: vscode.DebugSession | undefined;
 			if (this.useHierarchy) {
@@ -351,37 +509,188 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 					}
 					break;
 			}
+			if (cfg.request === 'attach') {
+				delete(cfg.args);
+				delete(cfg.environment);
+				delete(cfg.env);
+			}
 			if (confirmed) {
+				if (cfg[propNameSessionId]) {
+					this.sessions.add(cfg[propNameSessionId]);
+				}
 				this.log('onStart config: ' + JSON.stringify(cfg));
-				vscode.debug.startDebugging(undefined, cfg, parentSession);
+				var started = vscode.debug.startDebugging(undefined, cfg, parentSession);
+				if (this.tracefile && cfg.deepDbgTraceID) {
+					this.traceStart(cfg.deepDbgTraceID, started);
+				}
 			}
 		}
-		catch (e) {
-			//
+		catch (e: any) {
+			// a damaged request must not pass unnoticed, bench --soak counts them
+			this.log('onStart: cannot handle request (' + e.message + '), ' + param.length + ' characters: ' + param.substring(0, 200));
+		}
+	}
+
+	// Ends the request's flow, which the hook started, with the debug session start
+	protected traceStart(id: string, started: Thenable<boolean>) {
+		const common = { cat: 'deepdbg', pid: process.pid, tid: 0 };
+		var start = this.traceNowUs();
+		this.trace([
+			{ ...common, name: 'receive', ph: 'i', s: 't', ts: start, args: { traceId: id } },
+			{ ...common, name: 'request', ph: 'f', bp: 'e', id: '0x' + id, ts: start },
+		]);
+		var done = () => {
+			this.trace([{ ...common, name: 'startDebugging', ph: 'X', ts: start, dur: this.traceNowUs() - start, args: { traceId: id } }]);
+		};
+		started.then(done, done);
+	}
+
+	protected onBatch(seq: number, count: number, params: string[]) {
+		// a damaged frame says nothing about the numbering, only frames that add up move it on
+		if (!Number.isInteger(seq) || seq < 0 || count !== params.length) {
+			this.log('Malformed batch frame: sequence ' + seq + ', count ' + count + ', ' + params.length + ' requests');
+		}
+		else {
+			if (seq !== this.nextSequence) {
+				this.log('Batch sequence gap: expected ' + this.nextSequence + ', received ' + seq);
+			}
+			this.nextSequence = seq + params.length;
+		}
+		for (var param of params) {
+			this.onStart(param);
+		}
+	}
+
+	// The server has stopped a subtree of sessions and told their hooks, the sessions follow
+	protected onSessionsStopped(ids: string[]) {
+		this.log('Sessions stopped by the server: ' + ids.join(', '));
+		for (var id of ids) {
+			var session: vscode.DebugSession | undefined = DeepDebugSession.sessionDict[id];
+			if (session) {
+				this.cascaded.add(id);
+				vscode.debug.stopDebugging(session);
+			}
+		}
+	}
+
+	protected onSessionTerminated(cfg) {
+		var id = cfg[propNameSessionId];
+		if (!this.serverSessions) {
+			this.stopServer(cfg.deepDbgHookPipe);
+			return;
+		}
+		if (!this.sessions.delete(id)) {
+			return;
+		}
+		if (cfg.deepDbgHookPipe === this.launcherQueue) {
+			// one message stops the whole subtree, when the user stops the launch
+			if (this.stoppedRoots.delete(id)) {
+				this.stopServer(this.launcherQueue, 'stop|' + id);
+			}
+			this.stopServer(this.launcherQueue);
+		}
+		else if (!this.cascaded.delete(id)) {
+			// a session that is over takes only itself out of the tree, its children carry on
+			this.stopServer(this.launcherQueue, 'end|' + id);
+			this.stopServer(cfg.deepDbgHookPipe);
+		}
+	}
+
+	protected onHookExited(pid: number, hookPipe: string) {
+		this.log('Hook ' + pid + ' exited (' + hookPipe + ')');
+		for (var id in DeepDebugSession.sessionDict) {
+			var session: vscode.DebugSession = DeepDebugSession.sessionDict[id];
+			if (session.configuration.deepDbgHookPipe === hookPipe) {
+				// the hook will never be told the session is over, it is gone
+				delete session.configuration.deepDbgHookPipe;
+				vscode.debug.stopDebugging(session);
+			}
 		}
 	}
 
 	responce: string = '';
+	nextSequence: number = 0;
 
-	protected onMessage(commandString: string) {
+	// Takes the first complete frame off the buffer and splits it into fields, undefined while it is
+	// incomplete. A field '=<n>' announces a protocol 2 request of n characters, which may contain anything.
+	protected nextFrame(): string[] | undefined {
 		const SPLIT_CHAR = '|';
-		this.responce += commandString;
-		if (!commandString.endsWith(SPLIT_CHAR + 'end')) {
-			return;
+		const END_MARK = 'end';
+		var s = this.responce;
+		var fields: string[] = [];
+		var pos = 0;
+		while (pos < s.length && s.charCodeAt(pos) <= 32) {
+			++pos;
 		}
-		var commandArray = this.responce.trim().split(SPLIT_CHAR);
-		this.responce = '';
-		if (commandArray.length >= 1) {
-			var param = commandArray[1];
+		while (true) {
+			if (fields.length && s.startsWith(END_MARK, pos)) {
+				this.responce = s.substring(pos + END_MARK.length);
+				return fields;
+			}
+			var sep = s.indexOf(SPLIT_CHAR, pos);
+			if (sep < 0) {
+				return undefined;
+			}
+			var field = s.substring(pos, sep);
+			pos = sep + 1;
+			if (fields.length && field.startsWith('=')) {
+				var end = pos + Number(field.substring(1));
+				if (end >= s.length) {
+					return undefined;
+				}
+				field = s.substring(pos, end);
+				pos = end + 1;
+			}
+			fields.push(field);
+		}
+	}
+
+	protected onMessage(commandString: string) {
+		this.responce += commandString;
+		// one chunk may carry several frames, the last one possibly incomplete
+		for (var commandArray = this.nextFrame(); commandArray; commandArray = this.nextFrame()) {
 			switch (commandArray[0]) {
 				case 'start':
-					this.onStart(param);
+					++this.nextSequence;
+					this.onStart(commandArray[1]);
+					break;
+				case 'batch':
+					this.onBatch(Number(commandArray[1]), Number(commandArray[2]), commandArray.slice(3));
+					break;
+				case 'ready':
+					this.log('Server ' + commandArray[1] + ' is listening');
+					this.serverSessions = commandArray.indexOf('sessions', 2) >= 0;
+					this.serverReady?.();
+					break;
+				case 'stopped':
+					this.onSessionsStopped(commandArray[1].split(','));
+					break;
+				case 'stats':
+					this.log('Server stats: ' + commandArray[1]);
+					break;
+				case 'exited':
+					this.onHookExited(Number(commandArray[1]), commandArray[2]);
 					break;
 			}
 		}
 	}
 
-	protected launchDebugeeConfig(args: ILaunchRequestArguments) {
+	// Resolves to true on the server's ready frame, to false once timeoutMs have passed without it
+	protected waitServerReady(timeoutMs: number) {
+		return new Promise<boolean>(resolve => {
+			var timer = setTimeout(() => {
+				this.serverReady = undefined;
+				resolve(false);
+			}, timeoutMs);
+			this.serverReady = () => {
+				clearTimeout(timer);
+				this.serverReady = undefined;
+				resolve(true);
+			};
+		});
+	}
+
+	protected async launchDebugeeConfig(args: ILaunchRequestArguments) {
 
 		const pipeName = args['messageQueueName']??('deepdbg-lque-' + randomBytes(10).toString('hex'));
 		var tempLauncherQueuePath = this.platform.pipePrefix + path.join(tempName.dir, "DeepDebugger", pipeName);
@@ -389,23 +698,72 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 		this.useHierarchy = this.deepDbgSettings.get<boolean>('debugSessionsHierarchy') ?? false;
 
 		this.stopServer(tempLauncherQueuePath);
+		this.launcherQueue = tempLauncherQueuePath;
 		this.server = this.launchServer(tempLauncherQueuePath);
+		var ready = this.waitServerReady(this.deepDbgSettings.get<number>('serverReadyTimeout') ?? 5000);
 		this.server.stdout.on('data', d => { this.onMessage(d.toString('latin1')); });
 
+		// hooks wait for the queue too, but the first children of a session should not have to
+		if (!await ready) {
+			this.log('No ready frame from the server, starting the debuggee anyway');
+		}
+
 		try {
+			// nobody waits on the non-blocking hooks, their requests go last when the server is busy
+			const priorities = args['hookPriorities'] ?? {};
+			const priority = (name: string, fallback?: string) => priorities[name] ?? fallback;
+			const defaultHook = args['defaultHook']??'DEEPDBG';
+			const pythonHook = args['pythonHook']??'DEEPDBG_PYTHON';
+			const cppHook = args['cppHook']??'DEEPDBG_CPP';
+			const cppHookNoBlock = args['cppHookNoBlock']??'DEEPDBG_CPP_NB';
+			const bashHook = args['bashHook']??'DEEPDBG_BASH';
+			const bashHookNoBlock = args['bashHookNoBlock']??'DEEPDBG_BASH_NB';
+			const spawnHook = args['spawnHook']??'DEEPDBG_SPAWN';
 			var env = [
 				{name: 'DEEPDEBUGGER_LAUNCHER_QUEUE', value: tempLauncherQueuePath},
-				{name: args['defaultHook']??'DEEPDBG', value: this.getHook('default')},
-				{name: args['pythonHook']??'DEEPDBG_PYTHON', value: this.getHook('py')},
-				{name: args['cppHook']??'DEEPDBG_CPP', value: this.getHook('cpp')},
-				{name: args['cppHookNoBlock']??'DEEPDBG_CPP_NB', value: this.getHook('cpp', false)},
-				{name: args['bashHook']??'DEEPDBG_BASH', value: this.getHook('bash')},
-				{name: args['bashHookNoBlock']??'DEEPDBG_BASH_NB', value: this.getHook('bash', false)},
-				{name: args['spawnHook']??'DEEPDBG_SPAWN', value: this.getHook('spawn')},
+				{name: 'DEEPDEBUGGER_SERVER_PID', value: String(this.server.pid)},
+				{name: 'DEEPDEBUGGER_PROTOCOL', value: String(this.platform.protocolVersion)},
+				{name: defaultHook, value: this.getHook('default', true, priority(defaultHook))},
+				{name: pythonHook, value: this.getHook('py', true, priority(pythonHook))},
+				{name: cppHook, value: this.getHook('cpp', true, priority(cppHook))},
+				{name: cppHookNoBlock, value: this.getHook('cpp', false, priority(cppHookNoBlock, 'bulk'))},
+				{name: bashHook, value: this.getHook('bash', true, priority(bashHook))},
+				{name: bashHookNoBlock, value: this.getHook('bash', false, priority(bashHookNoBlock, 'bulk'))},
+				{name: spawnHook, value: this.getHook('spawn', true, priority(spawnHook))},
 			];
+			if (this.platform.superviseSwitch) {
+				env = env.concat([{name: args['superviseHook']??'DEEPDBG_SUPERVISE', value: this.getHook('supervise') + this.platform.superviseSwitch + ' '}]);
+			}
 			if (this.logfile) {
 				env = env.concat([{name: 'DEEPDEBUGGER_LOGFILE', value: this.logfile}]);
 			}
+			if (args['rules']) {
+				env = env.concat([{name: 'DEEPDEBUGGER_RULES', value: args['rules']}]);
+			}
+			if (args['compressThreshold']) {
+				env = env.concat([{name: 'DEEPDEBUGGER_COMPRESS', value: String(args['compressThreshold'])}]);
+			}
+			if (args['connectTimeout'] !== undefined) {
+				env = env.concat([{name: 'DEEPDEBUGGER_CONNECT_TIMEOUT', value: String(args['connectTimeout'])}]);
+			}
+			if (args['requestDeadline']) {
+				env = env.concat([{name: 'DEEPDEBUGGER_DEADLINE', value: String(args['requestDeadline'])}]);
+			}
+			if (args['sharedMemoryThreshold']) {
+				env = env.concat([{name: 'DEEPDEBUGGER_SHARED_MEMORY', value: String(args['sharedMemoryThreshold'])}]);
+			}
+			if (args['attachOnExec']) {
+				env = env.concat([{name: 'DEEPDEBUGGER_ATTACH_ON_EXEC', value: '1'}]);
+			}
+			if (args['pythonZygote']) {
+				env = env.concat([{name: 'DEEPDEBUGGER_PYTHON_ZYGOTE', value: '1'}]);
+				if (args['pythonPreload']) {
+					env = env.concat([{name: 'DEEPDEBUGGER_PYTHON_PRELOAD', value: args['pythonPreload']}]);
+				}
+			}
+			if (this.tracefile) {
+				env = env.concat([{name: 'DEEPDEBUGGER_TRACE', value: this.tracefile}]);
+			}
 			if (args.hasOwnProperty('environment')) {
 				env = env.concat(args['environment']);
 			}
@@ -417,13 +775,14 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 				cfgData.cfg.deepDbgHookPipe = tempLauncherQueuePath;
 
 				if (cfgData.cfg.type === 'python' && cfgData.cfg.request === 'launch') {
-					python.makeBinConfig(cfgData.cfg, cfgData.wf, this);
+					await python.makeBinConfig(cfgData.cfg, cfgData.wf, this);
 					if (this.logfile) {
 						cfgData.cfg.args = cfgData.cfg.args.concat([deepDebuggerLogFileSwitch, this.logfile]);
 					}
 				}
 
 				this.setConfigEnvironment(cfgData.cfg, env);
+				this.sessions.add(cfgData.cfg[propNameSessionId]);
 
 				this.log(JSON.stringify(cfgData));
 				vscode.debug.startDebugging(cfgData.wf, cfgData.cfg);
@@ -546,7 +905,7 @@ export class DeepDebugSession extends DeepDebugSessionBase {
 		await this._configurationDone.wait(1000);
 
 		// start the program in the runtime
-		this.launchDebugeeConfig(args);
+		await this.launchDebugeeConfig(args);
 
 		this.sendResponse(response);
 	}
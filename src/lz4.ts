@@ -0,0 +1,51 @@
+// Decoder of the LZ4 block format, for requests whose blocks the hook compressed (cpp/include/lz4.h)
+export function decompressBlock(block: Buffer, rawSize: number) {
+	var out = Buffer.alloc(rawSize);
+	var ip = 0;
+	var op = 0;
+	var damaged = () => new Error('damaged compressed block');
+	// 15 in the token, then bytes of 255 and a final one below it
+	var length = (len: number) => {
+		if (len === 15) {
+			var b: number;
+			do {
+				if (ip >= block.length) {
+					throw damaged();
+				}
+				b = block[ip++];
+				len += b;
+			} while (b === 255);
+		}
+		return len;
+	};
+	while (ip < block.length) {
+		var token = block[ip++];
+		var literals = length(token >> 4);
+		if (ip + literals > block.length || op + literals > rawSize) {
+			throw damaged();
+		}
+		block.copy(out, op, ip, ip + literals);
+		ip += literals;
+		op += literals;
+		if (ip === block.length) {
+			break;
+		}
+		if (ip + 2 > block.length) {
+			throw damaged();
+		}
+		var offset = block[ip] | block[ip + 1] << 8;
+		ip += 2;
+		var match = length(token & 15) + 4;
+		if (!offset || offset > op || op + match > rawSize) {
+			throw damaged();
+		}
+		// overlapping copies repeat the last offset bytes
+		for (var end = op + match; op < end; ++op) {
+			out[op] = out[op - offset];
+		}
+	}
+	if (op !== rawSize) {
+		throw damaged();
+	}
+	return out;
+}
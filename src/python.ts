@@ -13,8 +13,7 @@ import {
     deepDebuggerSessionCwdSwitch,
     DeepDebugSessionBase,
     getExtensionPath,
-	getLock,
-	releaseLock
+	getLock
 } from './common';
 
 function getPythonPath(): string {
@@ -86,7 +85,7 @@ function getInterpreter(pythonPathIn) {
     return {path: pythonPath, version: version};
 }
 
-function cloneDriver(origPythonPath: string, session: DeepDebugSessionBase): string {
+async function cloneDriver(origPythonPath: string, session: DeepDebugSessionBase): Promise<string> {
     var tempPath = path.join(os.tmpdir(), 'DeepDebugger', PYTHON);
     var extensionPath = getExtensionPath();
     var parcedExtDir = path.parse(extensionPath);
@@ -116,8 +115,11 @@ function cloneDriver(origPythonPath: string, session: DeepDebugSessionBase): str
     }
 
     var tempDriverPath = path.join(tempDriverDir, parcedPythonPath.base);
+    var release = await getLock(platform, tempDriverDir);
+    if (!release) {
+        session.log('Cannot lock ' + tempDriverDir + ', using the driver as it is');
+    }
     try {
-        getLock(tempDriverDir);
         var driverNeedsUpdate = !fs.existsSync(tempDriverPath);
         if (!driverNeedsUpdate) {
             var stat1 = fs.statSync(driverFileName);
@@ -126,17 +128,17 @@ function cloneDriver(origPythonPath: string, session: DeepDebugSessionBase): str
                 driverNeedsUpdate = true;
             }
         }
-        if (driverNeedsUpdate) {
+        if (driverNeedsUpdate && release) {
             fs.copyFileSync(driverFileName, tempDriverPath);
         }
-        releaseLock(tempDriverDir);
     } catch (e) {
         //
     }
+    release?.();
     return tempDriverPath;
 }
 
-export function makeBinConfig(cfg, wf, session: DeepDebugSessionBase) {
+export async function makeBinConfig(cfg, wf, session: DeepDebugSessionBase) {
     const DEFAULT_PYTHON_PATH = PYTHON;
     function notSet(pythonPath) {
         return !pythonPath || pythonPath === DEFAULT_PYTHON_PATH;
@@ -163,7 +165,7 @@ export function makeBinConfig(cfg, wf, session: DeepDebugSessionBase) {
         origPythonPath = hasbin.sync(DEFAULT_PYTHON_PATH);
     }
 
-    cfg.python = cloneDriver(origPythonPath, session);
+    cfg.python = await cloneDriver(origPythonPath, session);
 
     if (!cfg.args) {
         cfg.args = Array();